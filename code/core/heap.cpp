@@ -2,18 +2,103 @@
 
 #include "precompiled.h"
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <bitset>
 #include "core/heap.h"
+#include "core/page_provider.h"
+#include "core/heap_trace.h"
+#include "core/heap_profiler.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 // Configuration
 #define REGION_PAGE_SIZE        (1<<20)					// Size of pages used by region allocator
-#define POOL_PAGE_SIZE			(1<<17)					// Size of pages used by pool allocator
+#define POOL_PAGE_SIZE			(1<<17)					// Size of pages used by pool allocator; pages are aligned to this size
+#define POOL_RESERVE_SIZE		((size_t)1<<36)			// Size of address space reserved for pool pages
+#define TRANSIENT_CHUNK_SIZE	(1<<20)					// Size of chunks used by transient buffers
+#define PERMANENT_RESERVE_SIZE	((size_t)1<<32)			// Size of address space reserved for permanent allocations
+#define PERMANENT_CHUNK_SIZE	(1<<20)					// Size of chunks in which permanent memory is committed
+#define PERMANENT_ALIGNMENT		(8)						// Alignment of permanent allocations
+#define TRANSIENT_ALIGNMENT		(16)					// Alignment of transient allocations
+#define PAGE_HEADER_SIZE		(4096)					// Leading bytes of a page kept committed when the page is decommitted
 #define REGION_MIN_FREE			(64)					// Minimum size in bytes of a free element in a RegionAllocator
 #define MEMORY_SENTINEL			(0x6F6F6F6F6F6F6F6F)	// Test for buffer overrun/underrun
 #define FILL_VALUE				(0xE1)					// Value used for fill on free
+#define FILL_POINTER			((Page*)0xE1E1E1E1E1E1E1E1)	// Page pointer read from memory that has been filled
+#define POOL_MAGAZINE_SIZE		(64)					// Maximum number of free elements a thread caches for each pool
+#define POOL_CACHE_SLOTS		(256)					// Number of per-thread magazine slots shared between pools
+#define POOL_FREE_LABEL			(0xFF)					// Label of a freed pool element; no tag and hint make this value
+#define POOL_OCCUPANCY_BINS		(8)						// Number of lists into which a pool sorts its partial pages by occupancy
+#define POOL_MAX_ALIGNMENT		(64)					// Greatest alignment of pool elements; greater alignments use the region allocator
+#define GUARD_SLOT_COUNT		(256)					// Number of slots that serve guarded allocations
+#define GUARD_SLOT_SIZE			(4096)					// Size of a guarded slot and of the guard page that follows it
+#define GUARD_FILL				(0xA7)					// Value written to the unused bytes of a guarded slot
+#define PROMOTE_MAX_SIZE		(1024)					// Largest DEFAULT allocation that may be promoted to a pool
+#define PROMOTE_SAMPLE_RATE		(64)					// Average number of DEFAULT allocations per lifetime sample
+#define PROMOTE_MAX_SAMPLES		(4096)					// Number of lifetime samples that can be live at once
+#define PROMOTE_WINDOW			(64)					// Number of freed samples of a size class on which promotion is decided
+#define PROMOTE_HOT_MS			(10000)					// Longest time in which a window must fill for its class to be hot
+#define PROMOTE_LIFETIME_MS		(100)					// Samples freed within this many milliseconds are short-lived
+#define PROMOTE_SHORT_PERCENT	(75)					// Percentage of a window that must be short-lived to promote its class
+#define PROMOTE_FILTER_SIZE		(4096)					// Number of counters used to skip frees of allocations that were not sampled
+#define TAG_FLUSH_BYTES			(65536)					// Bytes by which a thread's count of a tag may change before it is shared
+#define DEFRAG_MAX_OCCUPANCY	(25)					// Percentage of its capacity below which a page in use may be evacuated
+#define RELOCATION_MIN_ENTRIES	(1024)					// Initial number of entries in the table of relocatable allocations
+#define SYSTEM_CACHE_MIN_LOG2	(15)					// log2 of the size above which freed system mappings are cached
+#define SYSTEM_CACHE_MAX_LOG2	(24)					// log2 of the largest system mapping that is cached when freed
+#define SYSTEM_CACHE_STEPS_LOG2	(2)						// log2 of the number of cached mapping sizes per power of two
 
 #define ptradd(p,offset) ((intptr_t) (p) + (intptr_t) (offset))	
 #define ptrsub(p,offset) ((intptr_t) (p) - (intptr_t) (offset))	
 
+// Return the index of the most significant set bit in a non-zero value
+static inline int HighestBit(size_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return (int)index;
+#else
+	return 63 - __builtin_clzll(value);
+#endif
+}
+
+// Return the index of the least significant set bit in a non-zero value
+static inline int LowestBit(size_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return (int)index;
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+
+// Return a monotonic time in milliseconds
+static uint64_t GetMilliseconds(void)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Frame number advanced by Heap::BeginFrame
+static std::atomic<unsigned int> current_frame = 0;
+
+// Return a random number of allocations between sampled ones, averaging sample_rate
+static int DrawSampleInterval(unsigned int sample_rate)
+{
+	static thread_local uint32_t random_state = 0;
+	if (random_state == 0) random_state = (uint32_t)(size_t)&random_state | 1;
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return 1 + (int)(random_state % (2 * sample_rate - 1));
+}
+
 #define list_insert(head, e) {e->prev = nullptr; e->next = head; head = e; if (e->next) e->next->prev = e; }
 #define list_remove(head, e) {if (e->next) e->next->prev = e->prev; if (e->prev) e->prev->next = e->next; else head = e->next; }
 
@@ -25,14 +110,65 @@ public:
 	virtual void* Resize(void* address, size_t new_size, bool fill) { (address); (new_size); (fill); throw("virtual method"); };
 	virtual void* Relocate(void* address, bool fill) { (address); (fill);  throw("virtual method"); };
 	virtual void  Free(void* address, bool fill) { (address); (fill); throw("virtual method"); };
+	virtual size_t GetSize(void* address) { (address); throw("virtual method"); };		// usable bytes of an allocation
+	virtual size_t GetAlignment(void* address) { (address); return HEAP_ALIGNMENT; };	// alignment to keep when an allocation moves
+	virtual unsigned int GetTag(void* address) { (address); return 0; };					// memory tag to keep when an allocation moves
+	virtual New::Hint GetHint(void* address) { (address); return New::Hint::DEFAULT; };	// hint to keep when an allocation moves
+
+	// Evacuation of a sparse page by the defragmenter; see Heap::DefragmentStep
+	virtual bool  BeginEvacuation(unsigned int pass) { (pass); return false; };	// chooses a page not yet chosen in the pass
+	virtual void* NextEvacuee(void) { return nullptr; };							// next allocation in the page, or nullptr
+	virtual size_t EndEvacuation(void) { return 0; };								// returns the bytes of the page if it was released
 protected:
-	unsigned int num_allocations = 0;
-	size_t total_allocated = 0;
-	size_t peak_allocated = 0;
+	// Counters are atomic so that statistics can be sampled without taking the allocator lock
+	std::atomic<size_t> num_allocations = 0;
+	std::atomic<size_t> total_allocated = 0;
+	std::atomic<size_t> peak_allocated = 0;
+	std::atomic<size_t> allocation_count = 0;	// allocations made since the allocator was created
+	std::atomic<size_t> page_maps = 0;			// pages obtained from the system
+	std::atomic<size_t> page_unmaps = 0;		// pages returned to the system
+	std::atomic<size_t> page_reuses = 0;		// pages taken from the retained page cache
+	std::atomic<size_t> page_decommits = 0;		// retained pages whose memory was returned to the system
+	HugePages huge_pages = HugePages::NONE;		// huge page mode used to map pages
 
-	void Count(size_t size)   { num_allocations++; total_allocated += size; if (total_allocated > peak_allocated) peak_allocated = total_allocated; }
-	void Uncount(size_t size) { num_allocations--; total_allocated -= size; }
+	void Count(size_t size, size_t count = 1)	// count allocations of size bytes each
+	{
+		num_allocations.fetch_add(count, std::memory_order_relaxed);
+		allocation_count.fetch_add(count, std::memory_order_relaxed);
+		size_t total = total_allocated.fetch_add(size * count, std::memory_order_relaxed) + size * count;
+		size_t peak = peak_allocated.load(std::memory_order_relaxed);
+		while (total > peak && !peak_allocated.compare_exchange_weak(peak, total, std::memory_order_relaxed)) {}
+	}
+	void Uncount(size_t size, size_t count = 1)	// count frees of size bytes each
+	{
+		num_allocations.fetch_sub(count, std::memory_order_relaxed);
+		total_allocated.fetch_sub(size * count, std::memory_order_relaxed);
+	}
+	void GetUsage(AllocatorStats& stats) const
+	{
+		stats.live_allocations = num_allocations.load(std::memory_order_relaxed);
+		stats.live_bytes = total_allocated.load(std::memory_order_relaxed);
+		stats.peak_bytes = peak_allocated.load(std::memory_order_relaxed);
+		stats.allocation_count = allocation_count.load(std::memory_order_relaxed);
+	}
+	void* MapPage(size_t size) { page_maps++; return PageProvider::GetInstance()->Map(size, huge_pages); }
+	void  UnmapPage(void* page, size_t size) { page_unmaps++; PageProvider::GetInstance()->Unmap(page, size); }
+
+	// Decommit all but the header of a page, and commit it again before reuse; false if the memory stays committed
+	bool  DecommitPage(void* page, size_t size)
+	{
+		if (!PageProvider::GetInstance()->Decommit((void*)ptradd(page, PAGE_HEADER_SIZE), size - PAGE_HEADER_SIZE)) return false;
+		page_decommits++;
+		return true;
+	}
+	void  RecommitPage(void* page, size_t size) { if (!PageProvider::GetInstance()->Commit((void*)ptradd(page, PAGE_HEADER_SIZE), size - PAGE_HEADER_SIZE)) throw("out of memory"); }
 };
+
+// Map memory for an allocator object or other heap bookkeeping
+static void* MapObject(size_t size)
+{
+	return PageProvider::GetInstance()->Map(size, HugePages::NONE);
+}
 Allocator::~Allocator() {}
 
 // base struct for memory pages
@@ -41,51 +177,558 @@ struct Page
 	Allocator* allocator;		// allocator that owns the page
 };
 
+// Empty pages retained by an allocator so that an allocate/free cycle at a page boundary does not map and unmap a page
+// every time. Pages that stay idle are decommitted, returning their memory to the system while keeping the page
+// header and address range for reuse. T is a page type with list pointers, idle stamps and a decommitted flag.
+// The owning allocator synchronizes access.
+template<class T> struct PageCache
+{
+	T* pages = nullptr;									// retained pages, most recently retained first
+	unsigned int count = 0;								// number of retained pages
+	unsigned int committed = 0;							// number of retained pages that are still committed
+	unsigned int max_pages = PAGE_RETAIN_MAX;			// high watermark; empty pages beyond this are released at once
+	unsigned int idle_frames = PAGE_IDLE_FRAMES;		// decommit pages idle for this many frames
+	unsigned int idle_milliseconds = PAGE_IDLE_MILLISECONDS;	// decommit pages idle for this many milliseconds
+	bool decommit = true;								// false if the pages cannot be decommitted and stay committed until released
+
+	// Retain an empty page; returns false if the cache is full and the page should be released
+	bool Retain(T* page)
+	{
+		if (count >= max_pages) return false;
+		page->idle_frame = current_frame;
+		page->idle_time = GetMilliseconds();
+		page->decommitted = false;
+		list_insert(pages, page);
+		count++;
+		committed++;
+		return true;
+	}
+
+	// Return the most recently retained page, or nullptr if there are none; the caller recommits a decommitted page
+	T* Reuse(void)
+	{
+		T* page = pages;
+		if (page) {
+			list_remove(pages, page);
+			count--;
+			if (!page->decommitted) committed--;
+		}
+		return page;
+	}
+
+	// Return a page beyond the watermark to be released, or nullptr if there are none
+	T* Excess(void)
+	{
+		if (count <= max_pages) return nullptr;
+		T* page = pages;
+		list_remove(pages, page);
+		count--;
+		if (!page->decommitted) committed--;
+		return page;
+	}
+
+	// Return a committed page that has been idle too long to be decommitted, or nullptr if there are none
+	T* Idle(void)
+	{
+		if (!decommit) return nullptr;
+		unsigned int frame = current_frame;
+		uint64_t time = GetMilliseconds();
+		for (T* page = pages; page != nullptr; page = page->next)
+		{
+			if (!page->decommitted && ((frame - page->idle_frame) >= idle_frames || (time - page->idle_time) >= idle_milliseconds))
+			{
+				page->decommitted = true;
+				committed--;
+				return page;
+			}
+		}
+		return nullptr;
+	}
+
+	// Return a page taken by Idle to the committed pages when it could not be decommitted
+	void Recommitted(T* page)
+	{
+		page->decommitted = false;
+		committed++;
+	}
+};
+
+// Lock-free list of freed addresses waiting for their allocator's lock. A free that finds the lock held by another
+// thread pushes the address here instead of waiting, and the next thread to take the lock reclaims the whole list in one
+// batch. Any number of threads push and the list is only ever taken whole, so the ABA problem of a lock-free pop does
+// not arise. Each link is stored in the freed memory.
+class DeferredFreeList
+{
+public:
+	bool  IsEmpty(void) const { return head.load(std::memory_order_relaxed) == nullptr; }
+	void  Push(void* address) { Push(address, address); }
+	void  Push(void* first, void* last)			// push a chain already linked from first to last
+	{
+		void* old_head = head.load(std::memory_order_relaxed);
+		do {
+			Link(last, old_head);
+		} while (!head.compare_exchange_weak(old_head, first, std::memory_order_release, std::memory_order_relaxed));
+	}
+	void* TakeAll(void) { return IsEmpty() ? nullptr : head.exchange(nullptr, std::memory_order_acquire); }
+
+	static void* Next(void* address) { return *(void**)address; }
+	static void  Link(void* address, void* next) { *(void**)address = next; }
+
+private:
+	std::atomic<void*> head = nullptr;
+};
+
 // marker placed at end of allocated memory to detect buffer overrun
 struct Sentinel
 {
-	unsigned __int64 value;
+	uint64_t value;
+};
+
+// Outcome of checking the next page of a tier with the incremental verifier
+enum VerifyResult { VERIFY_CHECKED, VERIFY_END, VERIFY_CORRUPT };
+
+//#################################################################################################################################
+// Thread Statistics
+//#################################################################################################################################
+
+// Allocation requests counted by one thread. Only the owning thread writes its counters, so recording a request takes
+// no lock and does not contend with other threads; a snapshot sums the counters of every thread.
+struct ThreadStats
+{
+	std::atomic<size_t> allocations[HEAP_HINT_COUNT] = {};
+	std::atomic<size_t> requested_bytes[HEAP_HINT_COUNT] = {};
+	std::atomic<size_t> size_histogram[HEAP_HISTOGRAM_BUCKETS] = {};
+	std::atomic<size_t> transient_allocations = 0;
+	std::atomic<size_t> promoted_allocations = 0;
+	ThreadStats* next;
+	ThreadStats* prev;
+
+	ThreadStats(void);
+	~ThreadStats(void);
+
+	static void Add(std::atomic<size_t>& counter, size_t value) { counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed); }
+	void Record(New::Hint hint, size_t size);
+	void Collect(HeapStats& stats) const;
+};
+
+static std::mutex thread_stats_mtx;					// guards the list of threads and the totals of exited threads
+static ThreadStats* thread_stats_list = nullptr;	// counters of running threads
+static HeapStats exited_thread_stats;				// counters collected from threads that have exited
+
+// The constructor registers the counters of a thread when it first allocates; the destructor keeps its totals
+static thread_local ThreadStats thread_stats;
+
+ThreadStats::ThreadStats(void)
+{
+	std::lock_guard<std::mutex> lock(thread_stats_mtx);
+	list_insert(thread_stats_list, this);
+}
+
+ThreadStats::~ThreadStats(void)
+{
+	std::lock_guard<std::mutex> lock(thread_stats_mtx);
+	list_remove(thread_stats_list, this);
+	Collect(exited_thread_stats);
+}
+
+void ThreadStats::Record(New::Hint hint, size_t size)
+{
+	int bucket = size < 16 ? 0 : HighestBit(size) - 3;
+	if (bucket >= HEAP_HISTOGRAM_BUCKETS) bucket = HEAP_HISTOGRAM_BUCKETS - 1;
+	Add(allocations[(int)hint], 1);
+	Add(requested_bytes[(int)hint], size);
+	Add(size_histogram[bucket], 1);
+}
+
+void ThreadStats::Collect(HeapStats& stats) const
+{
+	for (int i = 0; i < HEAP_HINT_COUNT; i++)
+	{
+		stats.hints[i].allocation_count += allocations[i].load(std::memory_order_relaxed);
+		stats.hints[i].requested_bytes += requested_bytes[i].load(std::memory_order_relaxed);
+	}
+	for (int i = 0; i < HEAP_HISTOGRAM_BUCKETS; i++)
+	{
+		stats.size_histogram[i] += size_histogram[i].load(std::memory_order_relaxed);
+	}
+	stats.transient.allocation_count += transient_allocations.load(std::memory_order_relaxed);
+	stats.promoted_allocation_count += promoted_allocations.load(std::memory_order_relaxed);
+}
+
+// Add the counters of every thread, running or exited, to a snapshot
+static void CollectThreadStats(HeapStats& stats)
+{
+	std::lock_guard<std::mutex> lock(thread_stats_mtx);
+	for (int i = 0; i < HEAP_HINT_COUNT; i++)
+	{
+		stats.hints[i].allocation_count += exited_thread_stats.hints[i].allocation_count;
+		stats.hints[i].requested_bytes += exited_thread_stats.hints[i].requested_bytes;
+	}
+	for (int i = 0; i < HEAP_HISTOGRAM_BUCKETS; i++)
+	{
+		stats.size_histogram[i] += exited_thread_stats.size_histogram[i];
+	}
+	stats.transient.allocation_count += exited_thread_stats.transient.allocation_count;
+	stats.promoted_allocation_count += exited_thread_stats.promoted_allocation_count;
+	for (ThreadStats* t = thread_stats_list; t != nullptr; t = t->next)
+	{
+		t->Collect(stats);
+	}
+}
+
+//#################################################################################################################################
+// Memory Tags
+//#################################################################################################################################
+
+// Allocations are tagged with the tag of the allocating thread, which is held in the allocation header or, for pool
+// elements, in a byte per element after the page bitmap. Each thread adds the sizes of the tagged allocations it makes
+// and frees to its own counts, and adds those to the shared count of a tag once they change by TAG_FLUSH_BYTES, so the
+// shared counts lag by up to that many bytes for each thread. Budgets are checked only when a count is shared, and a
+// pressure callback that becomes due is called by the thread on its next allocation, after the allocator locks are
+// released.
+struct TagAccount
+{
+	std::atomic<int64_t> live_bytes = 0;			// shared count; may be briefly negative when another thread frees
+	std::atomic<int64_t> peak_bytes = 0;
+	std::atomic<size_t> budget = 0;
+	std::atomic<size_t> pressure = 0;				// live bytes at which the callback is first called; 0 = no budget
+	std::atomic<HeapPressureCallback> callback = nullptr;
+	std::atomic<int> level = 0;						// 0 = below pressure, 1 = past pressure, 2 = past budget
+	std::atomic<size_t> pressure_count = 0;
+};
+
+// Counts of the calling thread not yet shared; the destructor shares them when the thread exits
+struct TagCounter
+{
+	int64_t bytes[HEAP_TAG_COUNT] = {};
+	unsigned int signals = 0;						// bit set for each tag whose callback the thread is due to call
+
+	~TagCounter(void) { Flush(); }
+	void Add(unsigned int tag, int64_t size)
+	{
+		bytes[tag] += size;
+		if (bytes[tag] >= TAG_FLUSH_BYTES || bytes[tag] <= -TAG_FLUSH_BYTES) Share(tag);
+	}
+	void Flush(void);
+	void Share(unsigned int tag);
+};
+
+static TagAccount tag_accounts[HEAP_TAG_COUNT];
+static thread_local TagCounter tag_counter;
+static thread_local unsigned int current_tag = 0;
+
+static inline void TagCount(unsigned int tag, size_t size) { tag_counter.Add(tag, (int64_t)size); }
+static inline void TagUncount(unsigned int tag, size_t size) { tag_counter.Add(tag, -(int64_t)size); }
+
+// Return the budget level of a count
+static int GetTagLevel(const TagAccount& account, int64_t live)
+{
+	size_t pressure = account.pressure.load(std::memory_order_relaxed);
+	if (!pressure || live < (int64_t)pressure) return 0;
+	return live < (int64_t)account.budget.load(std::memory_order_relaxed) ? 1 : 2;
+}
+
+void TagCounter::Flush(void)
+{
+	for (unsigned int i = 0; i < HEAP_TAG_COUNT; i++)
+	{
+		if (bytes[i]) Share(i);
+	}
+}
+
+// Add the count of a tag to its shared count and signal the callback if the tag has risen to a higher budget level
+void TagCounter::Share(unsigned int tag)
+{
+	TagAccount& account = tag_accounts[tag];
+	int64_t live = account.live_bytes.fetch_add(bytes[tag], std::memory_order_relaxed) + bytes[tag];
+	bytes[tag] = 0;
+	int64_t peak = account.peak_bytes.load(std::memory_order_relaxed);
+	while (live > peak && !account.peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+
+	int level = GetTagLevel(account, live);
+	if (level != account.level.load(std::memory_order_relaxed) && account.level.exchange(level) < level) signals |= 1u << tag;
+}
+
+// Call the pressure callbacks due on the calling thread. Signals are cleared first so that allocations made by a
+// callback do not call it again.
+static void CallPressureCallbacks(void)
+{
+	unsigned int signals = tag_counter.signals;
+	tag_counter.signals = 0;
+	while (signals)
+	{
+		int tag = LowestBit(signals);
+		signals &= signals - 1;
+		TagAccount& account = tag_accounts[tag];
+		HeapPressureCallback callback = account.callback.load();
+		if (!callback) continue;
+		account.pressure_count++;
+		int64_t live = account.live_bytes.load(std::memory_order_relaxed);
+		callback(tag, live > 0 ? (size_t)live : 0, account.budget.load(std::memory_order_relaxed));
+	}
+}
+
+// Add the shared count of each tag to a snapshot, after sharing the counts of the calling thread
+static void CollectTagStats(HeapStats& stats)
+{
+	tag_counter.Flush();
+	for (int i = 0; i < HEAP_TAG_COUNT; i++)
+	{
+		TagAccount& account = tag_accounts[i];
+		int64_t live = account.live_bytes.load(std::memory_order_relaxed);
+		stats.tags[i].live_bytes = live > 0 ? (size_t)live : 0;
+		stats.tags[i].peak_bytes = (size_t)account.peak_bytes.load(std::memory_order_relaxed);
+		stats.tags[i].budget = account.budget.load(std::memory_order_relaxed);
+		stats.tags[i].pressure_count = account.pressure_count.load(std::memory_order_relaxed);
+	}
+}
+
+//#################################################################################################################################
+// Relocatable Allocations
+//#################################################################################################################################
+
+// Allocations whose only reference is registered by their owner, so that the defragmenter may move them and update the
+// reference. Entries are held in an open addressed table keyed by the allocation address, which doubles as it fills.
+struct Relocation
+{
+	void* address;					// nullptr marks an unused entry
+	void** reference;				// location of the owner's pointer to the allocation
+};
+
+class RelocationTable
+{
+public:
+	void  Add(void** reference);
+	void* Remove(void** reference);						// returns the address of the allocation
+	bool  Contains(void* address) { std::lock_guard<std::mutex> lock(mtx); return Find(address) != nullptr; }
+	void** Find(void* address);							// the caller holds the lock
+	void  Replace(void* address, void* new_address);	// the caller holds the lock
+
+	std::mutex mtx;
+
+private:
+	Relocation* entries = nullptr;
+	size_t capacity = 0;
+	size_t count = 0;
+
+	size_t GetIndex(void* address) const { return (size_t)((((uint64_t)address >> 3) * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1); }
+	void  Insert(void* address, void** reference);
+	void  Erase(size_t index);
 };
 
+static RelocationTable relocations;
+
+void RelocationTable::Add(void** reference)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	Insert(*reference, reference);
+}
+
+void* RelocationTable::Remove(void** reference)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	void* address = *reference;
+	for (size_t index = address && capacity ? GetIndex(address) : 0; capacity && entries[index].address; index = (index + 1) & (capacity - 1))
+	{
+		if (entries[index].address == address)
+		{
+			Erase(index);
+			return address;
+		}
+	}
+	throw("allocation is not relocatable");
+}
+
+void** RelocationTable::Find(void* address)
+{
+	if (!capacity) return nullptr;
+	for (size_t index = GetIndex(address); entries[index].address; index = (index + 1) & (capacity - 1))
+	{
+		if (entries[index].address == address) return entries[index].reference;
+	}
+	return nullptr;
+}
+
+// Re-key the entry of an allocation that has moved and update its owner's reference
+void RelocationTable::Replace(void* address, void* new_address)
+{
+	size_t index = GetIndex(address);
+	while (entries[index].address != address)
+	{
+		index = (index + 1) & (capacity - 1);
+	}
+	void** reference = entries[index].reference;
+	Erase(index);
+	*reference = new_address;
+	Insert(new_address, reference);
+}
+
+void RelocationTable::Insert(void* address, void** reference)
+{
+	// Keep the table no more than three quarters full
+	if ((count + 1) * 4 > capacity * 3)
+	{
+		Relocation* old_entries = entries;
+		size_t old_capacity = capacity;
+		capacity = capacity ? capacity * 2 : RELOCATION_MIN_ENTRIES;
+		entries = (Relocation*)MapObject(capacity * sizeof(Relocation));
+		count = 0;
+		for (size_t i = 0; i < old_capacity; i++)
+		{
+			if (old_entries[i].address) Insert(old_entries[i].address, old_entries[i].reference);
+		}
+		if (old_entries) PageProvider::GetInstance()->Unmap(old_entries, old_capacity * sizeof(Relocation));
+	}
+	size_t index = GetIndex(address);
+	while (entries[index].address)
+	{
+		index = (index + 1) & (capacity - 1);
+	}
+	entries[index] = { address, reference };
+	count++;
+}
+
+// Remove an entry, moving later entries of its probe sequence back so that no tombstones are needed
+void RelocationTable::Erase(size_t index)
+{
+	size_t hole = index;
+	for (;;)
+	{
+		index = (index + 1) & (capacity - 1);
+		if (!entries[index].address) break;
+		size_t home = GetIndex(entries[index].address);
+		if (((index - home) & (capacity - 1)) >= ((index - hole) & (capacity - 1)))
+		{
+			entries[hole] = entries[index];
+			hole = index;
+		}
+	}
+	entries[hole].address = nullptr;
+	count--;
+}
+
 //#################################################################################################################################
 // System Memory Allocator
 //#################################################################################################################################
 
 struct SystemElement
 {
-	size_t size : 63;				// size in bytes of allocated memory
+	size_t size : 53;				// size in bytes of allocated memory
 	size_t track : 1;				// 1 = track as potential leak, 0 = don't track
+	size_t tag : 8;					// memory tag
+	size_t hint : 2;				// hint with which the allocation was requested
 	SystemElement* next;			// pointers for list of allocated elements
 	SystemElement* prev;			// "
 	Page* page;						// always nullptr for a SystemElement; MUST be last field in struct
 };
 
+// A freed mapping held for reuse. The entry is placed at the end of the mapping, clear of the element header, whose page
+// pointer is overwritten so that a second free of the address is reported.
+struct SystemCacheEntry
+{
+	SystemCacheEntry* next;			// pointers for list of cached mappings of one size
+	SystemCacheEntry* prev;			// "
+	SystemCacheEntry* newer;		// pointers for list of all cached mappings by the time they were freed
+	SystemCacheEntry* older;		// "
+	void* mapping;					// start of the mapping
+	size_t size;					// size of the mapping
+	unsigned int idle_frame;		// frame in which the mapping was freed
+	uint64_t idle_time;				// time in milliseconds at which the mapping was freed
+};
+
+// Mappings up to 2^SYSTEM_CACHE_MAX_LOG2 bytes are rounded to one of SYSTEM_CACHE_STEPS sizes per power of two, so that
+// a freed mapping serves later allocations of similar size; each size has a bucket of cached mappings
+#define SYSTEM_CACHE_STEPS		(1 << SYSTEM_CACHE_STEPS_LOG2)
+#define SYSTEM_CACHE_BUCKETS	(((SYSTEM_CACHE_MAX_LOG2 - SYSTEM_CACHE_MIN_LOG2) << SYSTEM_CACHE_STEPS_LOG2) + 1)
+
 class SystemAllocator : Allocator
 {
 public:
-	void* Allocate(size_t size, bool track_leaks);
+	SystemAllocator(void) { memset(buckets, 0, sizeof(buckets)); }
+
+	void* Allocate(size_t size, size_t alignment, bool track_leaks, unsigned int tag, New::Hint hint);
 	void* Resize(void* address, size_t new_size, bool fill);
 	void* Relocate(void* address, bool fill) { (fill); return address; }		// intentionally a null operation
 	void  Free(void* address, bool fill);
+	size_t GetSize(void* address) { return ((SystemElement*)ptrsub(address, sizeof(SystemElement)))->size; }
+	size_t GetAlignment(void* address);
+	unsigned int GetTag(void* address) { return ((SystemElement*)ptrsub(address, sizeof(SystemElement)))->tag; }
+	New::Hint GetHint(void* address) { return (New::Hint)((SystemElement*)ptrsub(address, sizeof(SystemElement)))->hint; }
+	void  Scavenge(void);
+	void  SetCache(size_t max_bytes, unsigned int idle_frames, unsigned int idle_milliseconds);
 	void  VerifyIntegrity(void);
+	VerifyResult VerifyNext(size_t& cursor, HeapCorruption& corruption);
 	void  ReportLeaks(void);
+	void  GetStats(HeapStats& stats);
 private:
-	std::mutex mtx;
+	std::mutex mtx;							// guards the list of elements and the cache
 	SystemElement* elements = nullptr;		// list of allocated elements
+	SystemElement* verify_next = nullptr;	// next element to be checked by the incremental verifier
+	size_t mapped_bytes = 0;				// bytes of the mappings of allocated elements
+
+	SystemCacheEntry* buckets[SYSTEM_CACHE_BUCKETS];	// cached mappings by size, most recently freed first
+	SystemCacheEntry* newest = nullptr;		// most recently freed cached mapping
+	SystemCacheEntry* oldest = nullptr;		// least recently freed cached mapping
+	size_t cached_bytes = 0;				// bytes of cached mappings
+	size_t cached_count = 0;				// number of cached mappings
+	size_t cache_reuses = 0;				// allocations served from cached mappings
+	size_t cache_max_bytes = LARGE_CACHE_BYTES;			// cached mappings beyond this are released, oldest first
+	unsigned int idle_frames = PAGE_IDLE_FRAMES;		// release mappings cached for this many frames
+	unsigned int idle_milliseconds = PAGE_IDLE_MILLISECONDS;	// release mappings cached for this many milliseconds
+
+	// Return the start of the mapping that holds an element. Mappings start on a page boundary and an aligned element
+	// is placed less than HEAP_MAX_ALIGNMENT bytes from the start.
+	static void* GetMapping(SystemElement* element) { return (void*)((size_t)element & ~(HEAP_MAX_ALIGNMENT - 1)); }
+	static size_t GetMappingSize(size_t offset, size_t size);
+	static int GetBucket(size_t mapping_size);
+	void* Reuse(size_t mapping_size);
+	void  Release(void* mapping, size_t mapping_size);
+	void  RemoveCached(SystemCacheEntry* entry);
+	void  UnmapList(SystemCacheEntry* list);
 };
 
-void* SystemAllocator::Allocate(size_t size, bool track_leaks)
+// Return the size of the mapping for an element placed at an offset from its start. Sizes that may be cached are rounded
+// up to a bucket size and others to a multiple of the system page.
+size_t SystemAllocator::GetMappingSize(size_t offset, size_t size)
+{
+	size_t bytes = offset + sizeof(SystemElement) + size + sizeof(Sentinel);
+	if (bytes <= ((size_t)1 << SYSTEM_CACHE_MIN_LOG2) || bytes > ((size_t)1 << SYSTEM_CACHE_MAX_LOG2)) return (bytes + 4095) & ~(size_t)4095;
+	size_t step = (size_t)1 << (HighestBit(bytes - 1) - SYSTEM_CACHE_STEPS_LOG2);
+	return (bytes + step - 1) & ~(step - 1);
+}
+
+// Return the cache bucket of a mapping size, or -1 if mappings of the size are not cached
+int SystemAllocator::GetBucket(size_t mapping_size)
+{
+	if (mapping_size <= ((size_t)1 << SYSTEM_CACHE_MIN_LOG2) || mapping_size > ((size_t)1 << SYSTEM_CACHE_MAX_LOG2)) return -1;
+	int fl = HighestBit(mapping_size);
+	return ((fl - SYSTEM_CACHE_MIN_LOG2) << SYSTEM_CACHE_STEPS_LOG2) + (int)((mapping_size >> (fl - SYSTEM_CACHE_STEPS_LOG2)) & (SYSTEM_CACHE_STEPS - 1));
+}
+
+void* SystemAllocator::Allocate(size_t size, size_t alignment, bool track_leaks, unsigned int tag, New::Hint hint)
 {
 	size = (size + 7) & -8;
-	size_t allocation_size = size + sizeof(SystemElement) + sizeof(Sentinel);
-	SystemElement* element = (SystemElement*)HeapAlloc(GetProcessHeap(), 0, allocation_size);
+
+	// Mappings are page aligned; offset the header so that the memory after it is aligned
+	size_t offset = alignment > sizeof(SystemElement) ? alignment - sizeof(SystemElement) : 0;
+	size_t mapping_size = GetMappingSize(offset, size);
+	void* mapping = Reuse(mapping_size);
+	if (!mapping) mapping = MapPage(mapping_size);
+	SystemElement* element = (SystemElement*)ptradd(mapping, offset);
 	element->size = size;
 	element->track = track_leaks;
+	element->tag = tag;
+	element->hint = (size_t)hint;
 	element->page = nullptr;
-	list_insert(elements, element);
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		list_insert(elements, element);
+		mapped_bytes += mapping_size;
+	}
 	Sentinel* sentinel = (Sentinel*)ptradd(element, sizeof(SystemElement) + element->size);
 	sentinel->value = MEMORY_SENTINEL;
 	Count(size);
+	TagCount(tag, size);
 	return (void*)ptradd(element, sizeof(SystemElement));
 }
 
@@ -94,20 +737,40 @@ void* SystemAllocator::Resize(void* address, size_t new_size, bool fill)
 	SystemElement* element = (SystemElement*)ptrsub(address, sizeof(SystemElement));
 	Sentinel* sentinel = (Sentinel*)ptradd(address, element->size);
 	if (sentinel->value != MEMORY_SENTINEL) throw("system allocation buffer overrun");
-	list_remove(elements, element);
+	new_size = (new_size + 7) & -8;
 	Uncount(element->size);
-	bool original_track = element->track;
+	TagUncount(element->tag, element->size);
 
-	new_size = (new_size + 7) & -8;
-	size_t allocation_size = new_size + sizeof(SystemElement) + sizeof(Sentinel);
-	element = (SystemElement*)HeapReAlloc(GetProcessHeap(), fill ? HEAP_ZERO_MEMORY : 0, (void*)element, allocation_size);
+	// Resize in place if the new size rounds to the same mapping
+	SystemElement* old_element = element;
+	void* old_mapping = GetMapping(old_element);
+	size_t offset = (size_t)ptrsub(old_element, old_mapping);
+	size_t old_mapping_size = GetMappingSize(offset, old_element->size);
+	size_t mapping_size = GetMappingSize(offset, new_size);
+	if (mapping_size != old_mapping_size)
+	{
+		// Otherwise move the contents to a mapping of the new size at the same offset
+		void* mapping = Reuse(mapping_size);
+		if (!mapping) mapping = MapPage(mapping_size);
+		element = (SystemElement*)ptradd(mapping, offset);
+		memcpy(element, old_element, sizeof(SystemElement) + (old_element->size < new_size ? old_element->size : new_size));
+		element->page = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			if (verify_next == old_element) verify_next = old_element->next;
+			list_remove(elements, old_element);
+			list_insert(elements, element);
+			mapped_bytes += mapping_size - old_mapping_size;
+		}
+		if (fill) memset(address, FILL_VALUE, old_element->size);
+		old_element->page = FILL_POINTER;
+		Release(old_mapping, old_mapping_size);
+	}
 	element->size = new_size;
-	element->track = original_track;
-	element->page = nullptr;
-	list_insert(elements, element);
 	sentinel = (Sentinel*)ptradd(element, sizeof(SystemElement) + element->size);
 	sentinel->value = MEMORY_SENTINEL;
 	Count(element->size);
+	TagCount(element->tag, element->size);
 	return (void*)ptradd(element, sizeof(SystemElement));
 }
 
@@ -116,58 +779,236 @@ void SystemAllocator::Free(void* address, bool fill)
 	SystemElement* element = (SystemElement*)ptrsub(address, sizeof(SystemElement));
 	Sentinel* sentinel = (Sentinel*)ptradd(address, element->size);
 	if (sentinel->value != MEMORY_SENTINEL) throw("system allocation buffer overrun");
-	list_remove(elements, element);
+	void* mapping = GetMapping(element);
+	size_t mapping_size = GetMappingSize((size_t)ptrsub(element, mapping), element->size);
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (verify_next == element) verify_next = element->next;
+		list_remove(elements, element);
+		mapped_bytes -= mapping_size;
+	}
 	Uncount(element->size);
-	if (fill) memset(element, 0, sizeof(SystemElement) + element->size + sizeof(Sentinel));
-	HeapFree(GetProcessHeap(), 0, (void*)element);
+	TagUncount(element->tag, element->size);
+
+	// A cached mapping keeps its contents, so it is filled if requested; an unmapped one faults when accessed
+	if (fill) memset(address, FILL_VALUE, element->size);
+	element->page = FILL_POINTER;
+	Release(mapping, mapping_size);
 }
 
-void SystemAllocator::VerifyIntegrity()
+// Take a cached mapping of a size, or return nullptr if there is none
+void* SystemAllocator::Reuse(size_t mapping_size)
 {
-	for (SystemElement* element = elements; element != nullptr; element = element->next)
-	{
-		Sentinel* sentinel = (Sentinel*)ptradd(element, sizeof(SystemElement) + element->size);
-		if (sentinel->value != MEMORY_SENTINEL) throw("system allocation buffer overrun");
-	}
+	int bucket = GetBucket(mapping_size);
+	if (bucket < 0) return nullptr;
+	std::lock_guard<std::mutex> lock(mtx);
+	SystemCacheEntry* entry = buckets[bucket];
+	if (!entry) return nullptr;
+	RemoveCached(entry);
+	cache_reuses++;
+	return entry->mapping;
 }
 
-void SystemAllocator::ReportLeaks()
+// Cache a freed mapping, releasing the oldest cached mappings beyond the byte limit; mappings that are not cached are
+// released at once. Mappings are returned to the system after the lock is released.
+void SystemAllocator::Release(void* mapping, size_t mapping_size)
 {
-	for (SystemElement* element = elements; element != nullptr; element = element->next)
+	int bucket = GetBucket(mapping_size);
+	SystemCacheEntry* expired = nullptr;
+	if (bucket >= 0)
 	{
-		// If this is a tracked allocation then report it as a leak
-		if (element->track)
+		std::lock_guard<std::mutex> lock(mtx);
+		if (mapping_size <= cache_max_bytes)
 		{
-			printf("Memory Leak");
+			SystemCacheEntry* entry = (SystemCacheEntry*)ptradd(mapping, mapping_size - sizeof(SystemCacheEntry));
+			entry->mapping = mapping;
+			entry->size = mapping_size;
+			entry->idle_frame = current_frame;
+			entry->idle_time = GetMilliseconds();
+			list_insert(buckets[bucket], entry);
+			entry->newer = nullptr;
+			entry->older = newest;
+			if (newest) newest->newer = entry;
+			else oldest = entry;
+			newest = entry;
+			cached_bytes += mapping_size;
+			cached_count++;
+			mapping = nullptr;
+
+			while (cached_bytes > cache_max_bytes)
+			{
+				SystemCacheEntry* e = oldest;
+				RemoveCached(e);
+				e->next = expired;
+				expired = e;
+			}
 		}
 	}
+	if (mapping) UnmapPage(mapping, mapping_size);
+	UnmapList(expired);
 }
 
-//#################################################################################################################################
-// Region Allocator
-//#################################################################################################################################
-
-// a page of memory from which allocations are made
-struct RegionPage : Page
+// Remove a mapping from the cache; the caller holds the lock
+void SystemAllocator::RemoveCached(SystemCacheEntry* entry)
 {
-	RegionPage* next;
-	RegionPage* prev;
-	unsigned int num_allocations;
-	unsigned int reserved;
-};
+	list_remove(buckets[GetBucket(entry->size)], entry);
+	if (entry->newer) entry->newer->older = entry->older;
+	else newest = entry->older;
+	if (entry->older) entry->older->newer = entry->newer;
+	else oldest = entry->newer;
+	cached_bytes -= entry->size;
+	cached_count--;
+}
 
-// describes an individual free or allocated element of memory
-struct RegionElement
+// Return a list of mappings removed from the cache to the system
+void SystemAllocator::UnmapList(SystemCacheEntry* list)
 {
-	size_t size : 61;				// size in bytes of allocated memory
-	size_t is_allocated : 1;		// 1 = allocated element, 0 = free element
-	size_t has_sentinel : 1;		// 1 = has a sentinel, 0 = no sentinel
-	size_t track : 1;				// 1 = track as potential leak, 0 = do not track
-	RegionElement* prev_element;	// Pointer to element that precedes this one in the page
-	RegionPage* page;				// page that owns this element; MUST be last real field in the struct
+	while (list)
+	{
+		SystemCacheEntry* next = list->next;
+		UnmapPage(list->mapping, list->size);
+		list = next;
+	}
+}
 
-	// Virtual fields; a shortened struct length is used such that these pointers are placed into the element memory
-	RegionElement* next;			// free list pointers
+// Release cached mappings that have been idle too long
+void SystemAllocator::Scavenge(void)
+{
+	SystemCacheEntry* expired = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		unsigned int frame = current_frame;
+		uint64_t time = GetMilliseconds();
+		while (oldest && ((frame - oldest->idle_frame) >= idle_frames || (time - oldest->idle_time) >= idle_milliseconds))
+		{
+			SystemCacheEntry* e = oldest;
+			RemoveCached(e);
+			e->next = expired;
+			expired = e;
+		}
+	}
+	UnmapList(expired);
+}
+
+void SystemAllocator::SetCache(size_t max_bytes, unsigned int idle_frames, unsigned int idle_milliseconds)
+{
+	SystemCacheEntry* expired = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		cache_max_bytes = max_bytes;
+		this->idle_frames = idle_frames;
+		this->idle_milliseconds = idle_milliseconds;
+		while (cached_bytes > cache_max_bytes)
+		{
+			SystemCacheEntry* e = oldest;
+			RemoveCached(e);
+			e->next = expired;
+			expired = e;
+		}
+	}
+	UnmapList(expired);
+}
+
+// An element placed after the start of its mapping was aligned to its offset from the start
+size_t SystemAllocator::GetAlignment(void* address)
+{
+	size_t offset = (size_t)ptrsub(address, GetMapping((SystemElement*)ptrsub(address, sizeof(SystemElement))));
+	return offset > sizeof(SystemElement) ? offset : HEAP_ALIGNMENT;
+}
+
+void SystemAllocator::VerifyIntegrity()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	for (SystemElement* element = elements; element != nullptr; element = element->next)
+	{
+		Sentinel* sentinel = (Sentinel*)ptradd(element, sizeof(SystemElement) + element->size);
+		if (sentinel->value != MEMORY_SENTINEL) throw("system allocation buffer overrun");
+	}
+}
+
+// Check the next element of the list; each element is its own mapping and counts as a page. A pass starts at the head
+// when the cursor is zero, and the cursor then counts the elements checked. Removing an element moves the verifier past
+// it, and elements are inserted at the head, so a pass visits each element that stays allocated exactly once. The lock
+// keeps the element mapped while it is checked.
+VerifyResult SystemAllocator::VerifyNext(size_t& cursor, HeapCorruption& corruption)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (cursor == 0) verify_next = elements;
+	SystemElement* next = verify_next;
+	if (!next) return VERIFY_END;
+	verify_next = next->next;
+	cursor++;
+
+	Sentinel* sentinel = (Sentinel*)ptradd(next, sizeof(SystemElement) + next->size);
+	if (sentinel->value == MEMORY_SENTINEL) return VERIFY_CHECKED;
+	corruption = { (void*)ptradd(next, sizeof(SystemElement)), next->size, "system", (New::Hint)next->hint, "buffer overrun" };
+	return VERIFY_CORRUPT;
+}
+
+void SystemAllocator::GetStats(HeapStats& stats)
+{
+	// Each element is a separate mapping; cached mappings are available for allocations of their bucket size
+	std::lock_guard<std::mutex> lock(mtx);
+	GetUsage(stats.system);
+	stats.system.pages = stats.system.live_allocations + cached_count;
+	stats.system.page_bytes = mapped_bytes + cached_bytes;
+	stats.system.free_bytes = cached_bytes;
+	for (int bucket = SYSTEM_CACHE_BUCKETS - 1; bucket >= 0 && !stats.system.largest_free; bucket--)
+	{
+		if (buckets[bucket]) stats.system.largest_free = buckets[bucket]->size - sizeof(SystemElement) - sizeof(Sentinel);
+	}
+	stats.large_cache_bytes = cached_bytes;
+	stats.large_reuse_count = cache_reuses;
+}
+
+void SystemAllocator::ReportLeaks()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	for (SystemElement* element = elements; element != nullptr; element = element->next)
+	{
+		// If this is a tracked allocation then report it as a leak
+		if (element->track)
+		{
+			void* address = (void*)ptradd(element, sizeof(SystemElement));
+			printf("Memory leak of %zu bytes at %p\n", (size_t)element->size, address);
+			HeapProfiler::PrintSite(address);
+		}
+	}
+}
+
+//#################################################################################################################################
+// Region Allocator
+//#################################################################################################################################
+
+// a page of memory from which allocations are made
+struct RegionPage : Page
+{
+	RegionPage* next;
+	RegionPage* prev;
+	unsigned int num_allocations;
+	size_t live_bytes;					// bytes in allocated elements
+	unsigned int defrag_pass;			// defragmentation pass in which the page was last chosen for evacuation
+	unsigned int idle_frame;			// frame in which the page was retained while empty
+	uint64_t idle_time;					// time in milliseconds at which the page was retained while empty
+	bool decommitted;					// page memory after the header has been returned to the system
+};
+
+// describes an individual free or allocated element of memory
+struct RegionElement
+{
+	size_t size : 49;				// size in bytes of allocated memory
+	size_t is_allocated : 1;		// 1 = allocated element, 0 = free element
+	size_t pending_free : 1;		// 1 = an allocated element claimed by a free that is deferred or in progress
+	size_t has_sentinel : 1;		// 1 = has a sentinel, 0 = no sentinel
+	size_t track : 1;				// 1 = track as potential leak, 0 = do not track
+	size_t align_log2 : 5;			// log2 of the alignment requested for the element, or 0 for HEAP_ALIGNMENT
+	size_t tag : 4;					// memory tag of an allocated element
+	size_t hint : 2;				// hint with which an allocated element was requested
+	RegionElement* prev_element;	// Pointer to element that precedes this one in the page
+	RegionPage* page;				// page that owns this element; MUST be last real field in the struct
+
+	// Virtual fields; a shortened struct length is used such that these pointers are placed into the element memory
+	RegionElement* next;			// free list pointers
 	RegionElement* prev;
 };
 
@@ -175,65 +1016,146 @@ struct RegionElement
 // This works because the pointers are only accessed when the element is not allocated
 #define REGION_ELEMENT_SIZE (sizeof(RegionElement) - (sizeof(RegionElement*) * 2))
 
+// Return the bit of the first header word that holds pending_free, wherever the compiler placed the bit field
+static size_t GetPendingFreeBit(void)
+{
+	RegionElement e;
+	memset(&e, 0, sizeof(e));
+	e.pending_free = 1;
+	size_t word;
+	memcpy(&word, &e, sizeof(word));
+	return word;
+}
+static const size_t pending_free_bit = GetPendingFreeBit();
+
+// Set pending_free in the header of an allocated element and return whether it was already set. The bit is set
+// atomically so that two frees of one element, which may both be deferred, cannot both claim it.
+static inline bool ClaimPendingFree(RegionElement* e)
+{
+#if defined(_MSC_VER)
+	return (_InterlockedOr64((volatile __int64*)e, (__int64)pending_free_bit) & pending_free_bit) != 0;
+#else
+	return (__atomic_fetch_or((size_t*)e, pending_free_bit, __ATOMIC_ACQ_REL) & pending_free_bit) != 0;
+#endif
+}
+
+// Free elements are indexed by a two-level segregated fit; the first level is the power-of-two range of the element
+// size and the second level divides that range linearly. Bitmaps record which lists are non-empty so that a
+// suitable list is found with bit scans instead of searching.
+#define REGION_SL_LOG2		(4)							// log2 of the number of second-level lists per range
+#define REGION_SL_COUNT		(1 << REGION_SL_LOG2)		// Number of second-level lists per range
+#define REGION_FL_COUNT		(32)						// Number of first-level ranges
+
 class RegionAllocator : public Allocator
 {
 public:
-	RegionAllocator(size_t page_size);
+	RegionAllocator(size_t page_size, HugePages huge_pages);
 
-	void* Allocate(size_t size, bool track_leaks, bool append_sentinel);
+	void* Allocate(size_t size, size_t alignment, bool track_leaks, bool append_sentinel, unsigned int tag, New::Hint hint);
 	void* Resize(void* address, size_t new_size, bool fill);
 	void* Relocate(void* address, bool fill);
 	void  Free(void* address, bool fill);
+	size_t GetSize(void* address);
+	size_t GetAlignment(void* address) { return GetAlignment((RegionElement*)ptrsub(address, REGION_ELEMENT_SIZE)); }
+	unsigned int GetTag(void* address) { return ((RegionElement*)ptrsub(address, REGION_ELEMENT_SIZE))->tag; }
+	New::Hint GetHint(void* address) { return (New::Hint)((RegionElement*)ptrsub(address, REGION_ELEMENT_SIZE))->hint; }
+	void  Scavenge(void);
+	void  SetPageRetention(unsigned int max_pages, unsigned int idle_frames, unsigned int idle_milliseconds);
+	void  GetStats(HeapStats& stats);
 	void  VerifyIntegrity(void);
+	VerifyResult VerifyNext(size_t& cursor, HeapCorruption& corruption);
 	void  ReportLeaks(void);
+	bool  BeginEvacuation(unsigned int pass);
+	void* NextEvacuee(void);
+	size_t EndEvacuation(void);
 
 private:
 	size_t page_size;
-	RegionPage* pages = nullptr;		// list of pages owned by the allocator
-	RegionElement* free_lists[64];		// free list head pointers
+	size_t resizes_in_place = 0;								// resizes satisfied by growing or shrinking the element
+	size_t resizes_copied = 0;									// resizes that moved the contents to a new element
+	RegionPage* pages = nullptr;								// list of pages owned by the allocator
+	RegionPage* verify_next = nullptr;							// next page to be checked by the incremental verifier
+	PageCache<RegionPage> retained;								// empty pages retained for reuse
+	uint64_t fl_bitmap = 0;								// bit set for each first-level range with a free element
+	unsigned int sl_bitmap[REGION_FL_COUNT];					// bit set for each non-empty second-level list
+	RegionElement* free_lists[REGION_FL_COUNT][REGION_SL_COUNT];	// free list head pointers
 	std::mutex mtx;
 
+	size_t free_bytes = 0;										// bytes in free elements of pages in use
+	DeferredFreeList deferred;									// frees made while another thread held the lock
+
+	// The free elements of a page being evacuated are kept out of the free lists so that nothing is allocated from it
+	RegionPage* evacuating = nullptr;							// page being evacuated, or nullptr
+	void* evacuee = nullptr;									// last allocation returned by NextEvacuee
+	bool evacuated = false;										// the evacuated page emptied and was released
+
+	void FreeElement(RegionElement* e, bool fill);
+	void ReclaimDeferred(void);
+	bool VerifyPage(RegionPage* page, HeapCorruption& corruption);
+	RegionElement* AlignElement(RegionElement* e, size_t alignment);
+	static size_t GetAlignment(RegionElement* e) { return e->align_log2 ? (size_t)1 << e->align_log2 : HEAP_ALIGNMENT; }
+	RegionElement* FindFreeElement(size_t size);
 	void AddFreeElement(RegionElement* e);
 	void RemoveFreeElement(RegionElement* e);
 };
 
-RegionAllocator::RegionAllocator(size_t page_size)
+RegionAllocator::RegionAllocator(size_t page_size, HugePages huge_pages)
 {
 	this->page_size = page_size;
+	this->huge_pages = huge_pages;
+	memset(sl_bitmap, 0, sizeof(sl_bitmap));
 	memset(free_lists, 0, sizeof(free_lists));
+
+	// Explicit huge pages can only be decommitted whole, and Windows large pages not at all, so a page of them keeps its
+	// memory while it is retained and returns it when it is released
+	retained.decommit = huge_pages != HugePages::EXPLICIT;
+}
+
+// Return the first and second level list indices for an element size
+static inline void GetFreeListIndex(size_t size, int& fl, int& sl)
+{
+	fl = HighestBit(size);
+	sl = (int)(size >> (fl - REGION_SL_LOG2)) & (REGION_SL_COUNT - 1);
 }
 
-void* RegionAllocator::Allocate(size_t size, bool track_leaks, bool append_sentinel)
+void* RegionAllocator::Allocate(size_t size, size_t alignment, bool track_leaks, bool append_sentinel, unsigned int tag, New::Hint hint)
 {
 	// Apply rounding and minimum size requirements
 	size = (size + 7) & -8;
 	if (append_sentinel) size += sizeof(Sentinel);								// add room for sentinel if requested
 	if (size < (sizeof(RegionElement*) * 2)) size = sizeof(RegionElement*) * 2;	// allocation must be big enough for free pointers
 
+	// An aligned allocation may need a free element split off before it, so look for room for both
+	size_t search_size = size;
+	if (alignment > HEAP_ALIGNMENT) search_size += alignment + REGION_ELEMENT_SIZE + REGION_MIN_FREE;
+
 	// An allocation cannot exceed the available memory in a page
 	int page_overhead = sizeof(RegionPage) + (REGION_ELEMENT_SIZE * 2);
-	if (size > page_size - page_overhead) return nullptr;
+	if (search_size > page_size - page_overhead) return nullptr;
 
 	// Synchronize thread access to this code block
 	{
 		std::lock_guard<std::mutex> lock(mtx);
+		ReclaimDeferred();
 
-		// Find the smallest free element that meets the size requirement
-		RegionElement* e = nullptr;
-		unsigned int search_size = (unsigned int)size + REGION_ELEMENT_SIZE;
-		for (int index = (int)log2(search_size); index <= (int)log2(page_size); index++)
-		{
-			e = free_lists[index];
-			while (e && (search_size > e->size)) e = e->next;
-			if (e) break;
-		}
+		// Find a free element that meets the size requirement
+		RegionElement* e = FindFreeElement(search_size);
 
 		// If we can't satisfy the allocation request then add a page of memory
 		if (!e)
 		{
-			RegionPage* page = (RegionPage*)HeapAlloc(GetProcessHeap(), 0, page_size);
+			RegionPage* page = retained.Reuse();
+			if (page) {
+				if (page->decommitted) RecommitPage(page, page_size);
+				page_reuses++;
+			}
+			else {
+				page = (RegionPage*)MapPage(page_size);
+			}
 			page->allocator = this;
 			page->num_allocations = 0;
+			page->live_bytes = 0;
+			page->defrag_pass = 0;
 			list_insert(pages, page);
 
 			// Initialize the free element
@@ -247,6 +1169,7 @@ void* RegionAllocator::Allocate(size_t size, bool track_leaks, bool append_senti
 			RegionElement* f = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
 			f->size = 0;
 			f->is_allocated = true;
+			f->pending_free = false;
 			f->page = page;
 			f->prev_element = e;
 		}
@@ -254,11 +1177,13 @@ void* RegionAllocator::Allocate(size_t size, bool track_leaks, bool append_senti
 		{
 			RemoveFreeElement(e);
 		}
+		if (alignment > HEAP_ALIGNMENT) e = AlignElement(e, alignment);
 
 		// Allocate from the start of the free element
-		size_t remainder = e->size - size - REGION_ELEMENT_SIZE;
-		if (remainder >= REGION_MIN_FREE)
+		if (e->size >= size + REGION_ELEMENT_SIZE + REGION_MIN_FREE)
 		{
+			size_t remainder = e->size - size - REGION_ELEMENT_SIZE;
+
 			// resize the allocated memory
 			e->size = size;				// includes sentinel size
 
@@ -277,14 +1202,20 @@ void* RegionAllocator::Allocate(size_t size, bool track_leaks, bool append_senti
 
 		// Update and return the allocated element
 		e->is_allocated = true;
+		e->pending_free = false;
 		e->has_sentinel = append_sentinel;
 		e->track = track_leaks;
+		e->align_log2 = alignment > HEAP_ALIGNMENT ? LowestBit(alignment) : 0;
+		e->tag = tag;
+		e->hint = (size_t)hint;
 		e->page->num_allocations++;
+		e->page->live_bytes += e->size;
 		if (append_sentinel) {
 			Sentinel* sentinel = (Sentinel*)ptradd(e, REGION_ELEMENT_SIZE + e->size - sizeof(Sentinel));
 			sentinel->value = MEMORY_SENTINEL;
 		}
-		Count(size);
+		Count(e->size);
+		TagCount(tag, e->size);
 		return (void*)ptradd(e, REGION_ELEMENT_SIZE);
 	}
 }
@@ -292,23 +1223,104 @@ void* RegionAllocator::Allocate(size_t size, bool track_leaks, bool append_senti
 void* RegionAllocator::Resize(void* address, size_t new_size, bool fill)
 {
 	RegionElement* e = (RegionElement*)ptrsub(address, REGION_ELEMENT_SIZE);
-	void* new_memory = Allocate(new_size, e->track, e->has_sentinel);
-	size_t copy_size = e->size < new_size ? e->size : new_size;
-	memcpy(new_memory, address, copy_size);
+	if (e->has_sentinel) {
+		Sentinel* sentinel = (Sentinel*)ptradd(address, e->size - sizeof(Sentinel));
+		if (sentinel->value != MEMORY_SENTINEL) throw ("region allocator buffer overrun");
+	}
+
+	// Apply the same rounding and minimum size requirements as Allocate
+	size_t size = (new_size + 7) & -8;
+	if (e->has_sentinel) size += sizeof(Sentinel);
+	if (size < (sizeof(RegionElement*) * 2)) size = sizeof(RegionElement*) * 2;
+
+	// Synchronize thread access to this code block
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		if (!e->is_allocated) throw("Region allocator resize of free element");
+
+		// Resize in place if the element, together with a free element that follows it, is large enough
+		RegionElement* next = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
+		size_t available = e->size;
+		if (!next->is_allocated) available += REGION_ELEMENT_SIZE + next->size;
+		if (size <= available && e->page != evacuating)
+		{
+			size_t old_size = e->size;
+
+			// Absorb the following free element
+			if (!next->is_allocated)
+			{
+				RemoveFreeElement(next);
+				e->size = available;
+				next = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
+				next->prev_element = e;
+			}
+
+			// Split off the tail as a free element if it is large enough to be useful
+			if (e->size >= size + REGION_ELEMENT_SIZE + REGION_MIN_FREE)
+			{
+				RegionElement* f = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + size);
+				f->size = e->size - size - REGION_ELEMENT_SIZE;
+				f->is_allocated = false;
+				f->page = e->page;
+				f->prev_element = e;
+				if (fill && old_size > size) {
+					// fill the released part of the element, leaving the free element header intact
+					size_t released = old_size - size;
+					if (released > sizeof(RegionElement)) memset((void*)ptradd(f, sizeof(RegionElement)), FILL_VALUE, released - sizeof(RegionElement));
+				}
+				AddFreeElement(f);
+				next->prev_element = f;
+				e->size = size;
+			}
+
+			if (e->has_sentinel) {
+				Sentinel* sentinel = (Sentinel*)ptradd(address, e->size - sizeof(Sentinel));
+				sentinel->value = MEMORY_SENTINEL;
+			}
+			e->page->live_bytes += e->size - old_size;
+			Uncount(old_size);
+			Count(e->size);
+			TagUncount(e->tag, old_size);
+			TagCount(e->tag, e->size);
+			resizes_in_place++;
+			return address;
+		}
+		resizes_copied++;
+	}
+
+	// Otherwise move the contents to a new element
+	size_t old_size = e->has_sentinel ? e->size - sizeof(Sentinel) : e->size;
+	void* new_memory = Allocate(new_size, GetAlignment(e), e->track, e->has_sentinel, e->tag, (New::Hint)e->hint);
+	if (!new_memory) return nullptr;
+	memcpy(new_memory, address, old_size < new_size ? old_size : new_size);
 	Free(address, fill);
 	return new_memory;
 }
 
+size_t RegionAllocator::GetSize(void* address)
+{
+	RegionElement* e = (RegionElement*)ptrsub(address, REGION_ELEMENT_SIZE);
+	return e->has_sentinel ? e->size - sizeof(Sentinel) : e->size;
+}
+
 void* RegionAllocator::Relocate(void* address, bool fill)
 {
-	// Resizing to the current size will relocate to the most efficient location
-	RegionElement* b = ((RegionElement*)address) - 1;
-	return Resize(address, b->size, fill);
+	// Allocating a new element of the same size will relocate to the most efficient location
+	RegionElement* e = (RegionElement*)ptrsub(address, REGION_ELEMENT_SIZE);
+	size_t size = e->has_sentinel ? e->size - sizeof(Sentinel) : e->size;
+	void* new_memory = Allocate(size, GetAlignment(e), e->track, e->has_sentinel, e->tag, (New::Hint)e->hint);
+	memcpy(new_memory, address, size);
+	Free(address, fill);
+	return new_memory;
 }
 
 void RegionAllocator::Free(void* address, bool fill)
 {
+	// Claim the element before it can be deferred, so a second free throws here rather than corrupting the deferred
+	// list and throwing in whichever thread reclaims it
 	RegionElement* e = (RegionElement*)ptrsub(address, REGION_ELEMENT_SIZE);
+	if (!e->is_allocated || ClaimPendingFree(e)) throw("Region allocator double free");
 	if (e->has_sentinel) {
 		Sentinel* sentinel = (Sentinel*)ptradd(address, e->size - sizeof(Sentinel));
 		if (sentinel->value != MEMORY_SENTINEL) throw ("region allocator buffer overrun");
@@ -317,416 +1329,2846 @@ void RegionAllocator::Free(void* address, bool fill)
 		memset(address, FILL_VALUE, e->size);
 	}
 
-	// Synchronize thread access to this code block
+	// If another thread holds the lock then leave the element for the next thread that takes it
+	std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+	if (!lock.owns_lock())
 	{
-		std::lock_guard<std::mutex> lock(mtx);
+		deferred.Push(address);
+		return;
+	}
+	ReclaimDeferred();
+	FreeElement(e, fill);
+}
+
+// Split the start off a free element that is not in a free list, so that the memory of the remainder is aligned, and
+// return the remainder. The start goes back to the free lists; it cannot merge with its neighbours because the element
+// was free and free elements are always merged. The caller holds the lock and has found an element with room for the
+// start, the alignment and the allocation.
+RegionElement* RegionAllocator::AlignElement(RegionElement* e, size_t alignment)
+{
+	size_t memory = (size_t)ptradd(e, REGION_ELEMENT_SIZE);
+	size_t aligned = (memory + alignment - 1) & ~(alignment - 1);
+	if (aligned == memory) return e;
+
+	// The start must be large enough to be a useful free element
+	while (aligned - memory < REGION_ELEMENT_SIZE + REGION_MIN_FREE) aligned += alignment;
+	RegionElement* a = (RegionElement*)(aligned - REGION_ELEMENT_SIZE);
+	size_t gap = aligned - memory;
+	a->size = e->size - gap;
+	a->is_allocated = false;
+	a->page = e->page;
+	a->prev_element = e;
+	RegionElement* next = (RegionElement*)ptradd(a, REGION_ELEMENT_SIZE + a->size);
+	next->prev_element = a;
+
+	e->size = gap - REGION_ELEMENT_SIZE;
+	AddFreeElement(e);
+	return a;
+}
+
+// Return deferred frees to the free lists; the caller holds the lock. The memory of deferred elements was filled when
+// they were freed, but the headers of elements they merge with are not. The whole list is reclaimed before an error is
+// thrown, so one corrupt element does not lose the others.
+void RegionAllocator::ReclaimDeferred(void)
+{
+	const char* error = nullptr;
+	void* address = deferred.TakeAll();
+	while (address)
+	{
+		void* next = DeferredFreeList::Next(address);
+		try {
+			FreeElement((RegionElement*)ptrsub(address, REGION_ELEMENT_SIZE), false);
+		}
+		catch (const char* message) {
+			if (!error) error = message;
+		}
+		address = next;
+	}
+	if (error) throw(error);
+}
+
+// Mark an element free and merge it with its free neighbours; the caller holds the lock
+void RegionAllocator::FreeElement(RegionElement* e, bool fill)
+{
+	// Test for a double-free
+	if (!e->is_allocated) throw("Region allocator double free");
+
+	// Mark as free
+	RegionPage* page = e->page;
+	e->is_allocated = false;
+	e->pending_free = false;
+	page->num_allocations--;
+	page->live_bytes -= e->size;
+	Uncount(e->size);
+	TagUncount(e->tag, e->size);
+
+	// Free elements of a page being evacuated are not in the free lists
+	bool listed = page != evacuating;
+
+	// If the previous element in memory is free then merge it with this one
+	RegionElement* prev = e->prev_element;
+	if (prev && !prev->is_allocated)
+	{
+		// Remove from the free list
+		if (listed) RemoveFreeElement(prev);
+
+		// Combine the current element with the previous one
+		prev->size += REGION_ELEMENT_SIZE + e->size;
+		RegionElement* next = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
+		next->prev_element = prev;
+		if (fill) {
+			memset(e, FILL_VALUE, REGION_ELEMENT_SIZE);
+		}
+
+		// We now consider the previous element as the current element
+		e = prev;
+	}
+
+	// If the next element in memory is free then merge it with this one
+	RegionElement* next = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
+	if (!next->is_allocated)
+	{
+		// Remove from the free list
+		if (listed) RemoveFreeElement(next);
+
+		// Combine the next element with the current one
+		e->size += REGION_ELEMENT_SIZE + next->size;
+		RegionElement* f = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
+		f->prev_element = e;
+		if (fill) {
+			memset(next, FILL_VALUE, REGION_ELEMENT_SIZE);
+		}
+	}
+
+	// If the page is empty then retain it for reuse or discard it
+	if (page->num_allocations == 0)
+	{
+		if (verify_next == page) verify_next = page->next;
+		list_remove(pages, page);
+		if (!retained.Retain(page)) UnmapPage(page, page_size);
+		if (!listed) {
+			evacuating = nullptr;
+			evacuated = true;
+		}
+	}
+	else if (listed)
+	{
+		// The page is not empty so just add the free element back to the free list
+		AddFreeElement(e);
+	}
+}
+
+RegionElement* RegionAllocator::FindFreeElement(size_t size)
+{
+	// Round the size up to the next list boundary so that any element in the selected list is large enough
+	size += ((size_t)1 << (HighestBit(size) - REGION_SL_LOG2)) - 1;
+	int fl, sl;
+	GetFreeListIndex(size, fl, sl);
+	if (fl >= REGION_FL_COUNT) return nullptr;
+
+	// Search the remainder of this range, then the smallest larger range with a free element
+	unsigned int sl_map = sl_bitmap[fl] & (~0u << sl);
+	if (!sl_map)
+	{
+		uint64_t fl_map = fl_bitmap & (~0ull << (fl + 1));
+		if (!fl_map) return nullptr;
+		fl = LowestBit(fl_map);
+		sl_map = sl_bitmap[fl];
+	}
+	sl = LowestBit(sl_map);
+	return free_lists[fl][sl];
+}
+
+void RegionAllocator::AddFreeElement(RegionElement* e)
+{
+	int fl, sl;
+	GetFreeListIndex(e->size, fl, sl);
+	list_insert(free_lists[fl][sl], e);
+	free_bytes += e->size;
+	fl_bitmap |= 1ull << fl;
+	sl_bitmap[fl] |= 1u << sl;
+}
+
+void RegionAllocator::RemoveFreeElement(RegionElement* e)
+{
+	int fl, sl;
+	GetFreeListIndex(e->size, fl, sl);
+	list_remove(free_lists[fl][sl], e);
+	free_bytes -= e->size;
+	if (!free_lists[fl][sl])
+	{
+		sl_bitmap[fl] &= ~(1u << sl);
+		if (!sl_bitmap[fl]) fl_bitmap &= ~(1ull << fl);
+	}
+}
+
+// Scavenging runs every frame, so if another thread holds the lock the work is left for a later frame rather than waited
+// for. The retained pages are only examined under the lock.
+void RegionAllocator::Scavenge(void)
+{
+	std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+	if (!lock.owns_lock()) return;
+	ReclaimDeferred();
+	while (RegionPage* page = retained.Excess()) UnmapPage(page, page_size);
+	while (RegionPage* page = retained.Idle())
+	{
+		if (DecommitPage(page, page_size)) continue;
+		retained.Recommitted(page);		// leave the page committed rather than retry it at once
+		break;
+	}
+}
 
-		// Test for a double-free
-		if (!e->is_allocated) throw("Region allocator double free");
+void RegionAllocator::SetPageRetention(unsigned int max_pages, unsigned int idle_frames, unsigned int idle_milliseconds)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	retained.max_pages = max_pages;
+	retained.idle_frames = idle_frames;
+	retained.idle_milliseconds = idle_milliseconds;
+}
 
-		// Mark as free
-		e->is_allocated = false;
-		e->page->num_allocations--;
-		Uncount(e->size);
+void RegionAllocator::GetStats(HeapStats& stats)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	GetUsage(stats.region);
+	stats.region.pages = page_maps - page_unmaps;
+	stats.region.page_bytes = stats.region.pages * page_size;
 
-		// If the previous element in memory is free then merge it with this one
-		RegionElement* prev = e->prev_element;
-		if (prev && !prev->is_allocated)
+	// Retained pages are available without mapping another page
+	size_t page_capacity = page_size - sizeof(RegionPage) - (REGION_ELEMENT_SIZE * 2);
+	stats.region.free_bytes = free_bytes + retained.count * page_capacity;
+	if (retained.count) {
+		stats.region.largest_free = page_capacity;
+	}
+	else if (fl_bitmap) {
+		// The largest free element is in the highest non-empty list
+		int fl = HighestBit(fl_bitmap);
+		int sl = HighestBit(sl_bitmap[fl]);
+		for (RegionElement* e = free_lists[fl][sl]; e != nullptr; e = e->next)
 		{
-			// Remove from the free list
-			RemoveFreeElement(prev);
+			if (e->size > stats.region.largest_free) stats.region.largest_free = e->size;
+		}
+	}
+
+	stats.page_map_count += page_maps;
+	stats.page_unmap_count += page_unmaps;
+	stats.page_reuse_count += page_reuses;
+	stats.page_decommit_count += page_decommits;
+	stats.retained_page_bytes += retained.committed * page_size;
+	stats.resize_in_place_count += resizes_in_place;
+	stats.resize_copy_count += resizes_copied;
+}
+
+void RegionAllocator::VerifyIntegrity()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	HeapCorruption corruption;
+	for (RegionPage* page = pages; page != nullptr; page = page->next)
+	{
+		if (!VerifyPage(page, corruption)) throw("region allocator buffer overrun");
+	}
+}
+
+// Check the next page of the list, in the same way as the system allocator walks its elements. The lock keeps the page
+// in use while it is checked.
+VerifyResult RegionAllocator::VerifyNext(size_t& cursor, HeapCorruption& corruption)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	if (cursor == 0) verify_next = pages;
+	RegionPage* next = verify_next;
+	if (!next) return VERIFY_END;
+	verify_next = next->next;
+	cursor++;
+	return VerifyPage(next, corruption) ? VERIFY_CHECKED : VERIFY_CORRUPT;
+}
 
-			// Combine the current element with the previous one
-			prev->size += REGION_ELEMENT_SIZE + e->size;
-			RegionElement* next = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
-			next->prev_element = prev;
-			if (fill) {
-				memset(e, FILL_VALUE, REGION_ELEMENT_SIZE);
+// Walk the elements of a page, checking their links and sentinels, and check the walk ends at the dummy element at the
+// end of the page. An element whose header is corrupt was most likely overrun by the allocation before it, so that
+// allocation is reported; the caller holds the lock.
+bool RegionAllocator::VerifyPage(RegionPage* page, HeapCorruption& corruption)
+{
+	size_t end = (size_t)ptradd(page, page_size - REGION_ELEMENT_SIZE);
+	RegionElement* prev = nullptr;
+	RegionElement* e = (RegionElement*)ptradd(page, sizeof(RegionPage));
+	unsigned int num_allocations = 0;
+	for (;;)
+	{
+		bool linked = e->page == page && e->prev_element == prev;
+		if (linked && e->size == 0) break;
+		if (!linked || (size_t)ptradd(e, REGION_ELEMENT_SIZE + e->size) > end)
+		{
+			if (prev && prev->is_allocated) {
+				size_t size = prev->has_sentinel ? prev->size - sizeof(Sentinel) : prev->size;
+				corruption = { (void*)ptradd(prev, REGION_ELEMENT_SIZE), size, "region", (New::Hint)prev->hint, "overrun of the following element header" };
+			}
+			else {
+				corruption = { page, 0, "region", New::Hint::DEFAULT, "element header is corrupt" };
+			}
+			return false;
+		}
+		if (e->is_allocated)
+		{
+			num_allocations++;
+			if (e->has_sentinel && ((Sentinel*)ptradd(e, REGION_ELEMENT_SIZE + e->size - sizeof(Sentinel)))->value != MEMORY_SENTINEL)
+			{
+				corruption = { (void*)ptradd(e, REGION_ELEMENT_SIZE), e->size - sizeof(Sentinel), "region", (New::Hint)e->hint, "buffer overrun" };
+				return false;
 			}
+		}
+		prev = e;
+		e = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
+	}
+	if ((size_t)e != end || num_allocations != page->num_allocations)
+	{
+		corruption = { page, 0, "region", New::Hint::DEFAULT, "page allocation count is corrupt" };
+		return false;
+	}
+	return true;
+}
+
+// Choose the page with the fewest live bytes among those below DEFRAG_MAX_OCCUPANCY of their capacity, and take its
+// free elements out of the free lists. A page is chosen once per pass, and only if every allocation in it is relocatable
+// and the free memory of the other pages is comfortably larger than the allocations that must move into it.
+bool RegionAllocator::BeginEvacuation(unsigned int pass)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	size_t capacity = page_size - sizeof(RegionPage) - (REGION_ELEMENT_SIZE * 2);
+	for (;;)
+	{
+		RegionPage* sparse = nullptr;
+		for (RegionPage* page = pages; page != nullptr; page = page->next)
+		{
+			if (page->defrag_pass == pass || page->live_bytes * 100 >= capacity * DEFRAG_MAX_OCCUPANCY) continue;
+			if (!sparse || page->live_bytes < sparse->live_bytes) sparse = page;
+		}
+		if (!sparse) return false;
+		sparse->defrag_pass = pass;
 
-			// We now consider the previous element as the current element
-			e = prev;
+		bool relocatable = true;
+		size_t page_free = 0;
+		RegionElement* e = (RegionElement*)ptradd(sparse, sizeof(RegionPage));
+		for (; e->size && relocatable; e = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size))
+		{
+			if (!e->is_allocated) page_free += e->size;
+			else relocatable = relocations.Contains((void*)ptradd(e, REGION_ELEMENT_SIZE));
 		}
+		if (!relocatable || free_bytes - page_free < sparse->live_bytes * 2) continue;
 
-		// If the next element in memory is free then merge it with this one
-		RegionElement* next = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
-		if (!next->is_allocated)
+		for (e = (RegionElement*)ptradd(sparse, sizeof(RegionPage)); e->size; e = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size))
 		{
-			// Remove from the free list
-			RemoveFreeElement(next);
+			if (!e->is_allocated) RemoveFreeElement(e);
+		}
+		evacuating = sparse;
+		evacuee = nullptr;
+		evacuated = false;
+		return true;
+	}
+}
 
-			// Combine the next element with the current one
-			e->size += REGION_ELEMENT_SIZE + next->size;
-			RegionElement* f = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
-			f->prev_element = e;
-			if (fill) {
-				memset(next, FILL_VALUE, REGION_ELEMENT_SIZE);
-			}
+// Return the first allocation in the page being evacuated above the last one returned. Allocations that were moved have
+// been freed and may have merged with the elements before them, so the page is walked from its start.
+void* RegionAllocator::NextEvacuee(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	if (!evacuating) return nullptr;
+	RegionElement* e = (RegionElement*)ptradd(evacuating, sizeof(RegionPage));
+	for (; e->size; e = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size))
+	{
+		void* address = (void*)ptradd(e, REGION_ELEMENT_SIZE);
+		if (e->is_allocated && (size_t)address > (size_t)evacuee) return evacuee = address;
+	}
+	return nullptr;
+}
+
+// Return the free elements of a page that did not empty to the free lists
+size_t RegionAllocator::EndEvacuation(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	if (evacuating)
+	{
+		RegionElement* e = (RegionElement*)ptradd(evacuating, sizeof(RegionPage));
+		for (; e->size; e = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size))
+		{
+			if (!e->is_allocated) AddFreeElement(e);
 		}
+		evacuating = nullptr;
+	}
+	return evacuated ? page_size : 0;
+}
 
-		// If the page is empty then discard it
-		RegionPage* page = e->page;
-		if (page->num_allocations == 0)
+void RegionAllocator::ReportLeaks()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	for (RegionPage* page = pages; page != nullptr; page = page->next)
+	{
+		void* end = (void*)ptradd(page, page_size);
+		RegionElement* e = (RegionElement*)ptradd(page, sizeof(RegionPage));
+		while (e < end)
+		{
+			if (e->is_allocated && e->track) {
+				void* address = (void*)ptradd(e, REGION_ELEMENT_SIZE);
+				printf("Memory leak of %zu bytes at %p\n", e->has_sentinel ? e->size - sizeof(Sentinel) : (size_t)e->size, address);
+				HeapProfiler::PrintSite(address);
+			}
+			e = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
+		}
+	}
+}
+
+//#################################################################################################################################
+// Transient Allocator
+//#################################################################################################################################
+
+// A chunk of memory from which a thread makes transient allocations
+struct TransientChunk : Page
+{
+	TransientChunk* next;			// next chunk in the same buffer; header size keeps elements 16 byte aligned
+};
+
+// describes an individual transient allocation
+struct TransientElement
+{
+	unsigned int size : 31;			// size in bytes of allocated memory
+	unsigned int has_sentinel : 1;	// 1 = has a sentinel, 0 = no sentinel
+	unsigned int frame;				// frame in which the element was allocated
+	Page* page;						// chunk that owns the element; MUST be last field in the struct
+};
+
+// One of the two buffers of a thread; a buffer is a list of chunks that is reset by rewinding to its first chunk
+struct TransientBuffer
+{
+	TransientChunk* first;			// first chunk of the buffer
+	TransientChunk* current;		// chunk currently used for allocation
+	char* cursor;					// next free byte in the current chunk
+	char* limit;					// end of the current chunk
+};
+
+// Serves short-lived allocations from per-thread bump buffers. Each thread alternates between two buffers at frame
+// boundaries, so memory allocated during a frame remains valid until the end of the following frame. Resetting a
+// buffer is O(1); free is a null operation.
+class TransientAllocator : public Allocator
+{
+public:
+	TransientAllocator(size_t chunk_size) { this->chunk_size = chunk_size; }
+
+	void* Allocate(size_t size, bool append_sentinel);
+	void* Resize(void* address, size_t new_size, bool fill);
+	void* Relocate(void* address, bool fill) { (fill); return address; }		// intentionally a null operation
+	void  Free(void* address, bool fill);
+	size_t GetSize(void* address);
+	New::Hint GetHint(void* address) { (address); return New::Hint::TRANSIENT; }
+	void  EnableEscapeCheck(bool flag) { escape_check = flag; }
+	void  GetStats(HeapStats& stats) const;
+
+private:
+	size_t chunk_size;
+	bool escape_check = false;				// poison expired buffers and validate frees against the current frame
+	std::atomic<size_t> num_chunks = 0;		// chunks held by the buffers of all threads
+
+	void CheckElement(TransientElement* e);
+	friend class TransientArena;
+};
+
+// Per-thread pair of transient buffers
+class TransientArena
+{
+public:
+	~TransientArena(void);
+	void* Allocate(TransientAllocator* allocator, size_t size);
+
+private:
+	TransientBuffer buffers[2] = {};
+	int index = 0;					// index of the buffer used for allocation
+	unsigned int frame = 0;			// frame in which the buffer was last selected
+	size_t chunk_size = 0;			// size of the chunks mapped by the arena
+
+	void Reset(TransientAllocator* allocator, TransientBuffer& buffer);
+};
+
+// The destructor of the arena releases the chunks of the thread when it exits
+static thread_local TransientArena transient_arena;
+
+TransientArena::~TransientArena(void)
+{
+	for (TransientBuffer& buffer : buffers)
+	{
+		TransientChunk* chunk = buffer.first;
+		while (chunk)
+		{
+			TransientChunk* next = chunk->next;
+			((TransientAllocator*)chunk->allocator)->num_chunks--;
+			PageProvider::GetInstance()->Unmap(chunk, chunk_size);
+			chunk = next;
+		}
+		buffer = {};
+	}
+}
+
+void TransientArena::Reset(TransientAllocator* allocator, TransientBuffer& buffer)
+{
+	// Poison the expired buffer so that pointers that escaped their frame are detectable
+	if (allocator->escape_check)
+	{
+		for (TransientChunk* chunk = buffer.first; chunk != nullptr; chunk = chunk->next)
+		{
+			memset((void*)ptradd(chunk, sizeof(TransientChunk)), FILL_VALUE, allocator->chunk_size - sizeof(TransientChunk));
+		}
+	}
+	buffer.current = buffer.first;
+	buffer.cursor = buffer.first ? (char*)ptradd(buffer.first, sizeof(TransientChunk)) : nullptr;
+	buffer.limit = buffer.first ? (char*)ptradd(buffer.first, allocator->chunk_size) : nullptr;
+}
+
+void* TransientArena::Allocate(TransientAllocator* allocator, size_t size)
+{
+	// At the first allocation after a frame boundary switch to the other buffer, whose contents have expired
+	unsigned int allocation_frame = current_frame;
+	if (frame != allocation_frame)
+	{
+		frame = allocation_frame;
+		index ^= 1;
+		Reset(allocator, buffers[index]);
+	}
+
+	TransientBuffer& buffer = buffers[index];
+	size_t allocation_size = sizeof(TransientElement) + size;
+	if (buffer.cursor + allocation_size > buffer.limit)
+	{
+		// Move to the next chunk of the buffer, adding a chunk if the buffer is exhausted
+		TransientChunk* chunk = buffer.current ? buffer.current->next : buffer.first;
+		if (!chunk)
+		{
+			chunk = (TransientChunk*)MapObject(allocator->chunk_size);
+			chunk_size = allocator->chunk_size;
+			allocator->num_chunks++;
+			chunk->allocator = allocator;
+			chunk->next = nullptr;
+			if (buffer.current) buffer.current->next = chunk;
+			else buffer.first = chunk;
+			if (allocator->escape_check) {
+				memset((void*)ptradd(chunk, sizeof(TransientChunk)), FILL_VALUE, allocator->chunk_size - sizeof(TransientChunk));
+			}
+		}
+		buffer.current = chunk;
+		buffer.cursor = (char*)ptradd(chunk, sizeof(TransientChunk));
+		buffer.limit = (char*)ptradd(chunk, allocator->chunk_size);
+	}
+
+	TransientElement* e = (TransientElement*)buffer.cursor;
+	buffer.cursor += allocation_size;
+	e->page = buffer.current;
+	e->frame = allocation_frame;
+	return (void*)ptradd(e, sizeof(TransientElement));
+}
+
+void* TransientAllocator::Allocate(size_t size, bool append_sentinel)
+{
+	// Round to 16 bytes so that every element and its header stay 16 byte aligned
+	size = (size + 15) & -16;
+	if (append_sentinel) size += 16;
+	if (size > chunk_size - sizeof(TransientChunk) - sizeof(TransientElement)) return nullptr;
+
+	void* address = transient_arena.Allocate(this, size);
+	ThreadStats::Add(thread_stats.transient_allocations, 1);
+	TransientElement* e = (TransientElement*)ptrsub(address, sizeof(TransientElement));
+	e->size = (unsigned int)size;
+	e->has_sentinel = append_sentinel;
+	if (append_sentinel) {
+		Sentinel* sentinel = (Sentinel*)ptradd(address, size - sizeof(Sentinel));
+		sentinel->value = MEMORY_SENTINEL;
+	}
+	return address;
+}
+
+void TransientAllocator::GetStats(HeapStats& stats) const
+{
+	stats.transient.pages = num_chunks.load(std::memory_order_relaxed);
+	stats.transient.page_bytes = stats.transient.pages * chunk_size;
+}
+
+void TransientAllocator::CheckElement(TransientElement* e)
+{
+	if (e->has_sentinel) {
+		Sentinel* sentinel = (Sentinel*)ptradd(e, sizeof(TransientElement) + e->size - sizeof(Sentinel));
+		if (sentinel->value != MEMORY_SENTINEL) throw("transient allocation buffer overrun");
+	}
+	if (escape_check && (current_frame - e->frame) > 1) throw("transient allocation used after its frame expired");
+}
+
+void* TransientAllocator::Resize(void* address, size_t new_size, bool fill)
+{
+	(fill);		// unreferenced parameter
+	TransientElement* e = (TransientElement*)ptrsub(address, sizeof(TransientElement));
+	CheckElement(e);
+	size_t old_size = GetSize(address);
+	void* new_memory = Allocate(new_size, e->has_sentinel);
+	if (new_memory) memcpy(new_memory, address, old_size < new_size ? old_size : new_size);
+	return new_memory;
+}
+
+size_t TransientAllocator::GetSize(void* address)
+{
+	TransientElement* e = (TransientElement*)ptrsub(address, sizeof(TransientElement));
+	return e->has_sentinel ? e->size - 16 : e->size;
+}
+
+void TransientAllocator::Free(void* address, bool fill)
+{
+	(fill);		// unreferenced parameter
+	CheckElement((TransientElement*)ptrsub(address, sizeof(TransientElement)));
+}
+
+//#################################################################################################################################
+// Permanent Allocator
+//#################################################################################################################################
+
+// Serves allocations that are never freed. Memory is bumped atomically from a contiguous range of reserved address
+// space that is committed in chunks as it is used. There is no per-allocation header; an address is identified as
+// permanent by testing whether it lies within the reserved range.
+class PermanentAllocator
+{
+public:
+	PermanentAllocator(size_t reserve_size, size_t chunk_size);
+
+	void*  Allocate(size_t size, size_t alignment);
+	bool   Contains(void* address) const { return (size_t)ptrsub(address, base) < reserve_size; }
+	size_t GetExtent(void* address) const;	// bytes from address to the end of the used and committed range
+	void   IgnoreFree() { ignored_frees.fetch_add(1, std::memory_order_relaxed); }
+	void   GetStats(HeapStats& stats) const;
+
+private:
+	void*  base;							// start of the reserved address range
+	size_t reserve_size;					// size in bytes of the reserved address range
+	size_t chunk_size;						// granularity in bytes of committing memory
+	std::atomic<size_t> used = 0;			// bytes consumed from the start of the range, including alignment padding
+	std::atomic<size_t> committed = 0;		// bytes committed from the start of the range
+	std::atomic<size_t> requested = 0;		// bytes requested by callers
+	std::atomic<size_t> allocations = 0;	// number of allocations made
+	std::atomic<size_t> ignored_frees = 0;	// number of attempts to free a permanent allocation
+};
+
+PermanentAllocator::PermanentAllocator(size_t reserve_size, size_t chunk_size)
+{
+	this->reserve_size = reserve_size;
+	this->chunk_size = chunk_size;
+	base = PageProvider::GetInstance()->Reserve(reserve_size);
+	if (!base) this->reserve_size = 0;		// every allocation will fail and fall back to another allocator
+}
+
+void* PermanentAllocator::Allocate(size_t size, size_t alignment)
+{
+	// Claim aligned space at the end of the used range
+	size_t start;
+	size_t end;
+	size_t current = used.load(std::memory_order_relaxed);
+	do {
+		start = (current + alignment - 1) & ~(alignment - 1);
+		end = start + size;
+		if (end > reserve_size) return nullptr;
+	} while (!used.compare_exchange_weak(current, end, std::memory_order_relaxed));
+
+	// Commit memory up to the end of the claimed space; committing a range that is already committed is harmless so
+	// threads that race here do not need to synchronize
+	size_t committed_end = committed.load(std::memory_order_acquire);
+	while (end > committed_end)
+	{
+		size_t commit_end = (end + chunk_size - 1) & ~(chunk_size - 1);
+		if (commit_end > reserve_size) commit_end = reserve_size;
+		if (!PageProvider::GetInstance()->Commit((void*)ptradd(base, committed_end), commit_end - committed_end)) throw("permanent allocator out of memory");
+		committed.compare_exchange_weak(committed_end, commit_end, std::memory_order_acq_rel);
+	}
+
+	requested.fetch_add(size, std::memory_order_relaxed);
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	return (void*)ptradd(base, start);
+}
+
+// The used range is claimed before it is committed, so another thread may have claimed space that is not yet readable.
+// The extent ends at whichever of the two ranges is shorter; an allocation that has been returned is always committed.
+size_t PermanentAllocator::GetExtent(void* address) const
+{
+	size_t end = committed.load(std::memory_order_acquire);
+	size_t used_end = used.load(std::memory_order_relaxed);
+	if (used_end < end) end = used_end;
+	return end - (size_t)ptrsub(address, base);
+}
+
+void PermanentAllocator::GetStats(HeapStats& stats) const
+{
+	// Permanent allocations are never freed so every allocation is live and usage is at its peak
+	stats.permanent.live_allocations = allocations.load(std::memory_order_relaxed);
+	stats.permanent.allocation_count = stats.permanent.live_allocations;
+	stats.permanent.live_bytes = requested.load(std::memory_order_relaxed);
+	stats.permanent.peak_bytes = stats.permanent.live_bytes;
+	stats.permanent.page_bytes = committed.load(std::memory_order_relaxed);
+	stats.permanent.pages = stats.permanent.page_bytes / chunk_size;
+	stats.permanent.free_bytes = stats.permanent.page_bytes - used.load(std::memory_order_relaxed);
+	stats.permanent.largest_free = stats.permanent.free_bytes;
+	stats.permanent_used_bytes = used.load(std::memory_order_relaxed);
+	stats.permanent_free_count = ignored_frees.load(std::memory_order_relaxed);
+}
+
+//#################################################################################################################################
+// Guarded Allocator
+//#################################################################################################################################
+
+// Serves a random sample of allocations from slots surrounded by inaccessible guard pages, so that an overrun or use
+// after free of a sampled allocation faults at the instruction that makes it. Allocations alternate between the end of
+// a slot, where an overrun runs into the following guard page, and the start, where an underrun runs into the preceding
+// one. The unused bytes of the slot are filled and checked when the allocation is freed. Freed slots are decommitted
+// and reused in the order they were freed, keeping each one inaccessible for as long as possible. Slot bookkeeping is
+// held outside the slots so that it cannot be corrupted by the errors being detected.
+struct GuardSlot
+{
+	void* address;					// address returned to the caller; nullptr while the slot is free
+	size_t size : 53;				// requested size in bytes
+	size_t track : 1;				// 1 = track as potential leak, 0 = don't track
+	size_t tag : 8;					// memory tag
+	size_t hint : 2;				// hint with which the allocation was requested
+};
+
+class GuardedAllocator : public Allocator
+{
+public:
+	GuardedAllocator(void);
+
+	void* Allocate(size_t size, bool track_leaks, unsigned int tag, New::Hint hint);
+	void* Resize(void* address, size_t new_size, bool fill);
+	void* Relocate(void* address, bool fill) { (fill); return address; }
+	void  Free(void* address, bool fill);
+	size_t GetSize(void* address);
+	unsigned int GetTag(void* address);
+	New::Hint GetHint(void* address);
+	void  GetStats(HeapStats& stats) const;
+	void  VerifyIntegrity(void);
+	VerifyResult VerifyNext(size_t& cursor, HeapCorruption& corruption);
+	void  ReportLeaks(void);
+
+	static size_t GetCapacity(void) { return GUARD_SLOT_SIZE - sizeof(Page*); }		// largest allocation a slot can hold
+
+private:
+	std::mutex mtx;
+	Page guard_page;							// page to which every guarded allocation refers
+	void* base;									// start of the reserved address range; the first page is a guard page
+	GuardSlot slots[GUARD_SLOT_COUNT];
+	unsigned int free_slots[GUARD_SLOT_COUNT];	// queue of free slot indices, oldest first
+	unsigned int free_head = 0;					// count of slots taken from the queue
+	unsigned int free_tail = 0;					// count of slots returned to the queue
+	bool align_end = true;						// place the next allocation at the end of its slot
+
+	void* GetSlotMemory(unsigned int index) { return (void*)ptradd(base, (2 * index + 1) * GUARD_SLOT_SIZE); }
+	unsigned int GetSlotIndex(void* address) { return (unsigned int)(ptrsub(address, base) / (2 * GUARD_SLOT_SIZE)); }
+	const char* CheckSlot(unsigned int index);
+};
+
+GuardedAllocator::GuardedAllocator(void)
+{
+	guard_page.allocator = this;
+	base = PageProvider::GetInstance()->Reserve((2 * GUARD_SLOT_COUNT + 1) * GUARD_SLOT_SIZE);
+	if (!base) throw("out of address space");
+	memset(slots, 0, sizeof(slots));
+	for (unsigned int i = 0; i < GUARD_SLOT_COUNT; i++)
+	{
+		free_slots[i] = i;
+	}
+	free_tail = GUARD_SLOT_COUNT;
+}
+
+void* GuardedAllocator::Allocate(size_t size, bool track_leaks, unsigned int tag, New::Hint hint)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	if (free_head == free_tail || size > GetCapacity()) return nullptr;
+	unsigned int index = free_slots[free_head++ % GUARD_SLOT_COUNT];
+	void* memory = GetSlotMemory(index);
+	if (!PageProvider::GetInstance()->Commit(memory, GUARD_SLOT_SIZE)) throw("out of memory");
+	memset(memory, GUARD_FILL, GUARD_SLOT_SIZE);
+
+	// Addresses at the end of a slot keep the heap's 8 byte alignment, so up to 7 bytes of overrun are found by the fill
+	void* address;
+	if (align_end) {
+		address = (void*)ptradd(memory, GUARD_SLOT_SIZE - ((size + 7) & -8));
+	}
+	else {
+		address = (void*)ptradd(memory, sizeof(Page*));
+	}
+	align_end = !align_end;
+	*(Page**)ptrsub(address, sizeof(Page*)) = &guard_page;
+
+	GuardSlot& slot = slots[index];
+	slot.address = address;
+	slot.size = size;
+	slot.track = track_leaks;
+	slot.tag = tag;
+	slot.hint = (size_t)hint;
+	Count(size);
+	TagCount(tag, size);
+	return address;
+}
+
+// Resizing moves an allocation to another tier, so Heap::Resize handles guarded allocations itself
+void* GuardedAllocator::Resize(void* address, size_t new_size, bool fill)
+{
+	(address); (new_size); (fill);		// unreferenced parameters
+	throw("guarded allocations are resized by the heap");
+}
+
+void GuardedAllocator::Free(void* address, bool fill)
+{
+	(fill);		// unreferenced parameter; a freed slot is made inaccessible instead
+	std::lock_guard<std::mutex> lock(mtx);
+	unsigned int index = GetSlotIndex(address);
+	GuardSlot& slot = slots[index];
+	if (slot.address != address) throw("guarded allocator free of an invalid address");
+	if (const char* error = CheckSlot(index)) throw(error);
+	PageProvider::GetInstance()->Decommit(GetSlotMemory(index), GUARD_SLOT_SIZE);
+	Uncount(slot.size);
+	TagUncount(slot.tag, slot.size);
+	slot.address = nullptr;
+	free_slots[free_tail++ % GUARD_SLOT_COUNT] = index;
+}
+
+size_t GuardedAllocator::GetSize(void* address)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return slots[GetSlotIndex(address)].size;
+}
+
+unsigned int GuardedAllocator::GetTag(void* address)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return slots[GetSlotIndex(address)].tag;
+}
+
+New::Hint GuardedAllocator::GetHint(void* address)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return (New::Hint)slots[GetSlotIndex(address)].hint;
+}
+
+// Check that the bytes of a slot outside its allocation still hold the fill value; returns the error found, if any
+const char* GuardedAllocator::CheckSlot(unsigned int index)
+{
+	GuardSlot& slot = slots[index];
+	unsigned char* memory = (unsigned char*)GetSlotMemory(index);
+	unsigned char* start = (unsigned char*)slot.address;
+	unsigned char* end = start + slot.size;
+	for (unsigned char* p = memory; p < start - sizeof(Page*); p++)
+	{
+		if (*p != GUARD_FILL) return "guarded allocator buffer underrun";
+	}
+	if (*(Page**)(start - sizeof(Page*)) != &guard_page) return "guarded allocator buffer underrun";
+	for (unsigned char* p = end; p < memory + GUARD_SLOT_SIZE; p++)
+	{
+		if (*p != GUARD_FILL) return "guarded allocator buffer overrun";
+	}
+	return nullptr;
+}
+
+void GuardedAllocator::GetStats(HeapStats& stats) const
+{
+	GetUsage(stats.guarded);
+	stats.guarded.pages = stats.guarded.live_allocations;
+	stats.guarded.page_bytes = stats.guarded.live_allocations * GUARD_SLOT_SIZE;
+	stats.guarded.free_bytes = stats.guarded.page_bytes - stats.guarded.live_bytes;
+}
+
+void GuardedAllocator::VerifyIntegrity(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	for (unsigned int i = 0; i < GUARD_SLOT_COUNT; i++)
+	{
+		const char* error = slots[i].address ? CheckSlot(i) : nullptr;
+		if (error) throw(error);
+	}
+}
+
+// Check the next allocated slot at or after the cursor, which is a slot index; each slot counts as a page
+VerifyResult GuardedAllocator::VerifyNext(size_t& cursor, HeapCorruption& corruption)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	while (cursor < GUARD_SLOT_COUNT && !slots[cursor].address) cursor++;
+	if (cursor == GUARD_SLOT_COUNT) return VERIFY_END;
+	unsigned int index = (unsigned int)cursor++;
+	const char* error = CheckSlot(index);
+	if (!error) return VERIFY_CHECKED;
+	GuardSlot& slot = slots[index];
+	corruption = { slot.address, slot.size, "guarded", (New::Hint)slot.hint, error };
+	return VERIFY_CORRUPT;
+}
+
+void GuardedAllocator::ReportLeaks(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	for (unsigned int i = 0; i < GUARD_SLOT_COUNT; i++)
+	{
+		if (slots[i].address && slots[i].track) {
+			printf("Memory leak of %zu bytes at %p\n", (size_t)slots[i].size, slots[i].address);
+			HeapProfiler::PrintSite(slots[i].address);
+		}
+	}
+}
+
+//#################################################################################################################################
+// Pool Allocator
+//#################################################################################################################################
+
+// Pool pages hold no per-element header. Each page starts with a header, a bitmap with a bit set for each free element
+// and a byte for each element that holds its memory tag in the low four bits and its hint above them, followed by the
+// elements. Pages are aligned to their size so the page of an element is found by masking.
+struct PoolPage : Page
+{
+	PoolPage* next;						// pointers for page list
+	PoolPage* prev;
+	int num_allocations = 0;
+	int list;							// index of the page list that holds the page, or -1
+	unsigned int free_word;				// index of the first bitmap word that may have a free element
+	unsigned int defrag_pass;			// defragmentation pass in which the page was last chosen for evacuation
+	unsigned int idle_frame;			// frame in which the page was retained while empty
+	uint64_t idle_time;					// time in milliseconds at which the page was retained while empty
+	bool decommitted;					// page memory after the header has been returned to the system
+};
+
+// Return the free element bitmap that follows a page header
+static inline uint64_t* GetFreeBits(PoolPage* page) { return (uint64_t*)ptradd(page, sizeof(PoolPage)); }
+
+// Hands out size-aligned pool pages from one reserved address range, so an address is identified as pooled by a range
+// test. Pages released by pools keep their header committed, with no allocator, and are reused before the range grows.
+class PoolArena
+{
+public:
+	PoolArena(size_t page_size, size_t reserve_size);
+
+	bool      Contains(void* address) const { return (size_t)ptrsub(address, base) < reserve_size; }
+	PoolPage* GetPage(void* address) const { return (PoolPage*)((size_t)address & ~(page_size - 1)); }
+	size_t    GetPageSize(void) const { return page_size; }
+	PoolPage* GetPageAt(size_t index) const { return (PoolPage*)ptradd(base, index * page_size); }
+	size_t    GetPageCount(void) { std::lock_guard<std::mutex> lock(mtx); return used / page_size; }	// pages handed out, including released pages
+	PoolPage* MapPage(void);
+	void      UnmapPage(PoolPage* page);
+
+private:
+	void*     base;						// start of the reserved address range, aligned to the page size
+	size_t    reserve_size;				// size in bytes of the reserved address range
+	size_t    page_size;
+	size_t    used = 0;					// bytes of the range handed out as pages
+	PoolPage* released = nullptr;		// list of pages returned by pools; all but their header is decommitted
+	std::mutex mtx;
+};
+
+PoolArena::PoolArena(size_t page_size, size_t reserve_size)
+{
+	// Reserve an extra page so that the range can be aligned to the page size
+	void* range = PageProvider::GetInstance()->Reserve(reserve_size + page_size);
+	if (!range) throw("out of address space");
+	this->base = (void*)(ptradd(range, page_size - 1) & ~(intptr_t)(page_size - 1));
+	this->reserve_size = reserve_size;
+	this->page_size = page_size;
+}
+
+PoolPage* PoolArena::MapPage(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	PoolPage* page = released;
+	if (page)
+	{
+		released = page->next;
+		if (!PageProvider::GetInstance()->Commit((void*)ptradd(page, PAGE_HEADER_SIZE), page_size - PAGE_HEADER_SIZE)) throw("out of memory");
+		return page;
+	}
+	if (used + page_size > reserve_size) throw("out of pool address space");
+	page = (PoolPage*)ptradd(base, used);
+	if (!PageProvider::GetInstance()->Commit(page, page_size)) throw("out of memory");
+	used += page_size;
+	return page;
+}
+
+void PoolArena::UnmapPage(PoolPage* page)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	PageProvider::GetInstance()->Decommit((void*)ptradd(page, PAGE_HEADER_SIZE), page_size - PAGE_HEADER_SIZE);
+	page->allocator = nullptr;
+	page->next = released;
+	released = page;
+}
+
+class PoolAllocator : public Allocator
+{
+public:
+	PoolAllocator(PoolArena* arena, size_t element_size, bool append_sentinel, bool use_thread_cache);
+
+	void* Allocate(unsigned int tag, New::Hint hint);
+	void* Resize(void* address, size_t new_size, bool fill);
+	size_t GetSize(void* address) { (address); return element_size; }
+	unsigned int GetTag(void* address) { return GetLabel(address) & 15; }
+	New::Hint GetHint(void* address) { unsigned int label = GetLabel(address); return label == POOL_FREE_LABEL ? New::Hint::POOLABLE : (New::Hint)(label >> 4); }
+	void  SetTag(void* address, unsigned int tag, New::Hint hint);	// labels an element taken by AllocateBatch and counts it against the tag
+	void* Relocate(void* address, bool fill);
+	void  Free(void* address, bool fill);
+	int   AllocateBatch(void** addresses, int count);
+	int   TakeBatch(void** addresses, int count);		// takes elements for a magazine without counting them as allocated
+	void  FreeBatch(void** addresses, int count, bool fill);
+	void  ReturnBatch(void** addresses, int count);	// frees elements that were checked and filled when freed to a magazine
+	void  CountCached(unsigned int allocations, unsigned int frees);	// counts allocations and frees served by a magazine
+	void  EnableThreadCache(bool flag) { use_thread_cache.store(flag, std::memory_order_relaxed); }
+	bool  IsThreadCacheEnabled(void) const { return use_thread_cache.load(std::memory_order_relaxed); }
+	int   GetCacheSlot(void) const { return cache_slot; }
+	size_t GetAlignment(void) const { return alignment; }
+	static size_t GetStrideAlignment(size_t element_size, bool append_sentinel);	// alignment of a pool's elements
+	void  Scavenge(void);
+	void  SetPageRetention(unsigned int max_pages, unsigned int idle_frames, unsigned int idle_milliseconds);
+	void  GetStats(HeapStats& stats, AllocatorStats& class_stats) const;
+	void  VerifyIntegrity(void);
+	VerifyResult VerifyPage(PoolPage* page, HeapCorruption& corruption);
+	void  ReportLeaks(void);
+	bool  BeginEvacuation(unsigned int pass);
+	void* NextEvacuee(void);
+	size_t EndEvacuation(void);
+
+private:
+	PoolArena* arena;						// source of the pool's pages
+	bool       append_sentinel;
+	std::atomic<bool> use_thread_cache;		// serve allocations and frees from per-thread magazines
+	int        cache_slot;					// index of the magazine used by this pool in each thread cache
+	size_t     page_size;
+	size_t     element_size;
+	size_t     element_stride;				// distance between elements; the element and its sentinel
+	size_t     alignment;					// alignment of every element
+	size_t     elements_offset;				// offset of the first element from the start of its page
+	size_t     num_elements;				// elements in each page
+	size_t     bitmap_words;				// words in the free element bitmap of each page
+	uint64_t   list_scale;					// multiplier that maps an allocation count to a partial list in the upper 32 bits
+	uint64_t   stride_reciprocal;			// multiplier that divides an element offset by the stride in the upper 32 bits
+	PoolPage*  page_lists[POOL_OCCUPANCY_BINS + 1] = {};	// partial pages by occupancy, then full pages
+	unsigned int partial_lists = 0;			// bit set for each non-empty list of partial pages
+	size_t     num_pages = 0;				// pages owned by the pool, including retained pages
+	PageCache<PoolPage> retained;			// empty pages retained for reuse
+	DeferredFreeList deferred;				// frees made while another thread held the lock
+	PoolPage*  evacuating = nullptr;		// page being evacuated, which is in no list, or nullptr
+	size_t     evacuee_index = 0;			// index of the element after the last one returned by NextEvacuee
+	bool       evacuated = false;			// the evacuated page emptied and was released
+	std::mutex mtx;
+
+	void* AllocateElement(void);
+	PoolPage* FindPage(void);
+	int   TakeElements(PoolPage* page, void** addresses, int count);
+	void  CheckElement(void* address, bool fill);
+	unsigned int TakeLabel(void* address);
+	size_t GetFreedIndex(PoolPage* page, void* address) const;
+	void  FreeElement(void* address);
+	void  ReclaimDeferred(void);
+	bool  CheckPage(PoolPage* page, HeapCorruption& corruption);
+	void  InitializePage(PoolPage* page);
+	int   GetPageList(PoolPage* page) const;
+	void  LinkPage(PoolPage* page);
+	void  UnlinkPage(PoolPage* page);
+	void* GetElement(PoolPage* page, size_t index) const { return (void*)ptradd(page, elements_offset + index * element_stride); }
+	size_t GetIndex(PoolPage* page, void* address) const { return (size_t)((((size_t)ptrsub(address, page) - elements_offset) * stride_reciprocal) >> 32); }
+	uint8_t* GetLabels(PoolPage* page) const { return (uint8_t*)ptradd(page, sizeof(PoolPage) + bitmap_words * sizeof(uint64_t)); }
+	unsigned int GetLabel(void* address) const { PoolPage* page = arena->GetPage(address); return GetLabels(page)[GetIndex(page, address)]; }
+};
+
+//#################################################################################################################################
+// Pool Thread Cache
+//#################################################################################################################################
+
+// A bounded stack of free elements held by one thread on behalf of one pool. Elements held in a magazine are not counted
+// as allocated; allocations and frees served by the magazine are counted by the pool in batches, so the pool's live
+// counts lag by up to POOL_MAGAZINE_SIZE elements for each thread.
+struct PoolMagazine
+{
+	PoolAllocator* pool;					// pool that owns the cached elements
+	int count;								// number of cached elements
+	unsigned int allocations;				// allocations served since the pool last counted them
+	unsigned int frees;						// frees served since the pool last counted them
+	void* elements[POOL_MAGAZINE_SIZE];		// addresses of cached elements
+};
+
+// Per-thread magazines; allocations and frees are satisfied without locking and exchanged with the pools in batches.
+// Caches are registered so that disabling the thread cache can return the magazines of every thread to the pools. The
+// owning thread holds the busy flag while it uses its magazines and a flushing thread holds it while emptying them; an
+// owner that finds the flag held bypasses its cache, so the flag is never contended on the allocation path.
+class ThreadCache
+{
+public:
+	ThreadCache(void);
+	~ThreadCache(void);
+
+	void* Allocate(PoolAllocator* pool);			// nullptr if the element must be taken from the pool itself
+	bool  Free(PoolAllocator* pool, void* address);	// false if the element must be returned to the pool itself
+	void  Flush(void);
+
+	static void FlushAll(void);						// flush the magazines of every thread
+
+private:
+	PoolMagazine* magazines = nullptr;		// POOL_CACHE_SLOTS magazines, mapped on first use by the thread
+	std::atomic<bool> busy = false;			// held while the magazines are used or flushed
+	ThreadCache* next;						// pointers for the list of registered caches
+	ThreadCache* prev;
+
+	PoolMagazine* GetMagazine(PoolAllocator* pool);
+	static void ShareCounts(PoolMagazine* m);
+	bool  Acquire(PoolAllocator* pool);
+	void  Release(void) { busy.store(false, std::memory_order_release); }
+	void  FlushMagazines(void);
+};
+
+static std::mutex thread_cache_mtx;					// guards the list of thread caches
+static ThreadCache* thread_cache_list = nullptr;	// caches of running threads
+
+// The destructor of the thread cache returns all cached elements to their pools when the thread exits. The exit flag
+// has no destructor, so it remains valid when the destructor of another thread local object frees memory afterwards.
+static thread_local ThreadCache thread_cache;
+static thread_local bool thread_cache_exited = false;
+
+ThreadCache::ThreadCache(void)
+{
+	std::lock_guard<std::mutex> lock(thread_cache_mtx);
+	list_insert(thread_cache_list, this);
+}
+
+ThreadCache::~ThreadCache(void)
+{
+	{
+		std::lock_guard<std::mutex> lock(thread_cache_mtx);
+		list_remove(thread_cache_list, this);
+	}
+	Flush();
+	if (magazines) PageProvider::GetInstance()->Unmap(magazines, sizeof(PoolMagazine) * POOL_CACHE_SLOTS);
+	magazines = nullptr;
+	thread_cache_exited = true;
+}
+
+// Take the busy flag to use the magazines for a pool; fails if a flush holds the flag or the pool no longer caches. The
+// pool is checked after the flag is taken, so an element is never cached after a flush that disabled the cache.
+bool ThreadCache::Acquire(PoolAllocator* pool)
+{
+	if (busy.exchange(true, std::memory_order_acquire)) return false;
+	if (pool->IsThreadCacheEnabled()) return true;
+	Release();
+	return false;
+}
+
+PoolMagazine* ThreadCache::GetMagazine(PoolAllocator* pool)
+{
+	// Mapped memory is zeroed so every magazine starts unbound and empty
+	if (!magazines) magazines = (PoolMagazine*)MapObject(sizeof(PoolMagazine) * POOL_CACHE_SLOTS);
+	PoolMagazine* m = &magazines[pool->GetCacheSlot()];
+	if (!m->pool)
+	{
+		m->pool = pool;
+	}
+	else if (m->pool != pool)
+	{
+		// The slot is shared with another pool; return its elements before reusing the magazine
+		ShareCounts(m);
+		if (m->count) m->pool->ReturnBatch(m->elements, m->count);
+		m->pool = pool;
+		m->count = 0;
+	}
+	return m;
+}
+
+// Have the pool count the allocations and frees served by a magazine; the caller holds the busy flag
+void ThreadCache::ShareCounts(PoolMagazine* m)
+{
+	if (m->allocations || m->frees) m->pool->CountCached(m->allocations, m->frees);
+	m->allocations = 0;
+	m->frees = 0;
+}
+
+void* ThreadCache::Allocate(PoolAllocator* pool)
+{
+	if (!Acquire(pool)) return nullptr;
+	PoolMagazine* m = GetMagazine(pool);
+	if (m->count == 0)
+	{
+		// Refill half of the magazine so that an alternating allocate/free pattern does not exchange on every call
+		m->count = pool->TakeBatch(m->elements, POOL_MAGAZINE_SIZE / 2);
+	}
+	void* address = m->count ? m->elements[--m->count] : nullptr;
+	if (address && ++m->allocations == POOL_MAGAZINE_SIZE) ShareCounts(m);
+	Release();
+	return address;
+}
+
+bool ThreadCache::Free(PoolAllocator* pool, void* address)
+{
+	if (!Acquire(pool)) return false;
+	PoolMagazine* m = GetMagazine(pool);
+	if (m->count == POOL_MAGAZINE_SIZE)
+	{
+		// Return the older half of the magazine to the pool and keep the most recently freed elements
+		pool->ReturnBatch(m->elements, POOL_MAGAZINE_SIZE / 2);
+		memmove(m->elements, &m->elements[POOL_MAGAZINE_SIZE / 2], sizeof(void*) * (POOL_MAGAZINE_SIZE / 2));
+		m->count = POOL_MAGAZINE_SIZE / 2;
+	}
+	m->elements[m->count++] = address;
+	if (++m->frees == POOL_MAGAZINE_SIZE) ShareCounts(m);
+	Release();
+	return true;
+}
+
+// Empty the magazines; the caller holds the busy flag
+void ThreadCache::FlushMagazines(void)
+{
+	if (!magazines) return;
+	for (int i = 0; i < POOL_CACHE_SLOTS; i++)
+	{
+		PoolMagazine* m = &magazines[i];
+		ShareCounts(m);
+		if (m->count)
+		{
+			m->pool->ReturnBatch(m->elements, m->count);
+			m->count = 0;
+		}
+	}
+}
+
+// Wait for the owner of the magazines to finish using them, then empty them
+void ThreadCache::Flush(void)
+{
+	while (busy.exchange(true, std::memory_order_acquire)) std::this_thread::yield();
+	FlushMagazines();
+	Release();
+}
+
+void ThreadCache::FlushAll(void)
+{
+	std::lock_guard<std::mutex> lock(thread_cache_mtx);
+	for (ThreadCache* cache = thread_cache_list; cache != nullptr; cache = cache->next)
+	{
+		cache->Flush();
+	}
+}
+
+//#################################################################################################################################
+// Pool Allocator Implementation
+//#################################################################################################################################
+
+static int GetSizeClass(size_t size);
+
+// Pools are assigned magazine slots in creation order; pools that share a slot rebind the magazine when used
+static std::atomic<unsigned int> next_cache_slot = 0;
+
+// Elements are aligned to the largest power of two that divides the stride, up to POOL_MAX_ALIGNMENT
+size_t PoolAllocator::GetStrideAlignment(size_t element_size, bool append_sentinel)
+{
+	element_size = (element_size + 7) & -8;
+	size_t stride = append_sentinel ? element_size + sizeof(Sentinel) : element_size;
+	size_t alignment = stride & (0 - stride);
+	return alignment > POOL_MAX_ALIGNMENT ? POOL_MAX_ALIGNMENT : alignment;
+}
+
+PoolAllocator::PoolAllocator(PoolArena* arena, size_t element_size, bool append_sentinel, bool use_thread_cache)
+{
+	this->arena = arena;
+	this->page_size = arena->GetPageSize();
+	this->append_sentinel = append_sentinel;
+	this->use_thread_cache = use_thread_cache;
+	this->cache_slot = (int)(next_cache_slot++ % POOL_CACHE_SLOTS);
+
+	// round size to 64-bit boundary
+	element_size = (element_size + 7) & -8;
+	this->element_size = element_size;
+	this->element_stride = append_sentinel ? element_size + sizeof(Sentinel) : element_size;
+	alignment = GetStrideAlignment(element_size, append_sentinel);
+
+	// Fit as many elements as possible after the header, one bitmap bit and one label byte per element; the bitmap may
+	// need one word more than its bits fill, and the first element may need padding to align it
+	size_t space = page_size - sizeof(PoolPage) - sizeof(uint64_t) - (alignment - 8);
+	num_elements = space * 8 / (element_stride * 8 + 9);
+	bitmap_words = (num_elements + 63) / 64;
+	elements_offset = (sizeof(PoolPage) + bitmap_words * sizeof(uint64_t) + num_elements + alignment - 1) & ~(alignment - 1);
+	list_scale = ((uint64_t)POOL_OCCUPANCY_BINS << 32) / num_elements;
+
+	// Element offsets are multiples of the stride below 2^32, which the rounded up reciprocal divides exactly
+	stride_reciprocal = (((uint64_t)1 << 32) + element_stride - 1) / element_stride;
+}
+
+void* PoolAllocator::Allocate(unsigned int tag, New::Hint hint)
+{
+	void* address = use_thread_cache.load(std::memory_order_relaxed) && !thread_cache_exited ? thread_cache.Allocate(this) : nullptr;
+	if (!address) {
+		std::lock_guard<std::mutex> lock(mtx);
+		ReclaimDeferred();
+		address = AllocateElement();
+		Count(element_size);
+	}
+	SetTag(address, tag, hint);
+	return address;
+}
+
+// Elements are labelled when handed to the caller, so elements held in magazines are not counted against a tag
+void PoolAllocator::SetTag(void* address, unsigned int tag, New::Hint hint)
+{
+	PoolPage* page = arena->GetPage(address);
+	GetLabels(page)[GetIndex(page, address)] = (uint8_t)(tag | ((unsigned int)hint << 4));
+	TagCount(tag, element_size);
+}
+
+int PoolAllocator::AllocateBatch(void** addresses, int count)
+{
+	int taken = TakeBatch(addresses, count);
+	Count(element_size, taken);
+	return taken;
+}
+
+int PoolAllocator::TakeBatch(void** addresses, int count)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	int i = 0;
+	while (i < count)
+	{
+		i += TakeElements(FindPage(), &addresses[i], count - i);
+	}
+	return i;
+}
+
+// Frees are counted first so that the peak is not raised by allocations whose elements were freed again
+void PoolAllocator::CountCached(unsigned int allocations, unsigned int frees)
+{
+	Uncount(element_size, frees);
+	Count(element_size, allocations);
+}
+
+// Pages in use are held in lists by occupancy. Partial pages are sorted into POOL_OCCUPANCY_BINS lists by the fraction
+// of their elements allocated, and full pages are held in the last list. Allocation takes a page from the fullest
+// non-empty partial list, so allocations pack into few pages and emptier pages are left to drain.
+int PoolAllocator::GetPageList(PoolPage* page) const
+{
+	if ((size_t)page->num_allocations == num_elements) return POOL_OCCUPANCY_BINS;
+	return (int)((page->num_allocations * list_scale) >> 32);
+}
+
+void PoolAllocator::LinkPage(PoolPage* page)
+{
+	page->list = GetPageList(page);
+	list_insert(page_lists[page->list], page);
+	if (page->list < POOL_OCCUPANCY_BINS) partial_lists |= 1u << page->list;
+}
+
+void PoolAllocator::UnlinkPage(PoolPage* page)
+{
+	list_remove(page_lists[page->list], page);
+	if (page->list < POOL_OCCUPANCY_BINS && !page_lists[page->list]) partial_lists &= ~(1u << page->list);
+	page->list = -1;
+}
+
+void* PoolAllocator::AllocateElement(void)
+{
+	void* address;
+	TakeElements(FindPage(), &address, 1);
+	return address;
+}
+
+// Return a page with a free element. Pages that are not yet in a list have a list index of -1.
+PoolPage* PoolAllocator::FindPage(void)
+{
+	// Take a page from the fullest list of partial pages
+	PoolPage* page = partial_lists ? page_lists[HighestBit(partial_lists)] : nullptr;
+
+	// If we didn't find a page with a free element then reuse a retained page; its elements are all free already
+	// unless the page was decommitted, in which case its sentinels are lost and the page is rebuilt
+	if (!page && (page = retained.Reuse()) != nullptr)
+	{
+		if (page->decommitted) {
+			RecommitPage(page, page_size);
+			InitializePage(page);
+		}
+		page->list = -1;
+		page_reuses++;
+	}
+
+	// Otherwise add a new page
+	if (!page)
+	{
+		page = arena->MapPage();
+		page_maps++;
+		page->allocator = this;
+		InitializePage(page);
+		page->list = -1;
+		num_pages++;
+	}
+	return page;
+}
+
+// Allocate up to count free elements of a page in address order, then move the page to the list for its new occupancy;
+// returns the number allocated
+int PoolAllocator::TakeElements(PoolPage* page, void** addresses, int count)
+{
+	uint64_t* bits = GetFreeBits(page);
+	unsigned int word = page->free_word;
+	int taken = 0;
+	while (taken < count && (size_t)page->num_allocations < num_elements)
+	{
+		while (bits[word] == 0) word++;
+		size_t index = word * 64 + LowestBit(bits[word]);
+		bits[word] &= bits[word] - 1;
+		page->num_allocations++;
+		addresses[taken++] = GetElement(page, index);
+	}
+	page->free_word = word;
+
+	int list = GetPageList(page);
+	if (list != page->list)
+	{
+		if (page->list >= 0) UnlinkPage(page);
+		LinkPage(page);
+	}
+	return taken;
+}
+
+// Mark every element of a page free
+void PoolAllocator::InitializePage(PoolPage* page)
+{
+	page->num_allocations = 0;
+	page->free_word = 0;
+	page->defrag_pass = 0;
+	uint64_t* bits = GetFreeBits(page);
+	memset(bits, 0xFF, (num_elements / 64) * sizeof(uint64_t));
+	if (num_elements % 64) bits[num_elements / 64] = ((uint64_t)1 << (num_elements % 64)) - 1;
+	memset(GetLabels(page), POOL_FREE_LABEL, num_elements);
+	if (append_sentinel)
+	{
+		for (size_t i = 0; i < num_elements; i++)
+		{
+			Sentinel* sentinel = (Sentinel*)ptradd(GetElement(page, i), element_size);
+			sentinel->value = MEMORY_SENTINEL;
+		}
+	}
+}
+
+// An element holds any size of its class; other sizes return nullptr and the heap moves the element
+void* PoolAllocator::Resize(void* address, size_t new_size, bool fill)
+{
+	(fill);		// unreferenced parameter
+	if (new_size > element_size || GetSizeClass(new_size) != GetSizeClass(element_size)) return nullptr;
+	return address;
+}
+
+// Move an element to the fullest page with a free element. The thread cache is bypassed so that an element is never
+// moved to one that was freed within the page being evacuated.
+void* PoolAllocator::Relocate(void* address, bool fill)
+{
+	unsigned int label = TakeLabel(address);
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	void* new_address = AllocateElement();
+	memcpy(new_address, address, element_size);
+	SetTag(new_address, label & 15, (New::Hint)(label >> 4));
+	CheckElement(address, fill);
+	TagUncount(label & 15, element_size);
+	FreeElement(address);
+	return new_address;
+}
+
+// Test the sentinel of an element being freed and optionally fill it
+void PoolAllocator::CheckElement(void* address, bool fill)
+{
+	if (append_sentinel) {
+		Sentinel* sentinel = (Sentinel*)ptradd(address, element_size);
+		if (sentinel->value != MEMORY_SENTINEL) throw("Pool element buffer overrun");
+	}
+
+	if (fill) memset(address, FILL_VALUE, element_size);
+}
+
+// Mark the label of an element being freed and return its previous value. An element freed to a magazine is not free
+// in its page bitmap until the magazine returns it, so a second free is detected by the label instead.
+unsigned int PoolAllocator::TakeLabel(void* address)
+{
+	PoolPage* page = arena->GetPage(address);
+	uint8_t* label = &GetLabels(page)[GetFreedIndex(page, address)];
+	unsigned int value = *label;
+	if (value == POOL_FREE_LABEL) throw("heap address was freed or has expired");
+	*label = POOL_FREE_LABEL;
+	return value;
+}
+
+void  PoolAllocator::Free(void* address, bool fill)
+{
+	unsigned int label = TakeLabel(address);
+	CheckElement(address, fill);
+	TagUncount(label & 15, element_size);
+
+	if (use_thread_cache.load(std::memory_order_relaxed) && !thread_cache_exited && thread_cache.Free(this, address)) return;
+	Uncount(element_size);
+
+	// If another thread holds the lock then leave the element for the next thread that takes it
+	std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+	if (!lock.owns_lock())
+	{
+		deferred.Push(address);
+		return;
+	}
+	ReclaimDeferred();
+	FreeElement(address);
+}
+
+// Free elements under one acquisition of the lock; elements do not pass through the thread cache
+void PoolAllocator::FreeBatch(void** addresses, int count, bool fill)
+{
+	for (int i = 0; i < count; i++)
+	{
+		unsigned int label = TakeLabel(addresses[i]);
+		CheckElement(addresses[i], fill);
+		TagUncount(label & 15, element_size);
+	}
+	Uncount(element_size, count);
+	ReturnBatch(addresses, count);
+}
+
+void PoolAllocator::ReturnBatch(void** addresses, int count)
+{
+	if (count == 0) return;
+
+	// If another thread holds the lock then chain the elements and leave them for the next thread that takes it
+	std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+	if (!lock.owns_lock())
+	{
+		for (int i = 0; i < count - 1; i++)
+		{
+			DeferredFreeList::Link(addresses[i], addresses[i + 1]);
+		}
+		deferred.Push(addresses[0], addresses[count - 1]);
+		return;
+	}
+	ReclaimDeferred();
+	for (int i = 0; i < count; i++)
+	{
+		FreeElement(addresses[i]);
+	}
+}
+
+// Return deferred frees to their pages; the caller holds the lock. As for the region allocator, the whole list is
+// reclaimed before an error is thrown.
+void PoolAllocator::ReclaimDeferred(void)
+{
+	const char* error = nullptr;
+	void* address = deferred.TakeAll();
+	while (address)
+	{
+		void* next = DeferredFreeList::Next(address);
+		try {
+			FreeElement(address);
+		}
+		catch (const char* message) {
+			if (!error) error = message;
+		}
+		address = next;
+	}
+	if (error) throw(error);
+}
+
+// Return the index of an element being freed, checking that the address is the start of an element of the page
+size_t PoolAllocator::GetFreedIndex(PoolPage* page, void* address) const
+{
+	size_t offset = (size_t)ptrsub(address, page) - elements_offset;
+	size_t index = offset / element_stride;
+	if (offset % element_stride || index >= num_elements) throw("pool free of an invalid address");
+	return index;
+}
+
+void PoolAllocator::FreeElement(void* address)
+{
+	// Return the element to its page; the bitmap shows whether it was already free
+	PoolPage* page = arena->GetPage(address);
+	size_t index = GetFreedIndex(page, address);
+	uint64_t* bits = GetFreeBits(page);
+	uint64_t bit = (uint64_t)1 << (index % 64);
+	unsigned int word = (unsigned int)(index / 64);
+	if (bits[word] & bit) throw("heap address was freed or has expired");
+	bits[word] |= bit;
+	if (word < page->free_word) page->free_word = word;
+	page->num_allocations--;
+
+	// Retain or remove the page if empty, otherwise move it to the list for its new occupancy. The page being
+	// evacuated is in no list.
+	bool listed = page != evacuating;
+	if (page->num_allocations == 0)
+	{
+		if (listed) {
+			UnlinkPage(page);
+		}
+		else {
+			evacuating = nullptr;
+			evacuated = true;
+		}
+		if (!retained.Retain(page)) {
+			arena->UnmapPage(page);
+			page_unmaps++;
+			num_pages--;
+		}
+	}
+	else if (listed && GetPageList(page) != page->list)
+	{
+		UnlinkPage(page);
+		LinkPage(page);
+	}
+}
+
+void PoolAllocator::VerifyIntegrity(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	for (int list = 0; list <= POOL_OCCUPANCY_BINS; list++)
+	{
+		for (PoolPage* page = page_lists[list]; page != nullptr; page = page->next)
+		{
+			if (page->list != list) throw("pool allocator page is in the wrong list");
+			HeapCorruption corruption;
+			if (!CheckPage(page, corruption)) throw(corruption.size ? "pool allocator buffer overrun" : "pool allocator bitmap is corrupt");
+		}
+	}
+}
+
+// Check a page found in the arena if it is in use by this pool; returns VERIFY_END for a page that is not. The page
+// cannot be released while the lock is held.
+VerifyResult PoolAllocator::VerifyPage(PoolPage* page, HeapCorruption& corruption)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	if (page->allocator != this || (page->list < 0 && page != evacuating)) return VERIFY_END;
+	return CheckPage(page, corruption) ? VERIFY_CHECKED : VERIFY_CORRUPT;
+}
+
+// Check that the free bits agree with the allocation count and that every sentinel is intact; the caller holds the lock
+bool PoolAllocator::CheckPage(PoolPage* page, HeapCorruption& corruption)
+{
+	uint64_t* bits = GetFreeBits(page);
+	size_t num_free = 0;
+	for (size_t i = 0; i < bitmap_words; i++)
+	{
+		num_free += std::bitset<64>(bits[i]).count();
+	}
+	if (num_free + page->num_allocations != num_elements)
+	{
+		corruption = { page, 0, "pool", New::Hint::POOLABLE, "page bitmap is corrupt" };
+		return false;
+	}
+
+	if (append_sentinel)
+	{
+		for (size_t i = 0; i < num_elements; i++)
+		{
+			void* element = GetElement(page, i);
+			Sentinel* sentinel = (Sentinel*)ptradd(element, element_size);
+			if (sentinel->value == MEMORY_SENTINEL) continue;
+			bool is_free = (bits[i / 64] >> (i % 64)) & 1;
+			corruption = { element, element_size, "pool", GetHint(element), is_free ? "write to a free element" : "buffer overrun" };
+			return false;
+		}
+	}
+	return true;
+}
+
+// As for the region allocator, a lock held by another thread leaves the work for a later frame
+void PoolAllocator::Scavenge(void)
+{
+	std::unique_lock<std::mutex> lock(mtx, std::try_to_lock);
+	if (!lock.owns_lock()) return;
+	ReclaimDeferred();
+	while (PoolPage* page = retained.Excess())
+	{
+		arena->UnmapPage(page);
+		page_unmaps++;
+		num_pages--;
+	}
+	while (PoolPage* page = retained.Idle())
+	{
+		if (DecommitPage(page, page_size)) continue;
+		retained.Recommitted(page);		// leave the page committed rather than retry it at once
+		break;
+	}
+}
+
+void PoolAllocator::SetPageRetention(unsigned int max_pages, unsigned int idle_frames, unsigned int idle_milliseconds)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	retained.max_pages = max_pages;
+	retained.idle_frames = idle_frames;
+	retained.idle_milliseconds = idle_milliseconds;
+}
+
+void PoolAllocator::GetStats(HeapStats& stats, AllocatorStats& class_stats) const
+{
+	// Elements held in thread magazines or waiting on the deferred list are counted as free. A free may be counted before
+	// the magazine allocation of its element, so the live counts are briefly negative and are then reported as zero.
+	GetUsage(class_stats);
+	if ((ptrdiff_t)class_stats.live_allocations < 0 || (ptrdiff_t)class_stats.live_bytes < 0) {
+		class_stats.live_allocations = 0;
+		class_stats.live_bytes = 0;
+	}
+	class_stats.pages = num_pages;
+	class_stats.page_bytes = num_pages * page_size;
+	size_t capacity = num_pages * num_elements;
+	class_stats.free_bytes = capacity > class_stats.live_allocations ? (capacity - class_stats.live_allocations) * element_size : 0;
+	class_stats.largest_free = class_stats.free_bytes ? element_size : 0;
+
+	stats.pool_count++;
+	stats.page_map_count += page_maps;
+	stats.page_unmap_count += page_unmaps;
+	stats.page_reuse_count += page_reuses;
+	stats.page_decommit_count += page_decommits;
+	stats.retained_page_bytes += retained.committed * page_size;
+}
+
+void PoolAllocator::ReportLeaks(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	for (int list = 0; list <= POOL_OCCUPANCY_BINS; list++)
+	{
+		for (PoolPage* p = page_lists[list]; p != nullptr; p = p->next)
+		{
+			if (p->num_allocations > 0) printf("Memory leak of %d pool elements of %zu bytes\n", p->num_allocations, element_size);
+		}
+	}
+}
+
+// Choose the page with the fewest allocations among those below DEFRAG_MAX_OCCUPANCY of their capacity, and take it out
+// of the page lists so that nothing is allocated from it. A page is chosen once per pass, and only if every allocated
+// element is relocatable and the other pages in use have a free element for each.
+bool PoolAllocator::BeginEvacuation(unsigned int pass)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	for (;;)
+	{
+		PoolPage* sparse = nullptr;
+		for (int list = 0; list * 100 < DEFRAG_MAX_OCCUPANCY * POOL_OCCUPANCY_BINS; list++)
+		{
+			for (PoolPage* page = page_lists[list]; page != nullptr; page = page->next)
+			{
+				if (page->defrag_pass != pass && (!sparse || page->num_allocations < sparse->num_allocations)) sparse = page;
+			}
+		}
+		if (!sparse) return false;
+		sparse->defrag_pass = pass;
+
+		size_t free_elsewhere = (num_pages - retained.count - 1) * num_elements - (num_allocations - sparse->num_allocations);
+		if (free_elsewhere < (size_t)sparse->num_allocations) continue;
+
+		bool relocatable = true;
+		uint64_t* bits = GetFreeBits(sparse);
+		for (size_t i = 0; i < num_elements && relocatable; i++)
+		{
+			if (!((bits[i / 64] >> (i % 64)) & 1)) relocatable = relocations.Contains(GetElement(sparse, i));
+		}
+		if (!relocatable) continue;
+
+		UnlinkPage(sparse);
+		evacuating = sparse;
+		evacuee_index = 0;
+		evacuated = false;
+		return true;
+	}
+}
+
+// Return the next allocated element of the page being evacuated
+void* PoolAllocator::NextEvacuee(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	if (!evacuating) return nullptr;
+	uint64_t* bits = GetFreeBits(evacuating);
+	for (; evacuee_index < num_elements; evacuee_index++)
+	{
+		if (!((bits[evacuee_index / 64] >> (evacuee_index % 64)) & 1)) return GetElement(evacuating, evacuee_index++);
+	}
+	return nullptr;
+}
+
+// Return a page that did not empty to the list for its occupancy
+size_t PoolAllocator::EndEvacuation(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	ReclaimDeferred();
+	if (evacuating)
+	{
+		LinkPage(evacuating);
+		evacuating = nullptr;
+	}
+	return evacuated ? page_size : 0;
+}
+
+
+//#################################################################################################################################
+// Pool Size Classes
+//#################################################################################################################################
+
+// Pool allocations are rounded up to a size class. Classes step by 8 bytes from 8 to 64 bytes, then divide each
+// power-of-two range into 8 geometric steps so that rounding wastes no more than 12.5% of an allocation.
+#define POOL_LINEAR_CLASSES		(8)						// Number of 8-byte classes from 8 to 64 bytes
+#define POOL_CLASS_STEPS		(8)						// Number of classes in each power-of-two range above 64 bytes
+
+static int GetSizeClass(size_t size)
+{
+	if (size <= 64) {
+		return size <= 8 ? 0 : (int)((size - 1) >> 3);
+	}
+	int k = HighestBit(size - 1);
+	int step = (int)((size - 1) >> (k - 3));		// 8..15
+	return POOL_LINEAR_CLASSES + (k - 6) * POOL_CLASS_STEPS + (step - POOL_CLASS_STEPS);
+}
+
+static size_t GetClassSize(int size_class)
+{
+	if (size_class < POOL_LINEAR_CLASSES) {
+		return (size_t)(size_class + 1) * 8;
+	}
+	int j = size_class - POOL_LINEAR_CLASSES;
+	int k = 6 + j / POOL_CLASS_STEPS;
+	int step = POOL_CLASS_STEPS + j % POOL_CLASS_STEPS;
+	return (size_t)(step + 1) << (k - 3);
+}
+
+//#################################################################################################################################
+// Size Promotion
+//#################################################################################################################################
+
+// DEFAULT allocations are sampled to learn which sizes are allocated often and freed soon after. When a window of
+// samples of a size class has been freed, the class is promoted if the window filled quickly and most of its samples
+// were short-lived; later DEFAULT allocations of the class are then served from the pool of the class. Promotions last
+// until the profile is cleared, and a saved profile lets the next session promote its classes from the start.
+struct PromoteSample
+{
+	void* address;					// nullptr marks an unused entry
+	uint64_t time;					// time in milliseconds at which the sampled allocation was made
+	int size_class;
+};
+
+class SizePromoter
+{
+public:
+	void Enable(bool flag) { enabled = flag; }
+	bool IsPromoted(int size_class) const { return promoted[size_class].load(std::memory_order_relaxed); }
+	bool IsActive(int size_class) const { return enabled.load(std::memory_order_relaxed) && IsPromoted(size_class); }	// promoted and enabled
+	void Promote(int size_class) { if (!promoted[size_class].exchange(true)) num_promoted++; }
+	void Clear(void);
+	size_t GetPromotedCount(void) const { return num_promoted; }
+	bool ShouldSample(void)
+	{
+		if (!enabled.load(std::memory_order_relaxed) || --countdown > 0) return false;
+		countdown = DrawSampleInterval(PROMOTE_SAMPLE_RATE);
+		return true;
+	}
+	void Sample(void* address, int size_class);
+	void OnFree(void* address) { if (filter[GetFilterIndex(address)].load(std::memory_order_relaxed)) Release(address, true); }
+	void OnMove(void* address) { if (filter[GetFilterIndex(address)].load(std::memory_order_relaxed)) Release(address, false); }
+
+private:
+	std::atomic<bool> enabled = false;
+	std::atomic<bool> promoted[POOL_SIZE_CLASSES] = {};
+	std::atomic<size_t> num_promoted = 0;
+	std::atomic<unsigned short> filter[PROMOTE_FILTER_SIZE] = {};	// count of live samples by address hash
+	std::mutex mtx;													// guards the samples and windows
+	PromoteSample samples[PROMOTE_MAX_SAMPLES] = {};				// open addressed by address
+	unsigned int num_samples = 0;
+	unsigned int window_sampled[POOL_SIZE_CLASSES] = {};			// samples taken in the current window of each class
+	unsigned int window_freed[POOL_SIZE_CLASSES] = {};				// samples freed in the current window
+	unsigned int window_short[POOL_SIZE_CLASSES] = {};				// samples freed within PROMOTE_LIFETIME_MS
+	uint64_t window_start[POOL_SIZE_CLASSES] = {};					// time at which the current window started
+	static thread_local int countdown;								// allocations the thread makes before its next sample
+
+	static unsigned int GetFilterIndex(void* address) { return (unsigned int)((((uint64_t)address >> 4) * 0x9E3779B97F4A7C15ull) >> 52); }
+	static unsigned int GetSampleIndex(void* address) { return (unsigned int)((((uint64_t)address >> 4) * 0x9E3779B97F4A7C15ull) >> 32) & (PROMOTE_MAX_SAMPLES - 1); }
+	void Release(void* address, bool freed);
+};
+
+thread_local int SizePromoter::countdown = 0;
+static SizePromoter size_promoter;
+
+void SizePromoter::Clear(void)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	for (int i = 0; i < POOL_SIZE_CLASSES; i++)
+	{
+		promoted[i] = false;
+		window_sampled[i] = window_freed[i] = window_short[i] = 0;
+	}
+	num_promoted = 0;
+}
+
+void SizePromoter::Sample(void* address, int size_class)
+{
+	if (!address || IsPromoted(size_class)) return;
+	uint64_t time = GetMilliseconds();
+	std::lock_guard<std::mutex> lock(mtx);
+	if (num_samples >= PROMOTE_MAX_SAMPLES * 3 / 4) return;
+	unsigned int index = GetSampleIndex(address);
+	while (samples[index].address != nullptr)
+	{
+		index = (index + 1) & (PROMOTE_MAX_SAMPLES - 1);
+	}
+	samples[index] = { address, time, size_class };
+	num_samples++;
+	filter[GetFilterIndex(address)].fetch_add(1, std::memory_order_relaxed);
+	if (window_sampled[size_class]++ == 0) window_start[size_class] = time;
+}
+
+// Remove a sample when its allocation is freed or moves; only freed samples have a lifetime
+void SizePromoter::Release(void* address, bool freed)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	unsigned int index = GetSampleIndex(address);
+	while (samples[index].address != address)
+	{
+		if (samples[index].address == nullptr) return;
+		index = (index + 1) & (PROMOTE_MAX_SAMPLES - 1);
+	}
+	PromoteSample sample = samples[index];
+	filter[GetFilterIndex(address)].fetch_sub(1, std::memory_order_relaxed);
+	num_samples--;
+
+	// Move later entries of the probe sequence back so that no tombstones are needed
+	unsigned int hole = index;
+	for (;;)
+	{
+		index = (index + 1) & (PROMOTE_MAX_SAMPLES - 1);
+		if (samples[index].address == nullptr) break;
+		unsigned int home = GetSampleIndex(samples[index].address);
+		if (((index - home) & (PROMOTE_MAX_SAMPLES - 1)) >= ((index - hole) & (PROMOTE_MAX_SAMPLES - 1)))
+		{
+			samples[hole] = samples[index];
+			hole = index;
+		}
+	}
+	samples[hole].address = nullptr;
+	if (!freed) return;
+
+	// Decide on the class when its window is complete; samples still live count against promotion
+	int c = sample.size_class;
+	uint64_t time = GetMilliseconds();
+	window_freed[c]++;
+	if (time - sample.time <= PROMOTE_LIFETIME_MS) window_short[c]++;
+	if (window_freed[c] < PROMOTE_WINDOW) return;
+	unsigned int window = window_sampled[c] > window_freed[c] ? window_sampled[c] : window_freed[c];
+	if (time - window_start[c] <= PROMOTE_HOT_MS && window_short[c] * 100 >= window * PROMOTE_SHORT_PERCENT) Promote(c);
+	window_sampled[c] = window_freed[c] = window_short[c] = 0;
+}
+
+//#################################################################################################################################
+// Global Heap
+//#################################################################################################################################
+
+// Tables of the statistics written by the CSV and JSON dumps
+static const struct { const char* name; AllocatorStats HeapStats::* member; } allocator_groups[] = {
+	{ "system", &HeapStats::system },
+	{ "region", &HeapStats::region },
+	{ "transient", &HeapStats::transient },
+	{ "permanent", &HeapStats::permanent },
+	{ "guarded", &HeapStats::guarded },
+	{ "pools", &HeapStats::pools },
+};
+static const struct { const char* name; size_t AllocatorStats::* member; } allocator_fields[] = {
+	{ "live_allocations", &AllocatorStats::live_allocations },
+	{ "live_bytes", &AllocatorStats::live_bytes },
+	{ "peak_bytes", &AllocatorStats::peak_bytes },
+	{ "allocation_count", &AllocatorStats::allocation_count },
+	{ "pages", &AllocatorStats::pages },
+	{ "page_bytes", &AllocatorStats::page_bytes },
+	{ "free_bytes", &AllocatorStats::free_bytes },
+	{ "largest_free", &AllocatorStats::largest_free },
+};
+static const struct { const char* name; size_t HeapStats::* member; } heap_counters[] = {
+	{ "pool_count", &HeapStats::pool_count },
+	{ "permanent_used_bytes", &HeapStats::permanent_used_bytes },
+	{ "permanent_free_count", &HeapStats::permanent_free_count },
+	{ "page_map_count", &HeapStats::page_map_count },
+	{ "page_unmap_count", &HeapStats::page_unmap_count },
+	{ "page_reuse_count", &HeapStats::page_reuse_count },
+	{ "page_decommit_count", &HeapStats::page_decommit_count },
+	{ "retained_page_bytes", &HeapStats::retained_page_bytes },
+	{ "resize_in_place_count", &HeapStats::resize_in_place_count },
+	{ "resize_copy_count", &HeapStats::resize_copy_count },
+	{ "large_cache_bytes", &HeapStats::large_cache_bytes },
+	{ "large_reuse_count", &HeapStats::large_reuse_count },
+	{ "promoted_allocation_count", &HeapStats::promoted_allocation_count },
+	{ "promoted_class_count", &HeapStats::promoted_class_count },
+	{ "verify_page_count", &HeapStats::verify_page_count },
+	{ "verify_pass_count", &HeapStats::verify_pass_count },
+	{ "defrag_moved_bytes", &HeapStats::defrag_moved_bytes },
+	{ "defrag_reclaimed_bytes", &HeapStats::defrag_reclaimed_bytes },
+	{ "defrag_pass_count", &HeapStats::defrag_pass_count },
+	{ "defrag_pass_reclaimed_bytes", &HeapStats::defrag_pass_reclaimed_bytes },
+};
+static const char* hint_names[HEAP_HINT_COUNT] = { "default", "permanent", "transient", "poolable" };
+
+// Add the usage of one allocator to a group total; peaks are summed so the group peak is an upper bound
+static void AddAllocatorStats(AllocatorStats& total, const AllocatorStats& stats)
+{
+	size_t largest_free = total.largest_free > stats.largest_free ? total.largest_free : stats.largest_free;
+	for (auto& field : allocator_fields) total.*field.member += stats.*field.member;
+	total.largest_free = largest_free;
+}
+
+static void SetAllocationRate(AllocatorStats& stats, const AllocatorStats& previous, double seconds)
+{
+	stats.allocation_rate = (stats.allocation_count - previous.allocation_count) / seconds;
+}
+
+// Tiers visited in order by the incremental verifier
+#define VERIFY_TIER_SYSTEM		(0)
+#define VERIFY_TIER_GUARDED		(1)
+#define VERIFY_TIER_REGION		(2)
+#define VERIFY_TIER_POOL		(3)
+#define VERIFY_TIER_COUNT		(4)
+
+// Global heap instance
+static Heap global_heap;
+Heap* Heap::GetInstance(void) {return &global_heap;}
+
+void Heap::VerifyIntegrity(void)
+{
+	if (system_allocator) system_allocator->VerifyIntegrity();
+	if (guarded_allocator) guarded_allocator->VerifyIntegrity();
+	if (default_allocator) default_allocator->VerifyIntegrity();
+	for (int i = 0; i < POOL_SIZE_CLASSES; i++)
+	{
+		PoolAllocator* p = pools[i];
+		if (p != nullptr) p->VerifyIntegrity();
+	}
+}
+
+// Check up to max_pages pages, continuing from where the previous step stopped; a step stops early when it completes a
+// pass over the heap. Each page is checked under the lock of its allocator, so steps may be taken from any thread while
+// other threads allocate and free. The first corrupted allocation found is reported and returned.
+bool Heap::VerifyStep(unsigned int max_pages, HeapCorruption* corruption)
+{
+	std::lock_guard<std::mutex> lock(verify_mtx);
+	HeapCorruption found;
+	unsigned int checked = 0;
+	while (checked < max_pages)
+	{
+		int result = VerifyNext(found);
+		if (result == VERIFY_CHECKED)
+		{
+			checked++;
+			verify_pages++;
+		}
+		else if (result == VERIFY_CORRUPT)
+		{
+			printf("Heap corruption: %s of %s allocation of %zu bytes at %p with %s hint\n", found.error, found.tier, found.size, found.address,
+				hint_names[(int)found.hint]);
+			HeapProfiler::PrintSite(found.address);
+			if (corruption) *corruption = found;
+			return false;
+		}
+		else
+		{
+			// Move to the next tier, and stop at the end of a pass
+			verify_cursor = 0;
+			if (++verify_tier == VERIFY_TIER_COUNT)
+			{
+				verify_tier = 0;
+				verify_passes++;
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+// Check the next page of the tier being verified, advancing the cursor
+int Heap::VerifyNext(HeapCorruption& corruption)
+{
+	switch (verify_tier)
+	{
+	case VERIFY_TIER_SYSTEM:
+		return system_allocator ? system_allocator->VerifyNext(verify_cursor, corruption) : VERIFY_END;
+	case VERIFY_TIER_GUARDED:
+		return guarded_allocator ? guarded_allocator->VerifyNext(verify_cursor, corruption) : VERIFY_END;
+	case VERIFY_TIER_REGION:
+		return default_allocator ? default_allocator->VerifyNext(verify_cursor, corruption) : VERIFY_END;
+	default:
+	{
+		// Pool pages are visited in arena order. A page released to the arena has no allocator, and a page that is
+		// released or reassigned between reading its allocator and taking the lock is skipped by the pool.
+		size_t page_count = pool_arena ? pool_arena->GetPageCount() : 0;
+		while (verify_cursor < page_count)
+		{
+			PoolPage* page = pool_arena->GetPageAt(verify_cursor++);
+			PoolAllocator* pool = (PoolAllocator*)page->allocator;
+			if (!pool) continue;
+			VerifyResult result = pool->VerifyPage(page, corruption);
+			if (result != VERIFY_END) return result;
+		}
+		return VERIFY_END;
+	}
+	}
+}
+
+void Heap::AddRelocatable(void** reference)
+{
+	relocations.Add(reference);
+}
+
+void* Heap::RemoveRelocatable(void** reference)
+{
+	return relocations.Remove(reference);
+}
+
+// Return the allocator of a tier visited by the defragmenter: the region allocator, then the pools by size class
+Allocator* Heap::GetDefragmentTier(int tier)
+{
+	if (tier == 0) return default_allocator;
+	return pools[tier - 1];
+}
+
+// Move relocatable allocations out of sparse region and pool pages until the budget is spent, continuing from where the
+// previous step stopped. Each allocator evacuates one page at a time; a page is released when its last allocation moves
+// or is freed. Pages holding an allocation that is not relocatable, including pool elements cached by another thread,
+// are left in place. A pass ends when every tier has run out of pages to evacuate.
+bool Heap::DefragmentStep(unsigned int budget_microseconds)
+{
+	std::lock_guard<std::mutex> lock(defrag_mtx);
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(budget_microseconds);
+
+	// Elements in the magazines of the calling thread are allocated but not relocatable
+	if (!thread_cache_exited) thread_cache.Flush();
+	do
+	{
+		if (!defrag_allocator)
+		{
+			Allocator* allocator = GetDefragmentTier(defrag_tier);
+			if (allocator && allocator->BeginEvacuation(defrag_pass))
+			{
+				defrag_allocator = allocator;
+			}
+			else if (++defrag_tier > POOL_SIZE_CLASSES)
+			{
+				defrag_tier = 0;
+				defrag_pass++;
+				defrag_passes++;
+				defrag_last_reclaimed = defrag_pass_reclaimed;
+				defrag_pass_reclaimed = 0;
+				return true;
+			}
+			continue;
+		}
+
+		void* address = defrag_allocator->NextEvacuee();
+		if (!address)
+		{
+			size_t released = defrag_allocator->EndEvacuation();
+			defrag_reclaimed += released;
+			defrag_pass_reclaimed += released;
+			defrag_allocator = nullptr;
+			continue;
+		}
+
+		// The table lock keeps the owner from freeing the allocation while it moves. Allocators take the table lock
+		// within their own only while choosing a page, which is done on this thread alone.
+		std::lock_guard<std::mutex> relocation_lock(relocations.mtx);
+		if (relocations.Find(address))
+		{
+			size_t size = defrag_allocator->GetSize(address);
+			void* new_address = Relocate(address);
+			relocations.Replace(address, new_address);
+			defrag_moved += size;
+		}
+	} while (std::chrono::steady_clock::now() < deadline);
+	return false;
+}
+
+void Heap::ReportLeaks(void)
+{
+	// Elements cached by any thread are not leaks
+	ThreadCache::FlushAll();
+
+	if (system_allocator) system_allocator->ReportLeaks();
+	if (guarded_allocator) guarded_allocator->ReportLeaks();
+	if (default_allocator) default_allocator->ReportLeaks();
+	for (int i = 0; i < POOL_SIZE_CLASSES; i++)
+	{
+		PoolAllocator* p = pools[i];
+		if (p != nullptr) p->ReportLeaks();
+	}
+}
+
+void Heap::GetStats(HeapStats& stats)
+{
+	memset(&stats, 0, sizeof(stats));
+	stats.time = GetMilliseconds();
+	stats.frame = current_frame;
+	if (system_allocator) system_allocator->GetStats(stats);
+	if (default_allocator) default_allocator->GetStats(stats);
+	if (transient_allocator) transient_allocator->GetStats(stats);
+	if (permanent_allocator) permanent_allocator->GetStats(stats);
+	if (guarded_allocator) guarded_allocator->GetStats(stats);
+	for (int i = 0; i < POOL_SIZE_CLASSES; i++)
+	{
+		PoolAllocator* p = pools[i];
+		if (p != nullptr) {
+			p->GetStats(stats, stats.size_classes[i]);
+			AddAllocatorStats(stats.pools, stats.size_classes[i]);
+		}
+	}
+	CollectThreadStats(stats);
+	CollectTagStats(stats);
+	stats.promoted_class_count = size_promoter.GetPromotedCount();
+	{
+		std::lock_guard<std::mutex> lock(verify_mtx);
+		stats.verify_page_count = verify_pages;
+		stats.verify_pass_count = verify_passes;
+	}
+	{
+		std::lock_guard<std::mutex> lock(defrag_mtx);
+		stats.defrag_moved_bytes = defrag_moved;
+		stats.defrag_reclaimed_bytes = defrag_reclaimed;
+		stats.defrag_pass_count = defrag_passes;
+		stats.defrag_pass_reclaimed_bytes = defrag_last_reclaimed;
+	}
+
+	// Allocation rates are measured from the previous snapshot
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!previous_stats) {
+		previous_stats = (HeapStats*)MapObject(sizeof(HeapStats));
+	}
+	else if (stats.time > previous_stats->time) {
+		double seconds = (stats.time - previous_stats->time) / 1000.0;
+		for (auto& group : allocator_groups)
+		{
+			SetAllocationRate(stats.*group.member, previous_stats->*group.member, seconds);
+		}
+		for (int i = 0; i < POOL_SIZE_CLASSES; i++)
+		{
+			SetAllocationRate(stats.size_classes[i], previous_stats->size_classes[i], seconds);
+		}
+		for (int i = 0; i < HEAP_HINT_COUNT; i++)
+		{
+			stats.hints[i].allocation_rate = (stats.hints[i].allocation_count - previous_stats->hints[i].allocation_count) / seconds;
+		}
+	}
+	*previous_stats = stats;
+}
+
+void Heap::WriteStatsCSV(FILE* file, const HeapStats& stats, bool header)
+{
+	if (header)
+	{
+		fprintf(file, "time,frame");
+		for (auto& group : allocator_groups)
 		{
-			list_remove(pages, page);
-			HeapFree(GetProcessHeap(), 0, page);
+			for (auto& field : allocator_fields) fprintf(file, ",%s_%s", group.name, field.name);
+			fprintf(file, ",%s_allocation_rate", group.name);
 		}
-		else
+		for (int i = 0; i < HEAP_HINT_COUNT; i++)
 		{
-			// The page is not empty so just add the free element back to the free list
-			AddFreeElement(e);
+			fprintf(file, ",%s_allocation_count,%s_requested_bytes,%s_allocation_rate", hint_names[i], hint_names[i], hint_names[i]);
 		}
+		for (int i = 0; i < HEAP_HISTOGRAM_BUCKETS; i++) fprintf(file, ",size_below_%zu", (size_t)16 << i);
+		for (int i = 0; i < POOL_SIZE_CLASSES; i++) fprintf(file, ",class_%zu_live_bytes", GetClassSize(i));
+		for (int i = 0; i < HEAP_TAG_COUNT; i++) fprintf(file, ",tag_%d_live_bytes", i);
+		for (auto& counter : heap_counters) fprintf(file, ",%s", counter.name);
+		fprintf(file, "\n");
 	}
-}
 
-void RegionAllocator::AddFreeElement(RegionElement* e)
-{
-	// Sort into free bucket
-	int index = (int)log2(e->size);
-	RegionElement* prev = nullptr;
-	RegionElement* next = free_lists[index];
-	while (next)
+	fprintf(file, "%llu,%u", (unsigned long long)stats.time, stats.frame);
+	for (auto& group : allocator_groups)
+	{
+		const AllocatorStats& a = stats.*group.member;
+		for (auto& field : allocator_fields) fprintf(file, ",%zu", a.*field.member);
+		fprintf(file, ",%.1f", a.allocation_rate);
+	}
+	for (int i = 0; i < HEAP_HINT_COUNT; i++)
 	{
-		if (e->size <= next->size) break;
-		prev = next;
-		next = next->next;
+		fprintf(file, ",%zu,%zu,%.1f", stats.hints[i].allocation_count, stats.hints[i].requested_bytes, stats.hints[i].allocation_rate);
 	}
-	e->next = next;
-	e->prev = prev;
-	if (next) next->prev = e;
-	if (prev) prev->next = e;
-	else free_lists[index] = e;
+	for (int i = 0; i < HEAP_HISTOGRAM_BUCKETS; i++) fprintf(file, ",%zu", stats.size_histogram[i]);
+	for (int i = 0; i < POOL_SIZE_CLASSES; i++) fprintf(file, ",%zu", stats.size_classes[i].live_bytes);
+	for (int i = 0; i < HEAP_TAG_COUNT; i++) fprintf(file, ",%zu", stats.tags[i].live_bytes);
+	for (auto& counter : heap_counters) fprintf(file, ",%zu", stats.*counter.member);
+	fprintf(file, "\n");
 }
 
-void RegionAllocator::RemoveFreeElement(RegionElement* e)
+// Write the fields of an AllocatorStats as the members of a JSON object
+static void WriteAllocatorJSON(FILE* file, const AllocatorStats& stats)
 {
-	int index = (int)log2(e->size);
-	list_remove(free_lists[index], e);
+	for (auto& field : allocator_fields) fprintf(file, "\"%s\":%zu,", field.name, stats.*field.member);
+	fprintf(file, "\"allocation_rate\":%.1f", stats.allocation_rate);
 }
 
-void RegionAllocator::VerifyIntegrity()
+void Heap::WriteStatsJSON(FILE* file, const HeapStats& stats)
 {
-	for (RegionPage* page = pages; page != nullptr; page = page->next)
+	fprintf(file, "{\"time\":%llu,\"frame\":%u", (unsigned long long)stats.time, stats.frame);
+	for (auto& group : allocator_groups)
 	{
-		void* end = (void*)ptradd(page, page_size);
-		RegionElement* e = (RegionElement*)ptradd(page, sizeof(RegionPage));
-		while (e < end)
-		{
-			if (e->is_allocated && e->has_sentinel) {
-				Sentinel* sentinel = (Sentinel*)ptradd(e, REGION_ELEMENT_SIZE + e->size - sizeof(Sentinel));
-				if (sentinel->value != MEMORY_SENTINEL) throw("region allocator buffer overrun");
-			}
-			e = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
-		}
+		fprintf(file, ",\"%s\":{", group.name);
+		WriteAllocatorJSON(file, stats.*group.member);
+		fprintf(file, "}");
 	}
-}
 
-void RegionAllocator::ReportLeaks()
-{
-	for (RegionPage* page = pages; page != nullptr; page = page->next)
+	fprintf(file, ",\"hints\":{");
+	for (int i = 0; i < HEAP_HINT_COUNT; i++)
 	{
-		void* end = (void*)ptradd(page, page_size);
-		RegionElement* e = (RegionElement*)ptradd(page, sizeof(RegionPage));
-		while (e < end)
-		{
-			if (e->is_allocated && e->track) {
-				printf("region allocator leak");
-			}
-			e = (RegionElement*)ptradd(e, REGION_ELEMENT_SIZE + e->size);
-		}
+		fprintf(file, "%s\"%s\":{\"allocation_count\":%zu,\"requested_bytes\":%zu,\"allocation_rate\":%.1f}", i ? "," : "",
+			hint_names[i], stats.hints[i].allocation_count, stats.hints[i].requested_bytes, stats.hints[i].allocation_rate);
 	}
-}
 
-//#################################################################################################################################
-// Pool Allocator
-//#################################################################################################################################
+	fprintf(file, "},\"size_histogram\":[");
+	for (int i = 0; i < HEAP_HISTOGRAM_BUCKETS; i++) fprintf(file, "%s%zu", i ? "," : "", stats.size_histogram[i]);
 
-struct PoolElement {
-	struct PoolPage* page;		// page that owns this element; MUST be last real field in the struct
+	// Only size classes that have been used are written
+	fprintf(file, "],\"size_classes\":[");
+	bool first = true;
+	for (int i = 0; i < POOL_SIZE_CLASSES; i++)
+	{
+		if (stats.size_classes[i].allocation_count == 0) continue;
+		fprintf(file, "%s{\"size\":%zu,", first ? "" : ",", GetClassSize(i));
+		WriteAllocatorJSON(file, stats.size_classes[i]);
+		fprintf(file, "}");
+		first = false;
+	}
 
-	// Virtual fields; a shortened struct length is used such that these pointers are placed into the element memory
-	PoolElement* next;			// free list pointers
-	PoolElement* prev;
-};
+	// Only tags that have been used are written
+	fprintf(file, "],\"tags\":[");
+	first = true;
+	for (int i = 0; i < HEAP_TAG_COUNT; i++)
+	{
+		const TagStats& t = stats.tags[i];
+		if (t.peak_bytes == 0 && t.budget == 0) continue;
+		fprintf(file, "%s{\"tag\":%d,\"live_bytes\":%zu,\"peak_bytes\":%zu,\"budget\":%zu,\"pressure_count\":%zu}", first ? "" : ",",
+			i, t.live_bytes, t.peak_bytes, t.budget, t.pressure_count);
+		first = false;
+	}
+	fprintf(file, "]");
 
-// Use shortened struct length for PoolElement, allowing the free pointers to extend into element memory
-// This works because the pointers are only accessed when the element is not allocated
-#define POOL_ELEMENT_SIZE (sizeof(PoolElement) - (sizeof(PoolElement*) * 2))
+	for (auto& counter : heap_counters) fprintf(file, ",\"%s\":%zu", counter.name, stats.*counter.member);
+	fprintf(file, "}\n");
+}
 
-struct PoolPage : Page
+void Heap::EnableThreadCache(bool flag)
 {
-	PoolPage* next;						// pointers for page list
-	PoolPage* prev;
-	PoolElement* free_list = nullptr;	// head of free element list
-	int num_allocations = 0;
-};
+	std::lock_guard<std::mutex> lock(mtx);
+	thread_cache_enabled = flag;
+	for (int i = 0; i < POOL_SIZE_CLASSES; i++)
+	{
+		PoolAllocator* p = pools[i];
+		if (p != nullptr) p->EnableThreadCache(flag);
+	}
+	if (!flag) ThreadCache::FlushAll();
+}
 
-class PoolAllocator : public Allocator
+void Heap::EnableTransientCheck(bool flag)
 {
-public:
-	PoolAllocator(size_t page_size, size_t element_size, bool append_sentinel);
-
-	void* Allocate();
-	void* Resize(void* address, size_t new_size) { (new_size); (address); throw("cannot resize a pool element"); }
-	void* Relocate(void* address, bool fill);
-	void  Free(void* address, bool fill);
-	void  VerifyIntegrity(void);
-	void  ReportLeaks(void);
-
-private:
-	bool       append_sentinel;
-	size_t     page_size;
-	size_t     element_size;
-	size_t     element_overhead;
-	PoolPage*  pages = nullptr;
-	std::mutex mtx;
-};
+	std::lock_guard<std::mutex> lock(mtx);
+	transient_check = flag;
+	if (transient_allocator) transient_allocator->EnableEscapeCheck(flag);
+}
 
+void Heap::SetPageRetention(unsigned int max_pages, unsigned int idle_frames, unsigned int idle_milliseconds)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	retain_max_pages = max_pages;
+	retain_idle_frames = idle_frames;
+	retain_idle_milliseconds = idle_milliseconds;
+	if (system_allocator) system_allocator->SetCache(large_cache_max, idle_frames, idle_milliseconds);
+	if (default_allocator) default_allocator->SetPageRetention(max_pages, idle_frames, idle_milliseconds);
+	for (int i = 0; i < POOL_SIZE_CLASSES; i++)
+	{
+		PoolAllocator* p = pools[i];
+		if (p != nullptr) p->SetPageRetention(max_pages, idle_frames, idle_milliseconds);
+	}
+}
 
-PoolAllocator::PoolAllocator(size_t page_size, size_t element_size, bool append_sentinel)
+void Heap::SetLargeCache(size_t max_bytes)
 {
-	this->page_size = page_size;
-	this->append_sentinel = append_sentinel;
+	std::lock_guard<std::mutex> lock(mtx);
+	large_cache_max = max_bytes;
+	if (system_allocator) system_allocator->SetCache(max_bytes, retain_idle_frames, retain_idle_milliseconds);
+}
 
-	// round size to 64-bit boundary and ensure element is big enough to hold free pointers
-	element_size = (element_size + 7) & -8;
-	if (element_size < (sizeof(PoolElement*) * 2)) element_size = sizeof(PoolElement*) * 2;
-	this->element_size = element_size;
-	this->element_overhead = append_sentinel ? POOL_ELEMENT_SIZE + sizeof(Sentinel) : POOL_ELEMENT_SIZE;
+void Heap::SetGuardSampling(unsigned int sample_rate)
+{
+	guard_sample_rate = sample_rate;
 }
 
-void* PoolAllocator::Allocate()
+void Heap::SetHugePages(HugePages mode)
 {
 	std::lock_guard<std::mutex> lock(mtx);
+	if (default_allocator) throw("huge pages must be selected before the first default allocation");
+	huge_pages = mode;
+}
 
-	// Find first page with a free element
-	PoolPage* page = nullptr;
-	for (page = pages; page != nullptr; page = page->next)
-	{
-		if (page->free_list) break;
-	}
-
-	// If we didn't find a page with a free element then add a new page
-	if (!page)
+void Heap::Scavenge(void)
+{
+	if (system_allocator) system_allocator->Scavenge();
+	if (default_allocator) default_allocator->Scavenge();
+	for (int i = 0; i < POOL_SIZE_CLASSES; i++)
 	{
-		page = (PoolPage*)HeapAlloc(GetProcessHeap(), 0, page_size);
-		list_insert(pages, page);
-		page->free_list = nullptr;
-		page->allocator = this;
-
-		// Split page into a list of free elements
-		PoolElement* element = (PoolElement*)ptradd(page, sizeof(PoolPage));
-		size_t num_elements = (page_size - sizeof(PoolPage)) / (element_size + element_overhead);
-		for (size_t i = 0; i < num_elements; i++)
-		{
-			element->page = page;
-			list_insert(page->free_list, element);
-			if (append_sentinel) {
-				Sentinel* sentinel = (Sentinel*)ptradd(element, POOL_ELEMENT_SIZE + element_size);
-				sentinel->value = MEMORY_SENTINEL;
-			}
-			element = (PoolElement*)ptradd(element, element_size + element_overhead);
-		}
+		PoolAllocator* p = pools[i];
+		if (p != nullptr) p->Scavenge();
 	}
+}
 
-	// Allocate free element from page
-	PoolElement* element = page->free_list;
-	if (element)
-	{
-		list_remove(page->free_list, element);
-		page->num_allocations++;
-		Count(element_size);
-		return (void*)ptradd(element, POOL_ELEMENT_SIZE);
-	}
+void Heap::BeginFrame(void)
+{
+	if (HeapTrace::IsRecording()) HeapTrace::Record(TraceOp::FRAME, nullptr, nullptr, 0, New::Hint::DEFAULT);
+	current_frame++;
+	Scavenge();
+}
 
-	return nullptr;
+void Heap::FlushThreadCache(void)
+{
+	if (!thread_cache_exited) thread_cache.Flush();
 }
 
-void* PoolAllocator::Relocate(void* address, bool fill)
+bool Heap::StartTrace(const char* filename)
 {
-	void* new_address = Allocate();
-	memcpy(new_address, address, element_size);
-	Free(address, fill);
-	return new_address;
+	return HeapTrace::Start(filename);
 }
 
-void  PoolAllocator::Free(void* address, bool fill)
+void Heap::StopTrace(void)
 {
-	PoolElement* element = (PoolElement*)ptrsub(address, POOL_ELEMENT_SIZE);
+	HeapTrace::Stop();
+}
 
-	if (append_sentinel) {
-		Sentinel* sentinel = (Sentinel*)ptradd(address, element_size);
-		if (sentinel->value != MEMORY_SENTINEL) throw("Pool element buffer overrun");
-	}
+void Heap::EnableProfiler(size_t sample_bytes)
+{
+	HeapProfiler::Enable(sample_bytes);
+}
 
-	if (fill) {
-		// skip over free pointers and fill the remainder of the element
-		size_t fill_size = element_size - (sizeof(PoolElement*) * 2);
-		if (fill_size > 0) memset((void*)ptradd(address, (sizeof(PoolElement*) * 2)), FILL_VALUE, fill_size);
-	}
+size_t Heap::GetProfilerSampleBytes(void) const
+{
+	return HeapProfiler::GetSampleBytes();
+}
 
-	// Synchronize thread access for this code block
-	{
-		std::lock_guard<std::mutex> lock(mtx);
+bool Heap::WriteProfile(const char* filename, bool live)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file) return false;
+	HeapProfiler::WriteReport(file, live);
+	fclose(file);
+	return true;
+}
 
-		// Return the element to its page
-		PoolPage* page = element->page;
-		list_insert(page->free_list, element);
-		page->num_allocations--;
-		Uncount(element_size);
+void Heap::EnablePromotion(bool flag)
+{
+	size_promoter.Enable(flag);
+}
 
-		// Remove the page if empty
-		if (page->num_allocations == 0)
-		{
-			list_remove(pages, page);
-			HeapFree(GetProcessHeap(), 0, page);
-		}
-		else
-		{
-			// page is not empty; move it to the head of the list to make next allocation faster
-			if (page->prev != nullptr) {	// if not already at the head of the list
-				list_remove(pages, page);
-				list_insert(pages, page);
-			}
-		}
-	}
+void Heap::ClearPromotionProfile(void)
+{
+	size_promoter.Clear();
 }
 
-void PoolAllocator::VerifyIntegrity(void)
+// The profile is a text file listing the size of each promoted class on its own line
+bool Heap::SavePromotionProfile(const char* filename)
 {
-	if (append_sentinel)
+	FILE* file = fopen(filename, "w");
+	if (!file) return false;
+	for (int i = 0; i < POOL_SIZE_CLASSES; i++)
 	{
-		for (PoolPage* page = pages; page != nullptr; page = page->next)
-		{
-			void* end = (void*)ptradd(page, page_size - element_size - element_overhead);
-			PoolElement* e = (PoolElement*)ptradd(page, sizeof(PoolPage));
-			while (e <= end)
-			{
-				Sentinel* sentinel = (Sentinel*)ptradd(e, POOL_ELEMENT_SIZE + element_size);
-				if (sentinel->value != MEMORY_SENTINEL) throw("pool allocator buffer overrun");
-				e = (PoolElement*)ptradd(e, element_size + element_overhead);
-			}
-		}
+		if (GetClassSize(i) <= PROMOTE_MAX_SIZE && size_promoter.IsPromoted(i)) fprintf(file, "%zu\n", GetClassSize(i));
 	}
+	fclose(file);
+	return true;
 }
 
-void PoolAllocator::ReportLeaks(void)
+bool Heap::LoadPromotionProfile(const char* filename)
 {
-	for (PoolPage* p = pages; p != nullptr; p = p->next)
+	FILE* file = fopen(filename, "r");
+	if (!file) return false;
+	size_promoter.Clear();
+	size_t size;
+	while (fscanf(file, "%zu", &size) == 1)
 	{
-		if (p->num_allocations > 0) printf ("Pool leak");
+		if (size > 0 && size <= PROMOTE_MAX_SIZE) size_promoter.Promote(GetSizeClass(size));
 	}
+	fclose(file);
+	return true;
 }
 
+// The budget level is set from the current count, so a tag that is already past its pressure threshold is signalled to
+// the calling thread
+void Heap::SetBudget(int tag, size_t budget, HeapPressureCallback callback, unsigned int pressure_percent)
+{
+	if (tag < 0 || tag >= HEAP_TAG_COUNT) throw("memory tag out of range");
+	TagAccount& account = tag_accounts[tag];
+	std::lock_guard<std::mutex> lock(mtx);
+	account.pressure = 0;
+	account.callback = callback;
+	account.budget = budget;
+	if (budget) {
+		size_t pressure = pressure_percent < 100 ? budget / 100 * pressure_percent : budget;
+		account.pressure = pressure ? pressure : budget;
+	}
+	tag_counter.Flush();
+	int level = GetTagLevel(account, account.live_bytes.load());
+	if (account.level.exchange(level) < level) tag_counter.signals |= 1u << tag;
+}
 
-//#################################################################################################################################
-// Global Heap
-//#################################################################################################################################
+int Heap::SetTag(int tag)
+{
+	if (tag < 0 || tag >= HEAP_TAG_COUNT) throw("memory tag out of range");
+	int previous = (int)current_tag;
+	current_tag = (unsigned int)tag;
+	return previous;
+}
 
-// Global heap instance
-static Heap global_heap;
-Heap* Heap::GetInstance(void) {return &global_heap;}
+int Heap::GetTag(void)
+{
+	return (int)current_tag;
+}
 
-void Heap::VerifyIntegrity(void)
+void* Heap::Allocate(size_t size, size_t alignment, New::Hint hint)
 {
-	if (system_allocator) system_allocator->VerifyIntegrity();
-	if (default_allocator) default_allocator->VerifyIntegrity();
-	if (transient_allocator) transient_allocator->VerifyIntegrity();
-	if (permanent_allocator) permanent_allocator->VerifyIntegrity();
-	for (int i = 0; i < LARGE_ALLOCATION_SIZE; i++)
-	{
-		PoolAllocator* p = pools[i];
-		if (p != nullptr) p->VerifyIntegrity();
-	}
+	if (alignment > HEAP_MAX_ALIGNMENT) throw("allocation alignment exceeds HEAP_MAX_ALIGNMENT");
+	thread_stats.Record(hint, size);
+	void* address = AllocateFromTier(size, alignment, hint, current_tag);
+	HeapProfiler::OnAllocate(address, size);
+	if (HeapTrace::IsRecording()) HeapTrace::Record(TraceOp::ALLOCATE, address, nullptr, size, hint);
+	if (tag_counter.signals) CallPressureCallbacks();
+	return address;
 }
 
-void Heap::ReportLeaks(void)
+// Number of allocations the calling thread makes before the next one is guarded
+static thread_local int guard_countdown = 0;
+static thread_local bool guard_countdown_started = false;
+
+// Allocate from the tier selected by the size and hint. A tier that cannot provide the alignment passes the allocation
+// to the default allocator.
+void* Heap::AllocateFromTier(size_t size, size_t alignment, New::Hint hint, unsigned int tag)
 {
-	if (system_allocator) system_allocator->ReportLeaks();
-	if (default_allocator) default_allocator->ReportLeaks();
-	if (transient_allocator) transient_allocator->ReportLeaks();
-	if (permanent_allocator) permanent_allocator->ReportLeaks();
-	for (int i = 0; i < LARGE_ALLOCATION_SIZE; i++)
+	// Sample allocations into guarded slots; transient and permanent allocations are not freed individually, and
+	// aligned allocations would not end at the guard page
+	unsigned int sample_rate = guard_sample_rate.load(std::memory_order_relaxed);
+	if (sample_rate && --guard_countdown <= 0 && hint != New::Hint::TRANSIENT && hint != New::Hint::PERMANENT && alignment <= HEAP_ALIGNMENT && size <= GuardedAllocator::GetCapacity())
 	{
-		PoolAllocator* p = pools[i];
-		if (p != nullptr) p->ReportLeaks();
+		guard_countdown = DrawSampleInterval(sample_rate);
+
+		// As for the heap profiler, the first sample of a thread only starts its countdown, so that threads do not all
+		// guard their first allocation
+		if (!guard_countdown_started)
+		{
+			guard_countdown_started = true;
+		}
+		else
+		{
+			if (!guarded_allocator) {
+				std::lock_guard<std::mutex> lock(mtx);
+				if (!guarded_allocator) {
+					guarded_allocator = new (MapObject(sizeof(GuardedAllocator))) GuardedAllocator();
+				}
+			}
+			void* address = guarded_allocator->Allocate(size, leak_tracking, tag, hint);
+			if (address) return address;
+		}
 	}
-}
 
-void* Heap::Allocate(size_t size, New::Hint hint)
-{
 	if (size >= LARGE_ALLOCATION_SIZE)
 	{
 		if (!system_allocator) {
-			system_allocator = new (HeapAlloc(GetProcessHeap(), 0, sizeof(SystemAllocator))) SystemAllocator();
+			std::lock_guard<std::mutex> lock(mtx);
+			if (!system_allocator) {
+				SystemAllocator* system = new (MapObject(sizeof(SystemAllocator))) SystemAllocator();
+				system->SetCache(large_cache_max, retain_idle_frames, retain_idle_milliseconds);
+				system_allocator = system;
+			}
 		}
-		return system_allocator->Allocate(size, leak_tracking);
+		return system_allocator->Allocate(size, alignment, leak_tracking, tag, hint);
 	}
 	else
 	{
 		switch (hint)
 		{
-		case New::Hint::POOLABLE:
-			if (!pools[size]) {
-				pools[size] = new (HeapAlloc(GetProcessHeap(), 0, sizeof(PoolAllocator))) PoolAllocator(POOL_PAGE_SIZE, size, append_sentinel);
+		case New::Hint::DEFAULT:
+			if (size <= PROMOTE_MAX_SIZE && alignment <= HEAP_ALIGNMENT)
+			{
+				// Serve promoted sizes from their pool, and sample the lifetimes of others
+				int size_class = GetSizeClass(size);
+				if (size_promoter.IsActive(size_class))
+				{
+					ThreadStats::Add(thread_stats.promoted_allocations, 1);
+					return GetClassPool(size_class)->Allocate(tag, hint);
+				}
+				if (size_promoter.ShouldSample())
+				{
+					void* address = AllocateDefault(size, alignment, tag, hint);
+					size_promoter.Sample(address, size_class);
+					return address;
+				}
 			}
-			return pools[size]->Allocate();
+			return AllocateDefault(size, alignment, tag, hint);
+		case New::Hint::POOLABLE:
+		{
+			PoolAllocator* pool = alignment <= HEAP_ALIGNMENT ? GetPool(size) : GetAlignedPool(size, alignment);
+			if (pool) return pool->Allocate(tag, hint);
+			return AllocateDefault(size, alignment, tag, hint);
+		}
 		case New::Hint::TRANSIENT:
+			if (alignment > TRANSIENT_ALIGNMENT) return AllocateDefault(size, alignment, tag, hint);
 			if (!transient_allocator) {
-				transient_allocator = new (HeapAlloc(GetProcessHeap(), 0, sizeof(RegionAllocator))) RegionAllocator(REGION_PAGE_SIZE);
+				std::lock_guard<std::mutex> lock(mtx);
+				if (!transient_allocator) {
+					transient_allocator = new (MapObject(sizeof(TransientAllocator))) TransientAllocator(TRANSIENT_CHUNK_SIZE);
+					transient_allocator->EnableEscapeCheck(transient_check);
+				}
 			}
-			return transient_allocator->Allocate(size, leak_tracking, append_sentinel);
+			return transient_allocator->Allocate(size, append_sentinel);
 		case New::Hint::PERMANENT:
+		{
 			if (!permanent_allocator) {
-				permanent_allocator = new (HeapAlloc(GetProcessHeap(), 0, sizeof(RegionAllocator))) RegionAllocator(REGION_PAGE_SIZE);
+				std::lock_guard<std::mutex> lock(mtx);
+				if (!permanent_allocator) {
+					permanent_allocator = new (MapObject(sizeof(PermanentAllocator))) PermanentAllocator(PERMANENT_RESERVE_SIZE, PERMANENT_CHUNK_SIZE);
+				}
 			}
-			return permanent_allocator->Allocate(size, leak_tracking, append_sentinel);
+			void* address = permanent_allocator->Allocate(size, alignment > PERMANENT_ALIGNMENT ? alignment : PERMANENT_ALIGNMENT);
+			if (address) return address;
+		}
+		// If the permanent address range is exhausted then fall back to the default allocator
+		[[fallthrough]];
 		default:
-			if (!default_allocator) {
-				default_allocator = new (HeapAlloc(GetProcessHeap(), 0, sizeof(RegionAllocator))) RegionAllocator(REGION_PAGE_SIZE);
-			}
-			return default_allocator->Allocate(size, leak_tracking, append_sentinel);
+			return AllocateDefault(size, alignment, tag, hint);
+		}
+	}
+}
+
+// Allocate from the default allocator, creating it on first use
+void* Heap::AllocateDefault(size_t size, size_t alignment, unsigned int tag, New::Hint hint)
+{
+	if (!default_allocator) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!default_allocator) {
+			RegionAllocator* region = new (MapObject(sizeof(RegionAllocator))) RegionAllocator(huge_pages == HugePages::NONE ? REGION_PAGE_SIZE : HUGE_PAGE_SIZE, huge_pages);
+			region->SetPageRetention(retain_max_pages, retain_idle_frames, retain_idle_milliseconds);
+			default_allocator = region;
+		}
+	}
+	return default_allocator->Allocate(size, alignment, leak_tracking, append_sentinel, tag, hint);
+}
+
+// Return the pool that serves a size below LARGE_ALLOCATION_SIZE, creating it on first use
+PoolAllocator* Heap::GetPool(size_t size)
+{
+	return GetClassPool(GetSizeClass(size));
+}
+
+// Return the pool of a size class, creating it on first use
+PoolAllocator* Heap::GetClassPool(int size_class)
+{
+	if (!pools[size_class]) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!pools[size_class]) {
+			if (!pool_arena) pool_arena = new (MapObject(sizeof(PoolArena))) PoolArena(POOL_PAGE_SIZE, POOL_RESERVE_SIZE);
+			PoolAllocator* pool = new (MapObject(sizeof(PoolAllocator))) PoolAllocator(pool_arena, GetClassSize(size_class), append_sentinel, thread_cache_enabled);
+			pool->SetPageRetention(retain_max_pages, retain_idle_frames, retain_idle_milliseconds);
+			pools[size_class] = pool;
 		}
 	}
+	return pools[size_class];
+}
+
+// Return the smallest pool whose elements can hold size bytes at an alignment, or nullptr if a pool would not be
+// aligned; pools with sentinels are aligned to no more than HEAP_ALIGNMENT
+PoolAllocator* Heap::GetAlignedPool(size_t size, size_t alignment)
+{
+	size = (size + alignment - 1) & ~(alignment - 1);
+	if (size >= LARGE_ALLOCATION_SIZE) return nullptr;
+	for (int size_class = GetSizeClass(size); size_class < POOL_SIZE_CLASSES; size_class++)
+	{
+		if (GetClassSize(size_class) % alignment) continue;
+
+		// Check the alignment the pool would have before creating it, so that a request no pool can align does not
+		// create one
+		PoolAllocator* pool = pools[size_class];
+		size_t pool_alignment = pool ? pool->GetAlignment() : PoolAllocator::GetStrideAlignment(GetClassSize(size_class), append_sentinel);
+		if (pool_alignment < alignment) return nullptr;
+		pool = GetClassPool(size_class);
+		return pool->GetAlignment() >= alignment ? pool : nullptr;
+	}
+	return nullptr;
+}
+
+// Return the allocator that owns an address, or nullptr for system memory. Pool elements have no header and are found
+// by their address; other allocations are preceded by a pointer to their page.
+Allocator* Heap::FindAllocator(void* address)
+{
+	if (pool_arena && pool_arena->Contains(address)) return pool_arena->GetPage(address)->allocator;
+	Page* page = *(Page**)ptrsub(address, sizeof(Page*));
+	if (page == FILL_POINTER) throw("heap address was freed or has expired");
+	return page ? page->allocator : nullptr;
 }
 
 void* Heap::Resize(void* address, size_t new_size)
 {
-	Page** page = (Page**)ptrsub(address, sizeof(Page*));
-	if (*page == nullptr)
+	// Permanent allocations have no header; the original size is unknown so copy as much as may belong to it, up to
+	// the end of the committed memory
+	if (permanent_allocator && permanent_allocator->Contains(address))
+	{
+		size_t extent = permanent_allocator->GetExtent(address);
+		void* new_memory = AllocateFromTier(new_size, HEAP_ALIGNMENT, New::Hint::PERMANENT, current_tag);
+		memcpy(new_memory, address, extent < new_size ? extent : new_size);
+		HeapProfiler::OnMove(address, new_memory);
+		if (HeapTrace::IsRecording()) HeapTrace::Record(TraceOp::RESIZE, address, new_memory, new_size, New::Hint::PERMANENT);
+		return new_memory;
+	}
+
+	// Allocations stay in their tier while it serves the new size, and otherwise move to the tier that the hint they were
+	// made with chooses for the new size. Guarded allocations always move.
+	Allocator* allocator = FindAllocator(address);
+	New::Hint hint = allocator ? allocator->GetHint(address) : system_allocator->GetHint(address);
+	void* new_address = nullptr;
+	bool large = new_size >= LARGE_ALLOCATION_SIZE;
+	if (allocator == nullptr)
 	{
-		return system_allocator->Resize(address, new_size, fill_on_free);
+		if (large) new_address = system_allocator->Resize(address, new_size, fill_on_free);
+		if (!new_address) new_address = MoveAllocation(address, nullptr, new_size, hint);
+	}
+	else if (allocator == transient_allocator)
+	{
+		// A transient allocation grows within its thread's buffers until it no longer fits in a chunk
+		new_address = allocator->Resize(address, new_size, fill_on_free);
+		if (!new_address) new_address = MoveAllocation(address, allocator, new_size, hint);
 	}
 	else
 	{
-		Allocator* allocator = ((Page*)*page)->allocator;
-		return allocator->Resize(address, new_size, fill_on_free);
+		if (!large && allocator != guarded_allocator) new_address = allocator->Resize(address, new_size, fill_on_free);
+		if (!new_address) new_address = MoveAllocation(address, allocator, new_size, hint);
+		if (allocator == default_allocator && new_address != address) size_promoter.OnMove(address);
 	}
+	HeapProfiler::OnMove(address, new_address);
+	if (HeapTrace::IsRecording()) HeapTrace::Record(TraceOp::RESIZE, address, new_address, new_size, hint);
+	if (tag_counter.signals) CallPressureCallbacks();
+	return new_address;
+}
+
+// Move an allocation to a new allocation made with a hint, keeping its contents, alignment and tag; allocator is nullptr
+// for system memory
+void* Heap::MoveAllocation(void* address, Allocator* allocator, size_t new_size, New::Hint hint)
+{
+	size_t size = allocator ? allocator->GetSize(address) : system_allocator->GetSize(address);
+	size_t alignment = allocator ? allocator->GetAlignment(address) : system_allocator->GetAlignment(address);
+	unsigned int tag = allocator ? allocator->GetTag(address) : system_allocator->GetTag(address);
+	void* new_address = AllocateFromTier(new_size, alignment, hint, tag);
+	memcpy(new_address, address, size < new_size ? size : new_size);
+	if (allocator) allocator->Free(address, fill_on_free);
+	else system_allocator->Free(address, fill_on_free);
+	return new_address;
 }
 
 void* Heap::Relocate(void* address)
 {
-	Page** page = (Page**)ptrsub(address, sizeof(Page*));
-	if (*page == nullptr)
+	if (permanent_allocator && permanent_allocator->Contains(address)) return address;
+
+	Allocator* allocator = FindAllocator(address);
+	void* new_address;
+	if (allocator == nullptr)
 	{
-		return system_allocator->Relocate(address, fill_on_free);
+		new_address = system_allocator->Relocate(address, fill_on_free);
 	}
+	else
 	{
-		Allocator* allocator = ((Page*)*page)->allocator;
-		return allocator->Relocate(address, fill_on_free);
+		new_address = allocator->Relocate(address, fill_on_free);
+		if (allocator == default_allocator) size_promoter.OnMove(address);
 	}
+	HeapProfiler::OnMove(address, new_address);
+	if (HeapTrace::IsRecording()) HeapTrace::Record(TraceOp::RELOCATE, address, new_address, 0, New::Hint::DEFAULT);
+	return new_address;
 }
 
 void Heap::Free(void* address)
 {
-	Page** page = (Page**)ptrsub(address, sizeof(Page*));
-	if (*page == nullptr)
+	// Permanent allocations cannot be freed; count the attempt and leave the allocator untouched
+	if (permanent_allocator && permanent_allocator->Contains(address))
+	{
+		permanent_allocator->IgnoreFree();
+		return;
+	}
+
+	Allocator* allocator = FindAllocator(address);
+	if (HeapTrace::IsRecording()) HeapTrace::Record(TraceOp::FREE, address, nullptr, 0, New::Hint::DEFAULT);
+	HeapProfiler::OnFree(address);
+	if (allocator && allocator == default_allocator) size_promoter.OnFree(address);
+	if (allocator == nullptr)
 	{
 		system_allocator->Free(address, fill_on_free);
 	}
 	else
 	{
-		Allocator* allocator = ((Page*)*page)->allocator;
 		allocator->Free(address, fill_on_free);
 	}
 }
+
+// Free an allocation of a known size. Pool elements are returned to the pool of the size class without searching the
+// allocators for the address. The owner of the element's page is checked against that pool, and an element of another
+// pool, such as one allocated aligned or freed with the wrong size, is freed as if its size were unknown.
+void Heap::Free(void* address, size_t size)
+{
+	PoolAllocator* pool = size < LARGE_ALLOCATION_SIZE ? pools[GetSizeClass(size)] : nullptr;
+	if (!pool || !pool_arena->Contains(address) || pool_arena->GetPage(address)->allocator != pool)
+	{
+		Free(address);
+		return;
+	}
+
+	if (HeapTrace::IsRecording()) HeapTrace::Record(TraceOp::FREE, address, nullptr, 0, New::Hint::DEFAULT);
+	HeapProfiler::OnFree(address);
+	pool->Free(address, fill_on_free);
+}
+
+// Allocate count blocks of one size. POOLABLE blocks are taken from their pool under one acquisition of its lock,
+// bypassing the thread cache and guarded sampling; blocks of other hints are allocated one at a time.
+void Heap::AllocateBatch(size_t size, size_t alignment, New::Hint hint, int count, void** addresses)
+{
+	PoolAllocator* pool = nullptr;
+	if (hint == New::Hint::POOLABLE && size < LARGE_ALLOCATION_SIZE)
+	{
+		pool = alignment <= HEAP_ALIGNMENT ? GetPool(size) : GetAlignedPool(size, alignment);
+	}
+	if (!pool)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			addresses[i] = Allocate(size, alignment, hint);
+		}
+		return;
+	}
+
+	pool->AllocateBatch(addresses, count);
+	for (int i = 0; i < count; i++)
+	{
+		pool->SetTag(addresses[i], current_tag, hint);
+		thread_stats.Record(hint, size);
+		HeapProfiler::OnAllocate(addresses[i], size);
+		if (HeapTrace::IsRecording()) HeapTrace::Record(TraceOp::ALLOCATE, addresses[i], nullptr, size, hint);
+	}
+	if (tag_counter.signals) CallPressureCallbacks();
+}
+
+// Free count blocks. Consecutive elements of the same pool are returned under one acquisition of its lock; other
+// blocks are freed one at a time.
+void Heap::FreeBatch(void** addresses, int count)
+{
+	int i = 0;
+	while (i < count)
+	{
+		if (!pool_arena || !pool_arena->Contains(addresses[i]))
+		{
+			Free(addresses[i++]);
+			continue;
+		}
+
+		// A page released to the arena has no allocator
+		PoolAllocator* pool = (PoolAllocator*)pool_arena->GetPage(addresses[i])->allocator;
+		if (!pool) throw("heap address was freed or has expired");
+		int first = i;
+		do {
+			if (HeapTrace::IsRecording()) HeapTrace::Record(TraceOp::FREE, addresses[i], nullptr, 0, New::Hint::DEFAULT);
+			HeapProfiler::OnFree(addresses[i]);
+			i++;
+		} while (i < count && pool_arena->Contains(addresses[i]) && pool_arena->GetPage(addresses[i])->allocator == pool);
+		pool->FreeBatch(&addresses[first], i - first, fill_on_free);
+	}
+}
+
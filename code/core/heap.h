@@ -3,9 +3,110 @@
 #pragma once
 
 #include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <new>
 #include "core/new.h"
+#include "core/page_provider.h"
 
 #define LARGE_ALLOCATION_SIZE ((size_t)32768)	// Allocations of this size or greater are made from system memory
+#define POOL_SIZE_CLASSES     (80)				// Number of size classes used by pools for allocations below LARGE_ALLOCATION_SIZE
+#define PAGE_RETAIN_MAX        (2)				// Default number of empty pages each allocator retains for reuse
+#define PAGE_IDLE_FRAMES       (300)			// Default number of frames after which a retained page is decommitted
+#define PAGE_IDLE_MILLISECONDS (5000)			// Default number of milliseconds after which a retained page is decommitted
+#define LARGE_CACHE_BYTES      ((size_t)64<<20)	// Default bytes of freed large allocations cached for reuse; idle ones are released after the page idle limits
+#define HEAP_HINT_COUNT        (4)				// Number of allocation hints in New::Hint
+#define HEAP_HISTOGRAM_BUCKETS (16)				// Number of power-of-two buckets in the allocation size histogram
+#define GUARD_SAMPLE_RATE      (1000)			// Default number of allocations per guarded allocation when sampling is on
+#define HEAP_ALIGNMENT         ((size_t)8)		// Alignment of allocations for which no greater alignment is requested
+#define HEAP_MAX_ALIGNMENT     ((size_t)4096)	// Greatest alignment that may be requested; must not exceed the page size
+#define PROMOTION_PROFILE_FILE "heap_promotion.profile"	// Default file of the sizes promoted from DEFAULT allocations to pools
+#define HEAP_TAG_COUNT         (16)				// Number of memory tags, at most 16; tag 0 holds allocations made outside any HeapTag scope
+#define HEAP_PRESSURE_PERCENT  (90)				// Default percentage of a budget at which its pressure callback is first called
+#define HEAP_VERIFY_PAGES      (4)				// Default number of pages checked by each step of the incremental verifier
+
+// Called on an allocating thread when the live bytes of a tag rise past the pressure threshold of its budget, and again
+// when they rise past the budget itself; the callback may free memory and make allocations
+typedef void (*HeapPressureCallback)(int tag, size_t live_bytes, size_t budget);
+
+// Usage of one allocator or group of allocators
+struct AllocatorStats
+{
+	size_t live_allocations;	// allocations currently live
+	size_t live_bytes;			// bytes currently allocated
+	size_t peak_bytes;			// highest number of bytes allocated at once
+	size_t allocation_count;	// allocations made since startup
+	double allocation_rate;		// allocations per second since the previous snapshot
+	size_t pages;				// pages of memory owned
+	size_t page_bytes;			// bytes of page memory owned
+	size_t free_bytes;			// bytes available for allocation within owned pages
+	size_t largest_free;		// largest allocation that can be made without another page
+};
+
+// Requests made with one allocation hint, whichever allocator served them
+struct HintStats
+{
+	size_t allocation_count;	// allocations requested since startup
+	size_t requested_bytes;		// bytes requested since startup
+	double allocation_rate;		// allocations per second since the previous snapshot
+};
+
+// Allocations made with one memory tag, whichever allocator served them
+struct TagStats
+{
+	size_t live_bytes;			// bytes currently allocated
+	size_t peak_bytes;			// highest number of bytes allocated at once
+	size_t budget;				// bytes the tag is budgeted, or 0 if it has no budget
+	size_t pressure_count;		// calls made to the pressure callback of the tag
+};
+
+// Corrupted allocation found by the incremental verifier
+struct HeapCorruption
+{
+	void* address;				// address of the allocation, or of its page if the page bookkeeping is corrupt
+	size_t size;				// usable bytes of the allocation, or 0 for a page
+	const char* tier;			// allocator that serves the allocation: "system", "region", "guarded" or "pool"
+	New::Hint hint;				// hint with which the allocation was requested
+	const char* error;			// description of the corruption
+};
+
+// Snapshot of heap memory usage
+struct HeapStats
+{
+	uint64_t time;				// time of the snapshot in milliseconds
+	unsigned int frame;			// frame number of the snapshot
+	AllocatorStats system;		// allocations of LARGE_ALLOCATION_SIZE or more
+	AllocatorStats region;		// DEFAULT allocations
+	AllocatorStats transient;	// TRANSIENT allocations; these are released in bulk so live usage is not tracked
+	AllocatorStats permanent;	// PERMANENT allocations
+	AllocatorStats guarded;		// sampled allocations served from guard-page-protected slots
+	AllocatorStats pools;		// POOLABLE allocations, summed over all size classes
+	AllocatorStats size_classes[POOL_SIZE_CLASSES];	// POOLABLE allocations in each size class
+	HintStats hints[HEAP_HINT_COUNT];				// requests by allocation hint
+	TagStats tags[HEAP_TAG_COUNT];					// allocations by memory tag; transient and permanent allocations are not tagged
+	size_t size_histogram[HEAP_HISTOGRAM_BUCKETS];	// requests since startup by size; bucket i counts sizes below 16 << i, the last all others
+	size_t pool_count;			// number of pool allocators in use
+	size_t permanent_used_bytes;	// bytes consumed by permanent allocations including alignment padding
+	size_t permanent_free_count;	// frees of permanent allocations, which are ignored
+	size_t page_map_count;		// region and pool pages obtained from the system
+	size_t page_unmap_count;	// region and pool pages returned to the system
+	size_t page_reuse_count;	// region and pool pages taken from retained empty pages
+	size_t page_decommit_count;	// idle retained pages whose memory was returned to the system
+	size_t retained_page_bytes;	// bytes of committed empty pages retained for reuse
+	size_t resize_in_place_count;	// region resizes that grew or shrank the element in place
+	size_t resize_copy_count;		// region resizes that moved the contents to a new element
+	size_t large_cache_bytes;		// bytes of freed system mappings cached for reuse
+	size_t large_reuse_count;		// system allocations served from cached mappings
+	size_t promoted_allocation_count;	// DEFAULT allocations served from a pool because their size was promoted
+	size_t promoted_class_count;		// size classes whose DEFAULT allocations are promoted to pools
+	size_t verify_page_count;			// pages checked by the incremental verifier
+	size_t verify_pass_count;			// passes over the whole heap completed by the incremental verifier
+	size_t defrag_moved_bytes;			// bytes of relocatable allocations moved by the defragmenter
+	size_t defrag_reclaimed_bytes;		// bytes of region and pool pages emptied and released by the defragmenter
+	size_t defrag_pass_count;			// passes over the region and pool pages completed by the defragmenter
+	size_t defrag_pass_reclaimed_bytes;	// bytes of pages released during the last completed pass
+};
 
 class Heap
 {
@@ -13,27 +114,170 @@ public:
 	Heap() { memset(pools, 0, sizeof(pools)); }
 	~Heap(void) {}
 
-	void* Allocate(size_t size, New::Hint hint);
-	void* Resize(void* address, size_t new_size);
+	void* Allocate(size_t size, New::Hint hint) { return Allocate(size, HEAP_ALIGNMENT, hint); }
+	void* Allocate(size_t size, size_t alignment, New::Hint hint);	// alignment is a power of two; kept by resizes of region and system allocations
+	void* Resize(void* address, size_t new_size);					// moves between tiers when the new size is served by another
 	void* Relocate(void* address);
 	void  Free(void* address);
+	void  Free(void* address, size_t size);		// size is the size requested by an unaligned allocation or resize
+	void  AllocateBatch(size_t size, New::Hint hint, int count, void** addresses) { AllocateBatch(size, HEAP_ALIGNMENT, hint, count, addresses); }
+	void  AllocateBatch(size_t size, size_t alignment, New::Hint hint, int count, void** addresses);	// POOLABLE batches take one pool lock
+	void  FreeBatch(void** addresses, int count);	// pool elements are returned under one lock per run of the same pool
 
 	void EnableLeakTracking(bool flag) { leak_tracking = flag; }
 	void EnableSentinel(bool flag) { append_sentinel = flag; }
 	void EnableFillOnFree(bool flag) { fill_on_free = flag; }
+	void EnableThreadCache(bool flag);					// disabling returns the elements cached by every thread to the pools
+	void EnableTransientCheck(bool flag);
+	void SetPageRetention(unsigned int max_pages, unsigned int idle_frames, unsigned int idle_milliseconds);
+	void SetHugePages(HugePages mode);
+	void SetLargeCache(size_t max_bytes);				// bytes of freed large allocations kept for reuse; 0 disables
+	void SetGuardSampling(unsigned int sample_rate);	// guard one in sample_rate allocations on average; 0 disables
+	unsigned int GetGuardSampling(void) const { return guard_sample_rate.load(std::memory_order_relaxed); }
+	void BeginFrame(void);
+	void Scavenge(void);
+	void FlushThreadCache(void);						// returns the elements cached by the calling thread to the pools
 	void VerifyIntegrity(void);
+	bool VerifyStep(unsigned int max_pages = HEAP_VERIFY_PAGES, HeapCorruption* corruption = nullptr);	// false if corruption was found
 	void ReportLeaks(void);
+	void GetStats(HeapStats& stats);
+	static void WriteStatsCSV(FILE* file, const HeapStats& stats, bool header);	// header writes the column names before the row
+	static void WriteStatsJSON(FILE* file, const HeapStats& stats);				// writes one object per line
+	void SetBudget(int tag, size_t budget, HeapPressureCallback callback, unsigned int pressure_percent = HEAP_PRESSURE_PERCENT);	// a budget of 0 removes it
+	static int SetTag(int tag);									// tags later allocations of the calling thread; returns the previous tag
+	static int GetTag(void);
+	void EnablePromotion(bool flag);							// learn which DEFAULT sizes are short-lived and serve them from pools
+	void ClearPromotionProfile(void);
+	bool SavePromotionProfile(const char* filename);			// writes the sizes that are promoted
+	bool LoadPromotionProfile(const char* filename);			// replaces the promoted sizes with those of a saved profile
+	void EnableProfiler(size_t sample_bytes);					// samples one allocation per sample_bytes on average; 0 disables
+	size_t GetProfilerSampleBytes(void) const;					// 0 if the profiler is disabled
+	bool WriteProfile(const char* filename, bool live);		// writes folded stacks of live or cumulative bytes by call site
+	bool StartTrace(const char* filename);		// records heap operations to a trace file until StopTrace
+	void StopTrace(void);
+	void ReplayTrace(const char* filename);		// re-executes a trace against each allocator configuration
+	void  AddRelocatable(void** reference);		// lets the defragmenter move the allocation at *reference and update it
+	void* RemoveRelocatable(void** reference);	// returns the current address of the allocation, which may then be freed
+	bool  DefragmentStep(unsigned int budget_microseconds);	// true when the step completes a pass over the heap
 	void TestAllocators(void);
 
 	static Heap* GetInstance(void);
 
 private:
+	void* AllocateFromTier(size_t size, size_t alignment, New::Hint hint, unsigned int tag);
+	void* AllocateDefault(size_t size, size_t alignment, unsigned int tag, New::Hint hint);
+	class PoolAllocator* GetPool(size_t size);
+	class PoolAllocator* GetClassPool(int size_class);
+	class PoolAllocator* GetAlignedPool(size_t size, size_t alignment);
+	void* MoveAllocation(void* address, class Allocator* allocator, size_t new_size, New::Hint hint);
+	class Allocator* FindAllocator(void* address);
+	int   VerifyNext(HeapCorruption& corruption);
+	class Allocator* GetDefragmentTier(int tier);
+
 	bool append_sentinel = false;
 	bool leak_tracking = false;
 	bool fill_on_free = false;
-	class SystemAllocator* system_allocator = nullptr;
-	class RegionAllocator* default_allocator = nullptr;
-	class RegionAllocator* transient_allocator = nullptr;
-	class RegionAllocator* permanent_allocator = nullptr;
-	class PoolAllocator*   pools[LARGE_ALLOCATION_SIZE];
+	bool thread_cache_enabled = true;
+	bool transient_check = false;
+	unsigned int retain_max_pages = PAGE_RETAIN_MAX;
+	unsigned int retain_idle_frames = PAGE_IDLE_FRAMES;
+	unsigned int retain_idle_milliseconds = PAGE_IDLE_MILLISECONDS;
+	size_t large_cache_max = LARGE_CACHE_BYTES;
+	HugePages huge_pages = HugePages::NONE;
+	std::atomic<unsigned int> guard_sample_rate = 0;
+	HeapStats* previous_stats = nullptr;		// last snapshot taken by GetStats; used to calculate allocation rates
+	std::mutex mtx;
+	std::mutex verify_mtx;						// guards the position and counts of the incremental verifier
+	int verify_tier = 0;						// tier being checked by the incremental verifier
+	size_t verify_cursor = 0;					// position of the verifier within its tier
+	size_t verify_pages = 0;
+	size_t verify_passes = 0;
+	std::mutex defrag_mtx;						// guards the position and counts of the defragmenter
+	int defrag_tier = 0;						// region allocator, then each pool in size class order
+	unsigned int defrag_pass = 1;				// pages are chosen for evacuation at most once per pass
+	class Allocator* defrag_allocator = nullptr;	// allocator evacuating a page, or nullptr
+	size_t defrag_moved = 0;
+	size_t defrag_reclaimed = 0;
+	size_t defrag_pass_reclaimed = 0;			// bytes released during the pass in progress
+	size_t defrag_last_reclaimed = 0;			// bytes released during the last completed pass
+	size_t defrag_passes = 0;
+	class SystemAllocator*    system_allocator = nullptr;
+	class RegionAllocator*    default_allocator = nullptr;
+	class TransientAllocator* transient_allocator = nullptr;
+	class PermanentAllocator* permanent_allocator = nullptr;
+	class GuardedAllocator*   guarded_allocator = nullptr;
+	class PoolArena*          pool_arena = nullptr;
+	class PoolAllocator*      pools[POOL_SIZE_CLASSES];
 };
+
+// Tags the allocations made by the calling thread while the scope is open
+class HeapTag
+{
+public:
+	explicit HeapTag(int tag) { previous = Heap::SetTag(tag); }
+	~HeapTag(void) { Heap::SetTag(previous); }
+private:
+	int previous;
+};
+
+// Owns a DEFAULT or POOLABLE allocation that the defragmenter may move; the address is read through Get and must not be
+// kept across a call to Heap::DefragmentStep, nor used by another thread during one
+class HeapHandle
+{
+public:
+	HeapHandle(void) {}
+	HeapHandle(const HeapHandle&) = delete;
+	HeapHandle& operator=(const HeapHandle&) = delete;
+	~HeapHandle(void) { Free(); }
+
+	void* Allocate(size_t size, New::Hint hint = New::Hint::DEFAULT)
+	{
+		Free();
+		address = Heap::GetInstance()->Allocate(size, hint);
+		Heap::GetInstance()->AddRelocatable(&address);
+		return address;
+	}
+	void Free(void)
+	{
+		if (!address) return;
+		Heap* heap = Heap::GetInstance();
+		heap->Free(heap->RemoveRelocatable(&address));
+		address = nullptr;
+	}
+	void* Get(void) const { return address; }
+
+private:
+	void* address = nullptr;
+};
+
+// Construct objects in a batch of POOLABLE allocations; objects receives a pointer to each. If a constructor throws, the
+// objects already constructed are destroyed and the whole batch is freed before the exception is passed on.
+template <class T, class... Args>
+void NewBatch(T** objects, int count, Args&&... args)
+{
+	Heap* heap = Heap::GetInstance();
+	heap->AllocateBatch(sizeof(T), alignof(T), New::Hint::POOLABLE, count, (void**)objects);
+	int constructed = 0;
+	try {
+		for (; constructed < count; constructed++)
+		{
+			new (objects[constructed]) T(args...);
+		}
+	}
+	catch (...) {
+		while (constructed > 0) objects[--constructed]->~T();
+		heap->FreeBatch((void**)objects, count);
+		throw;
+	}
+}
+
+// Destroy objects and free them in a batch
+template <class T>
+void DeleteBatch(T** objects, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		objects[i]->~T();
+	}
+	Heap::GetInstance()->FreeBatch((void**)objects, count);
+}
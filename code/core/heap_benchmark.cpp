@@ -0,0 +1,2264 @@
+/* Copyright is waived. No warranty is provided. Unrestricted use and modification is permitted. */
+
+#include "precompiled.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+#include <cstdio>
+#include "core/heap.h"
+#include "core/heap_trace.h"
+#include "core/heap_profiler.h"
+#include "core/heap_resource.h"
+
+#if defined(_WINDOWS)
+#include <windows.h>
+#include <psapi.h>
+#endif
+
+// Configuration
+#define BENCHMARK_MAX_THREADS		(16)		// Upper limit on the number of threads used by scaling benchmarks
+#define BENCHMARK_POOL_BATCH		(32)		// Number of elements each thread holds live between frees
+#define BENCHMARK_POOL_ITERATIONS	(20000)		// Number of allocate/free batches executed by each thread
+#define BENCHMARK_HANDOFF_OBJECTS	(200000)	// Number of objects each producer passes to its consumer
+#define BENCHMARK_HANDOFF_RING		(1024)		// Number of objects in flight between a producer and its consumer
+#define BENCHMARK_BATCH_SIZE		(256)		// Number of objects spawned together by the batch allocation benchmark
+#define BENCHMARK_BATCH_ROUNDS		(4000)		// Number of times each batch is allocated and freed
+#define BENCHMARK_ALIGNED_OBJECTS	(20000)		// Number of objects allocated at each alignment by the aligned allocation report
+#define BENCHMARK_SIZED_OBJECTS		(100000)	// Number of objects freed with and without their size by the sized free benchmark
+#define BENCHMARK_TIER_ROUNDS		(2000)		// Number of times an allocation is resized through every tier
+#define BENCHMARK_TRANSIENT_GROWTH	((size_t)4<<20)	// Size to which a transient allocation grows; beyond a transient buffer chunk
+#define BENCHMARK_PROMOTE_ROUNDS	(20000)		// Number of batches of short-lived DEFAULT objects churned by the promotion report
+#define BENCHMARK_PROMOTE_LIVE		(2000)		// Number of long-lived DEFAULT objects held while promotion is learned
+#define BENCHMARK_TAG_BUDGET		(4<<20)		// Budget of the cache filled by the memory tag report
+#define BENCHMARK_TAG_FILL			(32<<20)	// Bytes added to the budgeted cache, shedding entries under pressure
+#define BENCHMARK_VERIFY_OBJECTS	(100000)	// Number of objects live while the incremental verifier is timed
+#define BENCHMARK_DEFRAG_OBJECTS	(80000)		// Number of relocatable objects allocated before most are freed
+#define BENCHMARK_DEFRAG_KEEP		(8)			// One in this many relocatable objects is kept live
+#define BENCHMARK_DEFRAG_BUDGET		(500)		// Microseconds given to the defragmenter in each simulated frame
+#define BENCHMARK_DEFRAG_FRAMES		(2000)		// Upper limit on the simulated frames run by the defragmentation report
+#define BENCHMARK_CONTAINER_FRAMES	(200)		// Number of simulated frames in which the container workloads build their containers
+#define BENCHMARK_CONTAINER_ITEMS	(10000)		// Number of items added to each container in a frame
+#define BENCHMARK_TABLE_KEYS		(50000)		// Number of keys in the lookup table of the container workloads
+#define BENCHMARK_TABLE_LOOKUPS		(1000000)	// Number of lookups made in the lookup table
+#define BENCHMARK_WORKLOAD_SEED		(20240601)	// Seed of the mixed-size workload so every run replays the same sequence
+#define BENCHMARK_WORKLOAD_OPS		(400000)	// Number of operations in the mixed-size workload
+#define BENCHMARK_WORKLOAD_LIVE		(20000)		// Upper limit on live allocations in the mixed-size workload
+#define BENCHMARK_POOL_PAGE_SIZE	(1<<17)		// Page size of the pool allocator; used to model exact-size pools
+#define BENCHMARK_DENSITY_OBJECTS	(200000)	// Number of small objects held live by the pool density report
+#define BENCHMARK_PAGE_COUNTS		{ 1000, 10000 }	// Numbers of live pool pages at which allocation time is measured
+#define BENCHMARK_PAGE_OBJECT_SIZE	(16000)		// Size of the objects that fill pool pages; a page holds 7 or 8
+#define BENCHMARK_PAGE_ROUNDS		(5000)		// Number of free-one, allocate-two rounds timed over the live pages
+#define BENCHMARK_REGION_BLOCKS		(40000)		// Number of blocks used to fragment the region allocator
+#define BENCHMARK_REGION_OPS		(40000)		// Number of timed operations on the fragmented region allocator
+#define BENCHMARK_GROWTH_ROUNDS		(2000)		// Number of times each growth pattern is repeated
+#define BENCHMARK_GROWTH_LIMIT		(30000)		// Size at which a growing buffer is released; below LARGE_ALLOCATION_SIZE
+#define BENCHMARK_FRAMES			(2000)		// Number of simulated frames in the scratch allocation benchmark
+#define BENCHMARK_FRAME_ALLOCATIONS	(1000)		// Number of scratch allocations made in each simulated frame
+#define BENCHMARK_THRASH_CYCLES		(10000)		// Number of allocate/free cycles across a page boundary
+#define BENCHMARK_DECOMMIT_PAGES	(64)		// Number of region pages freed into the retained cache and then decommitted
+#define BENCHMARK_HUGE_PAGES		(4)			// Number of explicit huge region pages retained, scavenged and reused
+#define BENCHMARK_LARGE_ROUNDS		(2000)		// Number of simulated frames that allocate and free a set of large buffers
+#define BENCHMARK_LARGE_SIZES		{ 40000, 96000, 200000, 350000, 700000, 1500000 }	// Sizes of the large buffers of each frame
+#define BENCHMARK_STRESS_THREADS	(4)			// Upper limit on the number of threads used by the multi-threaded stress runs
+#define BENCHMARK_STRESS_SLOTS		(4096)		// Upper limit on live allocations held by each stress thread
+#define BENCHMARK_STRESS_OPS		(200000)	// Number of operations in each thread's random mix trace
+#define BENCHMARK_STRESS_FRAME_OPS	(1000)		// Number of random mix operations between frame boundaries
+#define BENCHMARK_STRESS_FRAMES		(300)		// Number of frames in each thread's frame trace
+#define BENCHMARK_STRESS_VERIFY		(10)		// Number of frames between integrity checks during stress runs
+#define BENCHMARK_REPLAY_SAMPLE		(1024)		// Number of replayed operations between footprint samples
+#define BENCHMARK_TRACE_FILE		"heap_benchmark.trace"	// Trace recorded and replayed by TestAllocators
+
+//#################################################################################################################################
+// Pool Scaling Benchmark
+//#################################################################################################################################
+
+// Churn small POOLABLE objects; each thread allocates a batch of mixed sizes and then frees it
+static void PoolChurn(void)
+{
+	static const size_t sizes[] = { 16, 24, 32, 48, 64, 96, 128, 256 };
+	void* live[BENCHMARK_POOL_BATCH];
+	Heap* heap = Heap::GetInstance();
+	for (int i = 0; i < BENCHMARK_POOL_ITERATIONS; i++)
+	{
+		for (int j = 0; j < BENCHMARK_POOL_BATCH; j++)
+		{
+			live[j] = heap->Allocate(sizes[(i + j) & 7], New::Hint::POOLABLE);
+		}
+		for (int j = 0; j < BENCHMARK_POOL_BATCH; j++)
+		{
+			heap->Free(live[j]);
+		}
+	}
+}
+
+// Measure pool throughput at 1..N threads in millions of allocate+free pairs per second
+static double MeasurePoolThroughput(int num_threads)
+{
+	auto start_time = std::chrono::high_resolution_clock::now();
+	std::vector<std::thread> threads;
+	for (int i = 0; i < num_threads; i++)
+	{
+		threads.emplace_back(PoolChurn);
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	std::chrono::duration<double> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+	double operations = (double)num_threads * BENCHMARK_POOL_ITERATIONS * BENCHMARK_POOL_BATCH;
+	return operations / elapsed_time.count() / 1000000.0;
+}
+
+static void BenchmarkPoolScaling(void)
+{
+	int max_threads = (int)std::thread::hardware_concurrency();
+	if (max_threads < 1) max_threads = 1;
+	if (max_threads > BENCHMARK_MAX_THREADS) max_threads = BENCHMARK_MAX_THREADS;
+
+	printf("Pool scaling (million allocate+free pairs per second)\n");
+	printf("  threads      locked    cached\n");
+	Heap* heap = Heap::GetInstance();
+	for (int num_threads = 1; num_threads <= max_threads; num_threads++)
+	{
+		heap->EnableThreadCache(false);
+		double locked = MeasurePoolThroughput(num_threads);
+		heap->EnableThreadCache(true);
+		double cached = MeasurePoolThroughput(num_threads);
+		printf("  %7d  %10.2f  %8.2f\n", num_threads, locked, cached);
+	}
+}
+
+//#################################################################################################################################
+// Producer/Consumer Benchmark
+//#################################################################################################################################
+
+// Objects in flight from a producer thread to its consumer thread
+struct HandoffRing
+{
+	void* objects[BENCHMARK_HANDOFF_RING];
+	std::atomic<unsigned int> head = 0;		// count of objects produced
+	std::atomic<unsigned int> tail = 0;		// count of objects consumed
+};
+
+// Allocate pool and region objects and pass them to the consumer
+static void ProduceObjects(HandoffRing* ring, bool use_heap)
+{
+	static const size_t sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+	Heap* heap = Heap::GetInstance();
+	for (unsigned int i = 0; i < BENCHMARK_HANDOFF_OBJECTS; i++)
+	{
+		size_t size = sizes[i & 7];
+		New::Hint hint = size <= 256 ? New::Hint::POOLABLE : New::Hint::DEFAULT;
+		void* object = use_heap ? heap->Allocate(size, hint) : malloc(size);
+		*(unsigned int*)object = i;
+		while (i - ring->tail.load(std::memory_order_acquire) == BENCHMARK_HANDOFF_RING)
+		{
+			std::this_thread::yield();
+		}
+		ring->objects[i % BENCHMARK_HANDOFF_RING] = object;
+		ring->head.store(i + 1, std::memory_order_release);
+	}
+}
+
+// Free the objects made by the producer, so every free is made by a thread other than the one that allocated
+static void ConsumeObjects(HandoffRing* ring, bool use_heap)
+{
+	Heap* heap = Heap::GetInstance();
+	for (unsigned int i = 0; i < BENCHMARK_HANDOFF_OBJECTS; i++)
+	{
+		while (ring->head.load(std::memory_order_acquire) == i)
+		{
+			std::this_thread::yield();
+		}
+		void* object = ring->objects[i % BENCHMARK_HANDOFF_RING];
+		ring->tail.store(i + 1, std::memory_order_release);
+		if (*(unsigned int*)object != i) throw("producer/consumer object was corrupted");
+		use_heap ? heap->Free(object) : free(object);
+	}
+}
+
+// Measure throughput of 1..N producer/consumer pairs in millions of objects passed per second
+static double MeasureHandoffThroughput(int num_pairs, bool use_heap)
+{
+	std::vector<HandoffRing> rings(num_pairs);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	std::vector<std::thread> threads;
+	for (int i = 0; i < num_pairs; i++)
+	{
+		threads.emplace_back(ProduceObjects, &rings[i], use_heap);
+		threads.emplace_back(ConsumeObjects, &rings[i], use_heap);
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	std::chrono::duration<double> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+	return (double)num_pairs * BENCHMARK_HANDOFF_OBJECTS / elapsed_time.count() / 1000000.0;
+}
+
+// Producers allocate and consumers free, so frees contend with allocations of the same allocators. A free that finds
+// its allocator locked is deferred to the allocator's lock-free list rather than waiting.
+static void BenchmarkProducerConsumer(void)
+{
+	int max_pairs = (int)std::thread::hardware_concurrency() / 2;
+	if (max_pairs < 1) max_pairs = 1;
+	if (max_pairs > BENCHMARK_MAX_THREADS / 2) max_pairs = BENCHMARK_MAX_THREADS / 2;
+
+	printf("Producer/consumer (million objects passed per second)\n");
+	printf("    pairs      locked    cached    malloc\n");
+	Heap* heap = Heap::GetInstance();
+	for (int num_pairs = 1; num_pairs <= max_pairs; num_pairs++)
+	{
+		heap->EnableThreadCache(false);
+		double locked = MeasureHandoffThroughput(num_pairs, true);
+		heap->EnableThreadCache(true);
+		double cached = MeasureHandoffThroughput(num_pairs, true);
+		double system = MeasureHandoffThroughput(num_pairs, false);
+		printf("  %7d  %10.2f  %8.2f  %8.2f\n", num_pairs, locked, cached, system);
+	}
+	heap->VerifyIntegrity();
+
+	// A region element is claimed before its free can be deferred, so a second free throws in the caller
+	void* block = heap->Allocate(300, New::Hint::DEFAULT);
+	heap->Free(block);
+	bool detected = false;
+	try {
+		heap->Free(block);
+	}
+	catch (const char*) {
+		detected = true;
+	}
+	printf("  double free of a region element %s\n", detected ? "detected" : "NOT DETECTED");
+}
+
+//#################################################################################################################################
+// Batch Allocation Benchmark
+//#################################################################################################################################
+
+// Small object spawned in groups, such as a particle or a scene graph node
+struct BatchObject
+{
+	float position[3];
+	float velocity[3];
+	unsigned int flags;
+	BatchObject(unsigned int flags) : position(), velocity(), flags(flags) {}
+};
+
+// Over-aligned object, such as a matrix used with SIMD loads
+struct alignas(64) AlignedBatchObject
+{
+	float matrix[16];
+};
+
+// Object whose constructor fails once a number of objects have been constructed
+struct FailingBatchObject
+{
+	static inline int remaining = 0;		// constructions that succeed before one throws
+	static inline int destroyed = 0;
+	unsigned int flags;
+	FailingBatchObject(void) : flags(0) { if (remaining-- == 0) throw("batch object construction failed"); }
+	~FailingBatchObject(void) { destroyed++; }
+};
+
+// Allocate and free groups of objects one at a time and in batches; returns million objects per second
+static double MeasureBatchThroughput(bool batch)
+{
+	BatchObject* objects[BENCHMARK_BATCH_SIZE];
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int round = 0; round < BENCHMARK_BATCH_ROUNDS; round++)
+	{
+		if (batch)
+		{
+			NewBatch(objects, BENCHMARK_BATCH_SIZE, (unsigned int)round);
+			DeleteBatch(objects, BENCHMARK_BATCH_SIZE);
+		}
+		else
+		{
+			for (int i = 0; i < BENCHMARK_BATCH_SIZE; i++)
+			{
+				objects[i] = new (New::Hint::POOLABLE) BatchObject((unsigned int)round);
+			}
+			for (int i = 0; i < BENCHMARK_BATCH_SIZE; i++)
+			{
+				delete objects[i];
+			}
+		}
+	}
+	std::chrono::duration<double> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+	return (double)BENCHMARK_BATCH_ROUNDS * BENCHMARK_BATCH_SIZE / elapsed_time.count() / 1000000.0;
+}
+
+// Check that batches of over-aligned objects are aligned, and that a batch whose construction fails is destroyed and
+// freed
+static void CheckBatchConstruction(void)
+{
+	Heap* heap = Heap::GetInstance();
+	AlignedBatchObject* aligned[BENCHMARK_BATCH_SIZE];
+	NewBatch(aligned, BENCHMARK_BATCH_SIZE);
+	for (AlignedBatchObject* object : aligned)
+	{
+		if ((size_t)object & (alignof(AlignedBatchObject) - 1)) throw("batch object is misaligned");
+	}
+	DeleteBatch(aligned, BENCHMARK_BATCH_SIZE);
+
+	FailingBatchObject* objects[BENCHMARK_BATCH_SIZE];
+	HeapStats before, after;
+	heap->GetStats(before);
+	FailingBatchObject::remaining = BENCHMARK_BATCH_SIZE / 2;
+	FailingBatchObject::destroyed = 0;
+	bool thrown = false;
+	try {
+		NewBatch(objects, BENCHMARK_BATCH_SIZE);
+	}
+	catch (const char*) {
+		thrown = true;
+	}
+	heap->GetStats(after);
+	if (!thrown || FailingBatchObject::destroyed != BENCHMARK_BATCH_SIZE / 2) throw("failed batch construction was not unwound");
+	if (after.pools.live_allocations != before.pools.live_allocations) throw("failed batch construction leaked its elements");
+}
+
+static void BenchmarkBatchAllocation(void)
+{
+	printf("Batch allocation (%d objects of %zu bytes, million objects allocated and freed per second)\n", BENCHMARK_BATCH_SIZE, sizeof(BatchObject));
+	printf("  thread cache   per object     batch\n");
+	Heap* heap = Heap::GetInstance();
+	for (int cached = 0; cached <= 1; cached++)
+	{
+		heap->EnableThreadCache(cached != 0);
+		double single = MeasureBatchThroughput(false);
+		double batch = MeasureBatchThroughput(true);
+		printf("  %-12s %10.2f  %8.2f\n", cached ? "on" : "off", single, batch);
+	}
+	CheckBatchConstruction();
+}
+
+//#################################################################################################################################
+// Aligned Allocation Report
+//#################################################################################################################################
+
+// Allocate objects at an alignment, check that each is aligned and stays aligned when resized, and return million
+// allocations per second. Resizing system allocations maps memory so large objects are made in smaller numbers.
+static double MeasureAlignedThroughput(size_t size, size_t alignment, New::Hint hint)
+{
+	int count = size >= LARGE_ALLOCATION_SIZE ? BENCHMARK_ALIGNED_OBJECTS / 100 : BENCHMARK_ALIGNED_OBJECTS;
+	std::vector<void*> objects(count);
+	Heap* heap = Heap::GetInstance();
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < count; i++)
+	{
+		objects[i] = heap->Allocate(size, alignment, hint);
+	}
+	std::chrono::duration<double> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+	for (int i = 0; i < count; i++)
+	{
+		if ((size_t)objects[i] & (alignment - 1)) throw("aligned allocation is misaligned");
+		if (hint != New::Hint::POOLABLE)
+		{
+			objects[i] = heap->Resize(objects[i], size * 2);
+			if ((size_t)objects[i] & (alignment - 1)) throw("aligned allocation is misaligned after resize");
+		}
+		heap->Free(objects[i]);
+	}
+	return count / elapsed_time.count() / 1000000.0;
+}
+
+static void ReportAlignedAllocation(void)
+{
+	static const size_t alignments[] = { 8, 16, 32, 64, 256, 4096 };
+	printf("Aligned allocation (million allocations per second)\n");
+	printf("  alignment   pool 48   region 200   system 40000\n");
+	for (size_t alignment : alignments)
+	{
+		double pool = MeasureAlignedThroughput(48, alignment, New::Hint::POOLABLE);
+		double region = MeasureAlignedThroughput(200, alignment, New::Hint::DEFAULT);
+		double system = MeasureAlignedThroughput(40000, alignment, New::Hint::DEFAULT);
+		printf("  %9zu  %8.2f  %11.2f  %13.3f\n", alignment, pool, region, system);
+	}
+	Heap::GetInstance()->VerifyIntegrity();
+}
+
+//#################################################################################################################################
+// Sized Free Benchmark
+//#################################################################################################################################
+
+// Free POOLABLE objects with or without their size and return million frees per second
+static double MeasureFreeThroughput(bool sized)
+{
+	static const size_t sizes[] = { 16, 24, 32, 48, 64, 96, 128, 256 };
+	std::vector<void*> objects(BENCHMARK_SIZED_OBJECTS);
+	Heap* heap = Heap::GetInstance();
+	for (int i = 0; i < BENCHMARK_SIZED_OBJECTS; i++)
+	{
+		objects[i] = heap->Allocate(sizes[i & 7], New::Hint::POOLABLE);
+	}
+
+	// Free in a shuffled order so that page headers are not already cached
+	std::mt19937 random(BENCHMARK_WORKLOAD_SEED);
+	std::vector<int> order(BENCHMARK_SIZED_OBJECTS);
+	for (int i = 0; i < BENCHMARK_SIZED_OBJECTS; i++) order[i] = i;
+	std::shuffle(order.begin(), order.end(), random);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int i : order)
+	{
+		if (sized) heap->Free(objects[i], sizes[i & 7]);
+		else heap->Free(objects[i]);
+	}
+	std::chrono::duration<double> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+	return BENCHMARK_SIZED_OBJECTS / elapsed_time.count() / 1000000.0;
+}
+
+// Resize one allocation up through the pool, region and system tiers and back down, checking that its contents move
+// with it; returns microseconds per resize
+static double MeasureTierResize(void)
+{
+	static const size_t sizes[] = { 24, 200, 4000, 40000, 100000, 3000, 100, 16 };
+	Heap* heap = Heap::GetInstance();
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int round = 0; round < BENCHMARK_TIER_ROUNDS; round++)
+	{
+		unsigned char* address = (unsigned char*)heap->Allocate(sizes[7], New::Hint::POOLABLE);
+		memset(address, round & 0xFF, sizes[7]);
+		for (size_t size : sizes)
+		{
+			address = (unsigned char*)heap->Resize(address, size);
+			if (address[0] != (round & 0xFF) || address[15] != (round & 0xFF)) throw("resize across tiers lost the contents");
+		}
+		heap->Free(address, sizes[7]);
+	}
+	std::chrono::duration<double> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+	return elapsed_time.count() * 1000000.0 / (BENCHMARK_TIER_ROUNDS * (sizeof(sizes) / sizeof(sizes[0])));
+}
+
+// Grow a transient allocation within its buffer and then past the end of a chunk, which moves it to another tier, and
+// free pool elements with the size of another class, which must fall back to an unsized free
+static void CheckResizeFallbacks(void)
+{
+	Heap* heap = Heap::GetInstance();
+	unsigned char* address = (unsigned char*)heap->Allocate(1000, New::Hint::TRANSIENT);
+	memset(address, 0x5A, 1000);
+	address = (unsigned char*)heap->Resize(address, 40000);
+	if (!address) throw("transient resize within a chunk failed");
+	address = (unsigned char*)heap->Resize(address, BENCHMARK_TRANSIENT_GROWTH);
+	if (!address) throw("transient resize past a chunk failed");
+	if (address[0] != 0x5A || address[999] != 0x5A) throw("transient resize lost the contents");
+	memset(address, 0x5A, BENCHMARK_TRANSIENT_GROWTH);
+	heap->Free(address);
+
+	void* small = heap->Allocate(24, New::Hint::POOLABLE);
+	void* aligned = heap->Allocate(48, 64, New::Hint::POOLABLE);
+	heap->Free(small, 200);
+	heap->Free(aligned, 48);
+
+	HeapStats before, after;
+	heap->GetStats(before);
+	heap->Free(heap->Allocate(64, New::Hint::PERMANENT));
+	heap->GetStats(after);
+	if (after.permanent_free_count != before.permanent_free_count + 1) throw("free of a permanent allocation was not counted");
+
+	// A POOLABLE allocation too large for a pool keeps its hint, so it moves to a pool when it shrinks
+	heap->FlushThreadCache();
+	heap->GetStats(before);
+	void* block = heap->Allocate(LARGE_ALLOCATION_SIZE, New::Hint::POOLABLE);
+	block = heap->Resize(block, 64);
+	heap->FlushThreadCache();
+	heap->GetStats(after);
+	if (after.pools.live_allocations != before.pools.live_allocations + 1) throw("resize did not keep the POOLABLE hint");
+	heap->Free(block);
+}
+
+static void BenchmarkSizedFree(void)
+{
+	Heap* heap = Heap::GetInstance();
+	heap->EnableThreadCache(false);
+	double unsized = MeasureFreeThroughput(false);
+	double sized = MeasureFreeThroughput(true);
+	heap->EnableThreadCache(true);
+	printf("Sized free (%d shuffled pool frees, million per second)\n", BENCHMARK_SIZED_OBJECTS);
+	printf("  unsized %.2f   sized %.2f\n", unsized, sized);
+	printf("Resize across pool, region and system tiers (microseconds per resize)\n");
+	printf("  %.3f\n", MeasureTierResize());
+	CheckResizeFallbacks();
+	heap->VerifyIntegrity();
+}
+
+//#################################################################################################################################
+// Size Promotion Report
+//#################################################################################################################################
+
+// Churn short-lived DEFAULT objects of a few sizes, as code that never passes POOLABLE does; returns million
+// allocate+free pairs per second
+static double ChurnDefaultSizes(void)
+{
+	static const size_t sizes[] = { 40, 72, 136, 40 };
+	void* live[BENCHMARK_POOL_BATCH];
+	Heap* heap = Heap::GetInstance();
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < BENCHMARK_PROMOTE_ROUNDS; i++)
+	{
+		for (int j = 0; j < BENCHMARK_POOL_BATCH; j++)
+		{
+			live[j] = heap->Allocate(sizes[(i + j) & 3], New::Hint::DEFAULT);
+		}
+		for (int j = 0; j < BENCHMARK_POOL_BATCH; j++)
+		{
+			heap->Free(live[j]);
+		}
+	}
+	std::chrono::duration<double> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+	return (double)BENCHMARK_PROMOTE_ROUNDS * BENCHMARK_POOL_BATCH / elapsed_time.count() / 1000000.0;
+}
+
+// Compare the churn before and after its sizes are learned. Long-lived objects of another size are held throughout
+// and freed after PROMOTE_LIFETIME_MS, so their class must not be promoted.
+static void ReportSizePromotion(void)
+{
+	Heap* heap = Heap::GetInstance();
+	heap->ClearPromotionProfile();
+	heap->EnablePromotion(false);
+	double region = ChurnDefaultSizes();
+
+	std::vector<void*> long_lived;
+	heap->EnablePromotion(true);
+	for (int i = 0; i < BENCHMARK_PROMOTE_LIVE; i++)
+	{
+		long_lived.push_back(heap->Allocate(520, New::Hint::DEFAULT));
+	}
+	ChurnDefaultSizes();
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	for (void* address : long_lived)
+	{
+		heap->Free(address);
+	}
+
+	HeapStats before, after;
+	heap->GetStats(before);
+	double promoted = ChurnDefaultSizes();
+	heap->GetStats(after);
+	heap->EnablePromotion(false);
+	printf("Size promotion (DEFAULT churn, million allocate+free pairs per second)\n");
+	printf("  region %.2f   promoted %.2f   classes promoted %zu (3 expected)   promoted allocations %zu\n", region, promoted,
+		after.promoted_class_count, after.promoted_allocation_count - before.promoted_allocation_count);
+	heap->ClearPromotionProfile();
+}
+
+//#################################################################################################################################
+// Memory Tag Report
+//#################################################################################################################################
+
+#define BENCHMARK_TAG_MIXED		(5)			// Tag of the mixed allocations whose count is checked
+#define BENCHMARK_TAG_CACHE		(6)			// Tag of the budgeted cache
+
+static std::vector<void*> tag_cache;		// entries of the budgeted cache, oldest first
+
+// Pressure callback of the cache; sheds the older half of its entries
+static void ShedTagCache(int tag, size_t live_bytes, size_t budget)
+{
+	(tag); (live_bytes); (budget);		// unreferenced parameters
+	size_t shed = tag_cache.size() / 2;
+	for (size_t i = 0; i < shed; i++)
+	{
+		Heap::GetInstance()->Free(tag_cache[i]);
+	}
+	tag_cache.erase(tag_cache.begin(), tag_cache.begin() + shed);
+}
+
+// Check that the count of a tag follows allocations of every tagged tier, then fill a budgeted cache that sheds
+// entries when its pressure callback is called, and time POOLABLE churn in a tag scope against churn outside one
+static void ReportMemoryTags(void)
+{
+	static const size_t sizes[] = { 48, 200, 3000, 40000 };
+	static const New::Hint hints[] = { New::Hint::POOLABLE, New::Hint::DEFAULT, New::Hint::DEFAULT, New::Hint::DEFAULT };
+	Heap* heap = Heap::GetInstance();
+	HeapStats stats;
+
+	// The vectors are reserved outside the tag scopes so that they are not counted, and so that the cache does not
+	// grow while the pressure callback sheds its entries
+	std::vector<void*> mixed;
+	mixed.reserve(4000);
+	size_t requested = 0;
+	{
+		HeapTag tag(BENCHMARK_TAG_MIXED);
+		for (int i = 0; i < 4000; i++)
+		{
+			mixed.push_back(heap->Allocate(sizes[i & 3], hints[i & 3]));
+			requested += sizes[i & 3];
+		}
+	}
+	heap->GetStats(stats);
+	size_t mixed_live = stats.tags[BENCHMARK_TAG_MIXED].live_bytes;
+	for (void* address : mixed)
+	{
+		heap->Free(address);
+	}
+	heap->GetStats(stats);
+	printf("Memory tags\n");
+	printf("  mixed tiers: requested %zu bytes, tag live %zu bytes, after free %zu bytes\n", requested, mixed_live,
+		stats.tags[BENCHMARK_TAG_MIXED].live_bytes);
+
+	tag_cache.reserve(BENCHMARK_TAG_FILL / 1024);
+	heap->SetBudget(BENCHMARK_TAG_CACHE, BENCHMARK_TAG_BUDGET, ShedTagCache);
+	{
+		HeapTag tag(BENCHMARK_TAG_CACHE);
+		for (size_t filled = 0; filled < BENCHMARK_TAG_FILL; filled += 1024)
+		{
+			tag_cache.push_back(heap->Allocate(1024, New::Hint::DEFAULT));
+		}
+	}
+	heap->GetStats(stats);
+	const TagStats& cache = stats.tags[BENCHMARK_TAG_CACHE];
+	printf("  budgeted cache: %d KB added, peak %zu KB of %zu KB budget, %zu pressure callbacks\n", BENCHMARK_TAG_FILL >> 10,
+		cache.peak_bytes >> 10, cache.budget >> 10, cache.pressure_count);
+	for (void* address : tag_cache)
+	{
+		heap->Free(address);
+	}
+	tag_cache.clear();
+	heap->SetBudget(BENCHMARK_TAG_CACHE, 0, nullptr);
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	PoolChurn();
+	std::chrono::duration<double> untagged(std::chrono::high_resolution_clock::now() - start_time);
+	start_time = std::chrono::high_resolution_clock::now();
+	{
+		HeapTag tag(BENCHMARK_TAG_MIXED);
+		PoolChurn();
+	}
+	std::chrono::duration<double> tagged(std::chrono::high_resolution_clock::now() - start_time);
+	double pairs = (double)BENCHMARK_POOL_ITERATIONS * BENCHMARK_POOL_BATCH / 1000000.0;
+	printf("  POOLABLE churn (million allocate+free pairs per second): untagged %.2f   tagged %.2f\n", pairs / untagged.count(), pairs / tagged.count());
+}
+
+//#################################################################################################################################
+// Incremental Verifier Report
+//#################################################################################################################################
+
+// Step the verifier until it finds corruption or completes a pass; returns false if corruption was found
+static bool VerifyPass(HeapCorruption& corruption)
+{
+	Heap* heap = Heap::GetInstance();
+	HeapStats stats;
+	heap->GetStats(stats);
+	size_t passes = stats.verify_pass_count;
+	do {
+		if (!heap->VerifyStep(HEAP_VERIFY_PAGES, &corruption)) return false;
+		heap->GetStats(stats);
+	} while (stats.verify_pass_count == passes);
+	return true;
+}
+
+// Compare the time of a full integrity check with the steps of the incremental verifier over the same live objects.
+// With sentinels on, overrun a region allocation and a pool element in turn and check that the verifier reports them.
+static void ReportIncrementalVerifier(bool sentinels)
+{
+	Heap* heap = Heap::GetInstance();
+	std::vector<void*> live;
+	for (int i = 0; i < BENCHMARK_VERIFY_OBJECTS; i++)
+	{
+		live.push_back(heap->Allocate(16 + (i * 37) % 2000, (i & 1) ? New::Hint::POOLABLE : New::Hint::DEFAULT));
+	}
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	heap->VerifyIntegrity();
+	std::chrono::duration<double, std::micro> full(std::chrono::high_resolution_clock::now() - start_time);
+
+	// Finish the pass in progress so that the timed pass starts at the beginning of the heap
+	HeapCorruption corruption;
+	VerifyPass(corruption);
+	HeapStats before, after;
+	heap->GetStats(before);
+	double longest = 0, total = 0;
+	int steps = 0;
+	do {
+		start_time = std::chrono::high_resolution_clock::now();
+		heap->VerifyStep(HEAP_VERIFY_PAGES);
+		std::chrono::duration<double, std::micro> step(std::chrono::high_resolution_clock::now() - start_time);
+		total += step.count();
+		if (step.count() > longest) longest = step.count();
+		steps++;
+		heap->GetStats(after);
+	} while (after.verify_pass_count == before.verify_pass_count);
+	printf("Incremental verifier (%d live objects)\n", BENCHMARK_VERIFY_OBJECTS);
+	printf("  full check %.0f us   pass of %d steps of %d pages (%zu pages), mean step %.1f us, longest %.1f us\n", full.count(),
+		steps, HEAP_VERIFY_PAGES, after.verify_page_count - before.verify_page_count, total / steps, longest);
+
+	if (sentinels)
+	{
+		static const New::Hint hints[] = { New::Hint::DEFAULT, New::Hint::POOLABLE };
+		for (New::Hint hint : hints)
+		{
+			// Sizes that are multiples of 8 are followed directly by their sentinel
+			unsigned char* address = (unsigned char*)heap->Allocate(96, hint);
+			unsigned char sentinel = address[96];
+			address[96] = ~sentinel;
+			bool detected = !VerifyPass(corruption) && corruption.address == address;
+			address[96] = sentinel;
+			heap->Free(address);
+			printf("  overrun of a %s allocation %s\n", hint == New::Hint::DEFAULT ? "DEFAULT" : "POOLABLE", detected ? "reported" : "NOT REPORTED");
+		}
+	}
+
+	for (void* address : live)
+	{
+		heap->Free(address);
+	}
+}
+
+//#################################################################################################################################
+// Defragmentation Report
+//#################################################################################################################################
+
+// Return the page bytes of the region allocator and the pools
+static size_t GetCompactablePageBytes(void)
+{
+	HeapStats stats;
+	Heap::GetInstance()->GetStats(stats);
+	return stats.region.page_bytes + stats.pools.page_bytes;
+}
+
+// Fill region and pool pages with relocatable objects and free most of them, then give the defragmenter a budget in
+// each simulated frame until a pass reclaims nothing. The objects kept are checked after they have moved.
+static void ReportDefragmentation(void)
+{
+	Heap* heap = Heap::GetInstance();
+	HeapHandle* handles = new HeapHandle[BENCHMARK_DEFRAG_OBJECTS];
+	for (int i = 0; i < BENCHMARK_DEFRAG_OBJECTS; i++)
+	{
+		size_t size = (i & 1) ? 16 + (i * 13) % 500 : 64 + (i * 37) % 3000;
+		unsigned int* address = (unsigned int*)handles[i].Allocate(size, (i & 1) ? New::Hint::POOLABLE : New::Hint::DEFAULT);
+		*address = i;
+	}
+	for (int i = 0; i < BENCHMARK_DEFRAG_OBJECTS; i++)
+	{
+		if ((i / 2) % BENCHMARK_DEFRAG_KEEP) handles[i].Free();
+	}
+	heap->Scavenge();
+
+	HeapStats before, stats;
+	heap->GetStats(before);
+	size_t page_bytes = GetCompactablePageBytes();
+	printf("Defragmentation (%d of %d relocatable objects kept, %d us per frame)\n", BENCHMARK_DEFRAG_OBJECTS / BENCHMARK_DEFRAG_KEEP,
+		BENCHMARK_DEFRAG_OBJECTS, BENCHMARK_DEFRAG_BUDGET);
+
+	double longest = 0;
+	int frames = 0, pass_frames = 0;
+	while (frames < BENCHMARK_DEFRAG_FRAMES)
+	{
+		auto start_time = std::chrono::high_resolution_clock::now();
+		bool complete = heap->DefragmentStep(BENCHMARK_DEFRAG_BUDGET);
+		std::chrono::duration<double, std::micro> step(std::chrono::high_resolution_clock::now() - start_time);
+		if (step.count() > longest) longest = step.count();
+		frames++;
+		pass_frames++;
+		if (!complete) continue;
+
+		heap->GetStats(stats);
+		printf("  pass %zu: %d frames, reclaimed %zu KB\n", stats.defrag_pass_count - before.defrag_pass_count, pass_frames,
+			stats.defrag_pass_reclaimed_bytes / 1024);
+		pass_frames = 0;
+		if (stats.defrag_pass_reclaimed_bytes == 0) break;
+	}
+	heap->Scavenge();
+
+	heap->GetStats(stats);
+	int moved_intact = 1;
+	for (int i = 0; i < BENCHMARK_DEFRAG_OBJECTS; i++)
+	{
+		if (handles[i].Get() && *(unsigned int*)handles[i].Get() != (unsigned int)i) moved_intact = 0;
+	}
+	printf("  moved %zu KB, reclaimed %zu KB, region+pool pages %zu KB -> %zu KB, longest step %.0f us, contents %s\n",
+		(stats.defrag_moved_bytes - before.defrag_moved_bytes) / 1024, (stats.defrag_reclaimed_bytes - before.defrag_reclaimed_bytes) / 1024,
+		page_bytes / 1024, GetCompactablePageBytes() / 1024, longest, moved_intact ? "intact" : "CORRUPT");
+	delete[] handles;
+}
+
+//#################################################################################################################################
+// Container Workloads
+//#################################################################################################################################
+
+// Build a vector of integers and a vector of strings too long for the small string buffer in each frame, then release
+// them; returns milliseconds. The frame resource, if given, is reset at the start of each frame.
+template <class IntVector, class StringVector, class String>
+static double RunFrameContainers(IntVector& ints, StringVector& strings, FrameResource* frame)
+{
+	Heap* heap = Heap::GetInstance();
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int round = 0; round < BENCHMARK_CONTAINER_FRAMES; round++)
+	{
+		heap->BeginFrame();
+		if (frame) frame->Reset();
+		for (int i = 0; i < BENCHMARK_CONTAINER_ITEMS; i++)
+		{
+			ints.push_back(i);
+			strings.emplace_back(String("entity/component/name/", strings.get_allocator()) += (char)('a' + i % 26));
+		}
+		ints.clear();
+		ints.shrink_to_fit();
+		strings.clear();
+		strings.shrink_to_fit();
+	}
+	std::chrono::duration<double, std::milli> elapsed(std::chrono::high_resolution_clock::now() - start_time);
+	return elapsed.count();
+}
+
+// Fill a string-keyed lookup table and look every key up repeatedly; returns milliseconds
+template <class Table, class String>
+static double RunLookupTable(Table& table)
+{
+	char key[32];
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < BENCHMARK_TABLE_KEYS; i++)
+	{
+		snprintf(key, sizeof(key), "resource/%08d", i);
+		table.emplace(String(key, table.get_allocator()), i);
+	}
+	// The lookup key is assigned in place so that lookups allocate nothing once it has grown
+	String lookup(table.get_allocator());
+	size_t found = 0;
+	for (int i = 0; i < BENCHMARK_TABLE_LOOKUPS; i++)
+	{
+		snprintf(key, sizeof(key), "resource/%08d", (int)(((size_t)i * 7919) % BENCHMARK_TABLE_KEYS));
+		lookup.assign(key);
+		found += table.count(lookup);
+	}
+	std::chrono::duration<double, std::milli> elapsed(std::chrono::high_resolution_clock::now() - start_time);
+	if (found != BENCHMARK_TABLE_LOOKUPS) printf("  lookup table lost keys\n");
+	return elapsed.count();
+}
+
+// Insert and erase random keys of an ordered map, so that its nodes are allocated and freed one at a time; returns
+// milliseconds
+template <class Map>
+static double RunNodeChurn(Map& map)
+{
+	std::mt19937 random(BENCHMARK_WORKLOAD_SEED);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int round = 0; round < BENCHMARK_CONTAINER_FRAMES; round++)
+	{
+		for (int i = 0; i < BENCHMARK_CONTAINER_ITEMS; i++)
+		{
+			int key = (int)(random() % (BENCHMARK_CONTAINER_ITEMS * 2));
+			if (!map.erase(key)) map.emplace(key, i);
+		}
+	}
+	map.clear();
+	std::chrono::duration<double, std::milli> elapsed(std::chrono::high_resolution_clock::now() - start_time);
+	return elapsed.count();
+}
+
+// Compare containers using the default allocator with containers drawing on the heap tiers through allocator templates
+// and memory resources
+static void BenchmarkContainers(void)
+{
+	printf("Container workloads (ms)\n");
+	{
+		std::vector<int> ints;
+		std::vector<std::string> strings;
+		double standard = RunFrameContainers<std::vector<int>, std::vector<std::string>, std::string>(ints, strings, nullptr);
+
+		std::vector<int, TransientHeapAllocator<int>> transient_ints;
+		std::vector<HeapString<New::Hint::TRANSIENT>, TransientHeapAllocator<HeapString<New::Hint::TRANSIENT>>> transient_strings;
+		double transient = RunFrameContainers<decltype(transient_ints), decltype(transient_strings), HeapString<New::Hint::TRANSIENT>>(transient_ints, transient_strings, nullptr);
+
+		FrameResource frame;
+		std::pmr::vector<int> frame_ints(&frame);
+		std::pmr::vector<std::pmr::string> frame_strings(&frame);
+		double monotonic = RunFrameContainers<std::pmr::vector<int>, std::pmr::vector<std::pmr::string>, std::pmr::string>(frame_ints, frame_strings, &frame);
+		printf("  frame containers   default %8.1f   transient allocator %8.1f   frame resource %8.1f\n", standard, transient, monotonic);
+	}
+	{
+		std::unordered_map<std::string, int> table;
+		double standard = RunLookupTable<decltype(table), std::string>(table);
+
+		typedef HeapString<New::Hint::PERMANENT> PermanentString;
+		std::unordered_map<PermanentString, int, HeapStringHash, std::equal_to<PermanentString>, PermanentHeapAllocator<std::pair<const PermanentString, int>>> permanent_table;
+		double permanent = RunLookupTable<decltype(permanent_table), PermanentString>(permanent_table);
+
+		std::pmr::unordered_map<std::pmr::string, int> pmr_table(GetHeapResource(New::Hint::PERMANENT));
+		double resource = RunLookupTable<decltype(pmr_table), std::pmr::string>(pmr_table);
+		printf("  lookup table       default %8.1f   permanent allocator %8.1f   permanent resource %8.1f\n", standard, permanent, resource);
+	}
+	{
+		std::map<int, int> map;
+		double standard = RunNodeChurn(map);
+
+		std::map<int, int, std::less<int>, PoolHeapAllocator<std::pair<const int, int>>> pool_map;
+		double pool = RunNodeChurn(pool_map);
+
+		std::pmr::map<int, int> pmr_map(GetHeapResource(New::Hint::POOLABLE));
+		double resource = RunNodeChurn(pmr_map);
+		printf("  node churn         default %8.1f   poolable allocator  %8.1f   poolable resource  %8.1f\n", standard, pool, resource);
+	}
+}
+
+//#################################################################################################################################
+// Pool Fragmentation Report
+//#################################################################################################################################
+
+// Return the resident memory of the process in bytes
+static size_t GetResidentBytes(void)
+{
+#if defined(_WINDOWS)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return counters.WorkingSetSize;
+	return 0;
+#else
+	// The second field of statm is the resident page count
+	size_t pages = 0, resident = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (!file) return 0;
+	if (fscanf(file, "%zu %zu", &pages, &resident) != 2) resident = 0;
+	fclose(file);
+	return resident * 4096;
+#endif
+}
+
+// Draw an allocation size from a distribution weighted toward small objects, as seen in entity and mesh code
+static size_t DrawWorkloadSize(std::mt19937& random)
+{
+	unsigned int r = random() % 100;
+	if (r < 60) return 8 + random() % 120;			// small nodes and handles
+	if (r < 90) return 128 + random() % 896;		// components and short strings
+	if (r < 99) return 1024 + random() % 7168;		// vertex and index scratch buffers
+	return 8192 + random() % 24000;					// occasional large blocks
+}
+
+// Replay a deterministic mixed-size POOLABLE workload and compare the peak page footprint of size-class pools with
+// exact-size pools. The exact-size footprint is modelled as perfectly packed pages for each distinct byte size, which
+// is a lower bound on what one pool per byte size would have used.
+static void ReportPoolFragmentation(void)
+{
+	struct Live { void* address; size_t size; };
+	std::vector<Live> live;
+	std::vector<size_t> exact_live(LARGE_ALLOCATION_SIZE, 0);
+	std::vector<size_t> exact_pages(LARGE_ALLOCATION_SIZE, 0);
+	std::mt19937 random(BENCHMARK_WORKLOAD_SEED);
+	Heap* heap = Heap::GetInstance();
+
+	size_t resident_before = GetResidentBytes();
+	size_t requested_bytes = 0, peak_requested = 0;
+	size_t exact_page_count = 0, exact_pool_count = 0, peak_exact_pages = 0;
+	size_t peak_class_bytes = 0, peak_class_live = 0, peak_class_pools = 0;
+	size_t peak_resident = resident_before;
+	live.reserve(BENCHMARK_WORKLOAD_LIVE);
+
+	for (int i = 0; i < BENCHMARK_WORKLOAD_OPS; i++)
+	{
+		bool allocate = live.empty() || (live.size() < BENCHMARK_WORKLOAD_LIVE && (random() % 100) < 52);
+		size_t size;
+		if (allocate)
+		{
+			size = DrawWorkloadSize(random);
+			live.push_back({ heap->Allocate(size, New::Hint::POOLABLE), size });
+			requested_bytes += size;
+			if (exact_live[size]++ == 0 && exact_pages[size] == 0) exact_pool_count++;
+		}
+		else
+		{
+			size_t index = random() % live.size();
+			size = live[index].size;
+			heap->Free(live[index].address);
+			live[index] = live.back();
+			live.pop_back();
+			requested_bytes -= size;
+			exact_live[size]--;
+		}
+
+		// Model the pages an exact-size pool would need for this byte size
+		size_t element_size = ((size + 7) & -8) + sizeof(void*);
+		size_t per_page = (BENCHMARK_POOL_PAGE_SIZE - 64) / element_size;
+		size_t pages = (exact_live[size] + per_page - 1) / per_page;
+		exact_page_count += pages - exact_pages[size];
+		exact_pages[size] = pages;
+
+		if (requested_bytes > peak_requested) peak_requested = requested_bytes;
+		if (exact_page_count > peak_exact_pages) peak_exact_pages = exact_page_count;
+		if ((i & 1023) == 0)
+		{
+			HeapStats stats;
+			heap->GetStats(stats);
+			if (stats.pools.page_bytes > peak_class_bytes) {
+				peak_class_bytes = stats.pools.page_bytes;
+				peak_class_live = stats.pools.live_bytes;
+				peak_class_pools = stats.pool_count;
+			}
+			size_t resident = GetResidentBytes();
+			if (resident > peak_resident) peak_resident = resident;
+		}
+	}
+	for (auto& e : live)
+	{
+		heap->Free(e.address);
+	}
+	heap->FlushThreadCache();
+
+	printf("Pool fragmentation (%d operations, peak requested %zu KB)\n", BENCHMARK_WORKLOAD_OPS, peak_requested / 1024);
+	printf("  scheme             pools   peak pages KB   utilization\n");
+	printf("  exact-size model  %6zu   %13zu   %10.1f%%\n", exact_pool_count, peak_exact_pages * BENCHMARK_POOL_PAGE_SIZE / 1024,
+		100.0 * peak_requested / ((double)peak_exact_pages * BENCHMARK_POOL_PAGE_SIZE));
+	printf("  size classes      %6zu   %13zu   %10.1f%%\n", peak_class_pools, peak_class_bytes / 1024,
+		peak_class_bytes ? 100.0 * peak_class_live / (double)peak_class_bytes : 0.0);
+	printf("  resident growth during workload: %zu KB\n", (peak_resident - resident_before) / 1024);
+}
+
+//#################################################################################################################################
+// Pool Density Report
+//#################################################################################################################################
+
+// Hold many small POOLABLE objects live and report the pool page bytes each one costs, with the throughput of
+// allocating and then freeing them all
+static void ReportPoolDensity(void)
+{
+	const size_t sizes[] = { 8, 16, 24, 32, 48, 64 };
+	std::vector<void*> objects(BENCHMARK_DENSITY_OBJECTS);
+	Heap* heap = Heap::GetInstance();
+	printf("Pool density (%d live objects)\n", BENCHMARK_DENSITY_OBJECTS);
+	printf("  size   bytes/object   Mops/s\n");
+	for (size_t size : sizes)
+	{
+		HeapStats before, after;
+		heap->GetStats(before);
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for (void*& object : objects)
+		{
+			object = heap->Allocate(size, New::Hint::POOLABLE);
+		}
+		std::chrono::duration<double> allocate_time(std::chrono::high_resolution_clock::now() - start_time);
+		heap->GetStats(after);
+		start_time = std::chrono::high_resolution_clock::now();
+		for (void* object : objects)
+		{
+			heap->Free(object);
+		}
+		std::chrono::duration<double> free_time(std::chrono::high_resolution_clock::now() - start_time);
+
+		double page_bytes = (double)(after.pools.page_bytes - before.pools.page_bytes);
+		double mops = 2.0 * BENCHMARK_DENSITY_OBJECTS / (allocate_time.count() + free_time.count()) / 1000000.0;
+		printf("  %4zu %14.2f %8.2f\n", size, page_bytes / BENCHMARK_DENSITY_OBJECTS, mops);
+	}
+
+	// Churn one element through a magazine. The elements the magazine holds afterwards are free, not live; the pool's
+	// counts lag the magazine by a few allocations and frees, so the live count may differ by one or two.
+	HeapStats before, after;
+	heap->FlushThreadCache();
+	heap->GetStats(before);
+	for (int i = 0; i < 1000; i++)
+	{
+		heap->Free(heap->Allocate(24, New::Hint::POOLABLE));
+	}
+	heap->GetStats(after);
+	printf("  live elements after churn through a magazine %zu\n", after.pools.live_allocations - before.pools.live_allocations);
+
+	// Free an element twice with the thread cache on, where the first free leaves the element in a magazine
+	void* object = heap->Allocate(24, New::Hint::POOLABLE);
+	heap->Free(object);
+	bool detected = false;
+	try {
+		heap->Free(object);
+	}
+	catch (const char*) {
+		detected = true;
+	}
+	printf("  double free of a cached element %s\n", detected ? "detected" : "NOT DETECTED");
+
+	// Free a pointer into the middle of an element, which must be rejected before it can reach a magazine
+	object = heap->Allocate(24, New::Hint::POOLABLE);
+	detected = false;
+	try {
+		heap->Free((char*)object + 8);
+	}
+	catch (const char*) {
+		detected = true;
+	}
+	heap->Free(object);
+	printf("  free of an interior pointer %s\n", detected ? "detected" : "NOT DETECTED");
+}
+
+//#################################################################################################################################
+// Pool Page Scaling
+//#################################################################################################################################
+
+// Fill a pool to a number of live pages, then time a growing workload that frees one random object and allocates two.
+// The thread cache is disabled so that every operation reaches the pool. Returns microseconds per allocation.
+static double MeasurePoolPages(size_t target_pages, size_t& live_pages)
+{
+	Heap* heap = Heap::GetInstance();
+	std::mt19937 random(BENCHMARK_WORKLOAD_SEED);
+	std::vector<void*> objects;
+	HeapStats before, after;
+	heap->GetStats(before);
+	while (true)
+	{
+		objects.push_back(heap->Allocate(BENCHMARK_PAGE_OBJECT_SIZE, New::Hint::POOLABLE));
+		if (objects.size() % 1024 == 0)
+		{
+			heap->GetStats(after);
+			if (after.pools.pages - before.pools.pages >= target_pages) break;
+		}
+	}
+
+	double seconds = 0.0;
+	for (int round = 0; round < BENCHMARK_PAGE_ROUNDS; round++)
+	{
+		size_t index = random() % objects.size();
+		heap->Free(objects[index]);
+		auto start_time = std::chrono::high_resolution_clock::now();
+		objects[index] = heap->Allocate(BENCHMARK_PAGE_OBJECT_SIZE, New::Hint::POOLABLE);
+		objects.push_back(heap->Allocate(BENCHMARK_PAGE_OBJECT_SIZE, New::Hint::POOLABLE));
+		std::chrono::duration<double, std::micro> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+		seconds += elapsed_time.count();
+	}
+
+	heap->GetStats(after);
+	live_pages = after.pools.pages - before.pools.pages;
+	for (void* object : objects)
+	{
+		heap->Free(object);
+	}
+	return seconds / (2.0 * BENCHMARK_PAGE_ROUNDS);
+}
+
+static void BenchmarkPoolPages(void)
+{
+	Heap* heap = Heap::GetInstance();
+	const size_t page_counts[] = BENCHMARK_PAGE_COUNTS;
+	printf("Pool page scaling (microseconds per allocation while growing)\n");
+	printf("  live pages   us/alloc\n");
+	heap->EnableThreadCache(false);
+	for (size_t target_pages : page_counts)
+	{
+		size_t live_pages;
+		double latency = MeasurePoolPages(target_pages, live_pages);
+		printf("  %10zu %10.3f\n", live_pages, latency);
+	}
+	heap->EnableThreadCache(true);
+}
+
+//#################################################################################################################################
+// Region Fragmentation Latency
+//#################################################################################################################################
+
+// Return the value at the given fraction of a sorted list of latencies
+static double Percentile(std::vector<double>& sorted, double fraction)
+{
+	if (sorted.empty()) return 0.0;
+	size_t index = (size_t)(fraction * (sorted.size() - 1));
+	return sorted[index];
+}
+
+// Fragment the DEFAULT region allocator so that each free list holds many blocks that are just too small for the
+// following requests, then time individual allocate and free calls
+static void BenchmarkRegionFragmentation(void)
+{
+	std::vector<void*> blocks(BENCHMARK_REGION_BLOCKS);
+	std::vector<void*> live;
+	std::vector<double> latencies;
+	std::mt19937 random(BENCHMARK_WORKLOAD_SEED);
+	Heap* heap = Heap::GetInstance();
+
+	// Interleave small and larger blocks, then free the larger ones to leave thousands of isolated holes
+	for (int i = 0; i < BENCHMARK_REGION_BLOCKS; i++)
+	{
+		size_t size = (i & 1) ? 520 + (random() % 16) * 8 : 16;
+		blocks[i] = heap->Allocate(size, New::Hint::DEFAULT);
+	}
+	for (int i = 1; i < BENCHMARK_REGION_BLOCKS; i += 2)
+	{
+		heap->Free(blocks[i]);
+		blocks[i] = nullptr;
+	}
+
+	// Request sizes just above the holes so that a linear bin search must pass over all of them
+	latencies.reserve(BENCHMARK_REGION_OPS);
+	live.reserve(BENCHMARK_REGION_OPS);
+	for (int i = 0; i < BENCHMARK_REGION_OPS; i++)
+	{
+		bool allocate = live.empty() || (random() % 100) < 55;
+		auto start_time = std::chrono::high_resolution_clock::now();
+		if (allocate)
+		{
+			live.push_back(heap->Allocate(656 + (random() % 32) * 8, New::Hint::DEFAULT));
+		}
+		else
+		{
+			size_t index = random() % live.size();
+			heap->Free(live[index]);
+			live[index] = live.back();
+			live.pop_back();
+		}
+		std::chrono::duration<double, std::micro> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+		latencies.push_back(elapsed_time.count());
+	}
+	for (void* address : live)
+	{
+		heap->Free(address);
+	}
+	for (void* address : blocks)
+	{
+		if (address) heap->Free(address);
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	printf("Region fragmentation latency (%d holes, microseconds)\n", BENCHMARK_REGION_BLOCKS / 2);
+	printf("  p50 %.3f   p99 %.3f   p99.9 %.3f   max %.3f\n", Percentile(latencies, 0.5), Percentile(latencies, 0.99),
+		Percentile(latencies, 0.999), latencies.back());
+}
+
+//#################################################################################################################################
+// Region Growth Benchmark
+//#################################################################################################################################
+
+// Grow a set of DEFAULT buffers from 16 bytes to the growth limit, either by resizing them or by the allocate, copy and
+// free sequence that resizing used to perform, and return the elapsed time in milliseconds
+static double MeasureRegionGrowth(int buffers, bool doubling, bool resize)
+{
+	Heap* heap = Heap::GetInstance();
+	std::vector<void*> addresses(buffers);
+	std::vector<size_t> sizes(buffers);
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int round = 0; round < BENCHMARK_GROWTH_ROUNDS; round++)
+	{
+		for (int i = 0; i < buffers; i++)
+		{
+			sizes[i] = 16;
+			addresses[i] = heap->Allocate(sizes[i], New::Hint::DEFAULT);
+		}
+
+		// Buffers are grown in turn so that with more than one buffer each is hemmed in by its neighbours
+		bool growing = true;
+		while (growing)
+		{
+			growing = false;
+			for (int i = 0; i < buffers; i++)
+			{
+				size_t new_size = doubling ? sizes[i] * 2 : sizes[i] + 256;
+				if (new_size > BENCHMARK_GROWTH_LIMIT) continue;
+				if (resize) {
+					addresses[i] = heap->Resize(addresses[i], new_size);
+				}
+				else {
+					void* address = heap->Allocate(new_size, New::Hint::DEFAULT);
+					memcpy(address, addresses[i], sizes[i]);
+					heap->Free(addresses[i]);
+					addresses[i] = address;
+				}
+				sizes[i] = new_size;
+				growing = true;
+			}
+		}
+
+		for (int i = 0; i < buffers; i++)
+		{
+			heap->Free(addresses[i]);
+		}
+	}
+	std::chrono::duration<double, std::milli> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+	return elapsed_time.count();
+}
+
+static void BenchmarkRegionGrowth(void)
+{
+	static const struct { const char* name; int buffers; bool doubling; } patterns[] = {
+		{ "linear       ", 1, false },
+		{ "doubling     ", 1, true },
+		{ "interleaved 4", 4, false },
+	};
+
+	Heap* heap = Heap::GetInstance();
+	printf("Region growth (%d rounds to %d bytes, milliseconds)\n", BENCHMARK_GROWTH_ROUNDS, BENCHMARK_GROWTH_LIMIT);
+	printf("  pattern          copy   resize   in place   copied\n");
+	for (auto& pattern : patterns)
+	{
+		HeapStats before, after;
+		double copy_time = MeasureRegionGrowth(pattern.buffers, pattern.doubling, false);
+		heap->GetStats(before);
+		double resize_time = MeasureRegionGrowth(pattern.buffers, pattern.doubling, true);
+		heap->GetStats(after);
+		printf("  %s %8.1f %8.1f %10zu %8zu\n", pattern.name, copy_time, resize_time,
+			after.resize_in_place_count - before.resize_in_place_count, after.resize_copy_count - before.resize_copy_count);
+	}
+}
+
+//#################################################################################################################################
+// Frame Scratch Benchmark
+//#################################################################################################################################
+
+// Make a frame's worth of small scratch allocations, freeing them at the end of the frame, and return the number of
+// millions of allocations per second
+static double MeasureFrameScratch(New::Hint hint)
+{
+	std::vector<void*> scratch(BENCHMARK_FRAME_ALLOCATIONS);
+	std::mt19937 random(BENCHMARK_WORKLOAD_SEED);
+	Heap* heap = Heap::GetInstance();
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int frame = 0; frame < BENCHMARK_FRAMES; frame++)
+	{
+		heap->BeginFrame();
+		for (int i = 0; i < BENCHMARK_FRAME_ALLOCATIONS; i++)
+		{
+			scratch[i] = heap->Allocate(16 + (random() & 511), hint);
+		}
+		for (int i = 0; i < BENCHMARK_FRAME_ALLOCATIONS; i++)
+		{
+			heap->Free(scratch[i]);
+		}
+	}
+	std::chrono::duration<double> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+	return (double)BENCHMARK_FRAMES * BENCHMARK_FRAME_ALLOCATIONS / elapsed_time.count() / 1000000.0;
+}
+
+static void BenchmarkFrameScratch(void)
+{
+	printf("Frame scratch allocation (million allocations per second)\n");
+	printf("  region %.2f   transient %.2f\n", MeasureFrameScratch(New::Hint::DEFAULT), MeasureFrameScratch(New::Hint::TRANSIENT));
+}
+
+//#################################################################################################################################
+// Page Thrash Report
+//#################################################################################################################################
+
+// Repeatedly allocate and free a block that needs a second page, and return the number of pages mapped
+static size_t MeasurePageThrash(New::Hint hint, size_t size)
+{
+	Heap* heap = Heap::GetInstance();
+	HeapStats before, after;
+	std::vector<void*> fill;
+
+	// Fill the first page so that every cycle below has to start a new page
+	heap->GetStats(before);
+	for (;;)
+	{
+		fill.push_back(heap->Allocate(size, hint));
+		HeapStats stats;
+		heap->GetStats(stats);
+		if (stats.page_map_count + stats.page_reuse_count - before.page_map_count - before.page_reuse_count > 1) break;
+	}
+	heap->Free(fill.back());
+	fill.pop_back();
+	heap->FlushThreadCache();
+
+	heap->GetStats(before);
+	for (int i = 0; i < BENCHMARK_THRASH_CYCLES; i++)
+	{
+		heap->Free(heap->Allocate(size, hint));
+		heap->FlushThreadCache();
+	}
+	heap->GetStats(after);
+
+	for (void* address : fill)
+	{
+		heap->Free(address);
+	}
+	heap->FlushThreadCache();
+	return after.page_map_count - before.page_map_count;
+}
+
+static void ReportPageThrash(void)
+{
+	Heap* heap = Heap::GetInstance();
+	printf("Page thrash (pages mapped over %d allocate/free cycles at a page boundary)\n", BENCHMARK_THRASH_CYCLES);
+	heap->SetPageRetention(0, PAGE_IDLE_FRAMES, PAGE_IDLE_MILLISECONDS);
+	size_t region_unretained = MeasurePageThrash(New::Hint::DEFAULT, 4000);
+	size_t pool_unretained = MeasurePageThrash(New::Hint::POOLABLE, 4000);
+	heap->SetPageRetention(PAGE_RETAIN_MAX, PAGE_IDLE_FRAMES, PAGE_IDLE_MILLISECONDS);
+	size_t region_retained = MeasurePageThrash(New::Hint::DEFAULT, 4000);
+	size_t pool_retained = MeasurePageThrash(New::Hint::POOLABLE, 4000);
+	printf("  region   no retention %6zu   retention %6zu\n", region_unretained, region_retained);
+	printf("  pool     no retention %6zu   retention %6zu\n", pool_unretained, pool_retained);
+}
+
+//#################################################################################################################################
+// Page Decommit Report
+//#################################################################################################################################
+
+// Free a burst of region pages into a large retained cache and measure the resident memory returned by decommitting them
+static void ReportPageDecommit(void)
+{
+	Heap* heap = Heap::GetInstance();
+	std::vector<void*> blocks;
+	heap->SetPageRetention(BENCHMARK_DECOMMIT_PAGES, PAGE_IDLE_FRAMES, PAGE_IDLE_MILLISECONDS);
+
+	size_t resident_before = GetResidentBytes();
+	for (int i = 0; i < BENCHMARK_DECOMMIT_PAGES * 64; i++)
+	{
+		void* block = heap->Allocate(16000, New::Hint::DEFAULT);
+		memset(block, 1, 16000);
+		blocks.push_back(block);
+	}
+	size_t resident_allocated = GetResidentBytes();
+	for (void* address : blocks)
+	{
+		heap->Free(address);
+	}
+	size_t resident_retained = GetResidentBytes();
+
+	// An idle limit of zero decommits every retained page at the next scavenge
+	HeapStats before, after;
+	heap->GetStats(before);
+	heap->SetPageRetention(BENCHMARK_DECOMMIT_PAGES, 0, 0);
+	heap->Scavenge();
+	heap->GetStats(after);
+	size_t resident_decommitted = GetResidentBytes();
+	heap->SetPageRetention(PAGE_RETAIN_MAX, PAGE_IDLE_FRAMES, PAGE_IDLE_MILLISECONDS);
+	heap->Scavenge();
+
+	printf("Page decommit (resident MB; %zu pages decommitted)\n", after.page_decommit_count - before.page_decommit_count);
+	printf("  before %7.1f   allocated %7.1f   retained %7.1f   decommitted %7.1f\n",
+		resident_before / 1048576.0, resident_allocated / 1048576.0, resident_retained / 1048576.0, resident_decommitted / 1048576.0);
+}
+
+// Retain and scavenge the region pages of a separate heap mapped from explicit huge pages, then reuse them. Only whole
+// huge pages can be decommitted, so the retained pages must stay committed and be reused without recommitting them.
+static void ReportHugePageDecommit(void)
+{
+	static Heap heap;
+	heap.SetHugePages(HugePages::EXPLICIT);
+	heap.SetPageRetention(BENCHMARK_HUGE_PAGES, 0, 0);
+
+	const size_t block_size = 16000;
+	const int block_count = (int)(BENCHMARK_HUGE_PAGES * (HUGE_PAGE_SIZE / block_size)) - BENCHMARK_HUGE_PAGES * 4;
+	std::vector<void*> blocks(block_count);
+	HeapStats before, after;
+	heap.GetStats(before);
+	for (int round = 0; round < 2; round++)
+	{
+		for (void*& block : blocks)
+		{
+			block = heap.Allocate(block_size, New::Hint::DEFAULT);
+			memset(block, round + 1, block_size);
+		}
+		for (void* block : blocks)
+		{
+			if (((unsigned char*)block)[block_size - 1] != round + 1) throw("huge page contents were lost");
+			heap.Free(block);
+		}
+		heap.Scavenge();
+	}
+	heap.GetStats(after);
+	heap.VerifyIntegrity();
+
+	printf("Huge page retention (%zu pages mapped, %zu reused, %zu decommitted, %.1f MB retained)\n",
+		after.page_map_count - before.page_map_count, after.page_reuse_count - before.page_reuse_count,
+		after.page_decommit_count - before.page_decommit_count, after.retained_page_bytes / 1048576.0);
+}
+
+//#################################################################################################################################
+// Large Allocation Cache Report
+//#################################################################################################################################
+
+// Allocate, write and free a set of per-frame buffers of a few hundred KB, each size varying slightly from frame to frame,
+// with the cache of freed large allocations off and on
+static void BenchmarkLargeCache(void)
+{
+	Heap* heap = Heap::GetInstance();
+	const size_t sizes[] = BENCHMARK_LARGE_SIZES;
+	const int count = sizeof(sizes) / sizeof(sizes[0]);
+	printf("Large allocation cache (%d frames of %d buffers)\n", BENCHMARK_LARGE_ROUNDS, count);
+	printf("  cache        us/frame   reused   cached KB\n");
+	for (size_t cache_bytes : { (size_t)0, LARGE_CACHE_BYTES })
+	{
+		heap->SetLargeCache(cache_bytes);
+		HeapStats before, after;
+		heap->GetStats(before);
+		void* buffers[sizeof(sizes) / sizeof(sizes[0])];
+		auto start_time = std::chrono::high_resolution_clock::now();
+		for (int round = 0; round < BENCHMARK_LARGE_ROUNDS; round++)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				// Touch every page as a buffer filled during the frame would
+				size_t size = sizes[i] + (round * 4096) % (sizes[i] / 8);
+				buffers[i] = heap->Allocate(size, New::Hint::DEFAULT);
+				for (size_t offset = 0; offset < size; offset += 4096) ((char*)buffers[i])[offset] = (char)round;
+			}
+			for (int i = 0; i < count; i++)
+			{
+				heap->Free(buffers[i]);
+			}
+		}
+		std::chrono::duration<double, std::micro> elapsed(std::chrono::high_resolution_clock::now() - start_time);
+		heap->GetStats(after);
+		printf("  %-10s %10.1f %8zu %11zu\n", cache_bytes ? "on" : "off", elapsed.count() / BENCHMARK_LARGE_ROUNDS,
+			after.large_reuse_count - before.large_reuse_count, after.large_cache_bytes / 1024);
+	}
+	heap->SetLargeCache(LARGE_CACHE_BYTES);
+}
+
+//#################################################################################################################################
+// Profiler Overhead
+//#################################################################################################################################
+
+// Compare small allocation throughput with the sampling profiler off, at its default rate and at a high rate
+static void BenchmarkProfilerOverhead(void)
+{
+	Heap* heap = Heap::GetInstance();
+	size_t sample_bytes = heap->GetProfilerSampleBytes();
+	const size_t rates[] = { 0, PROFILE_SAMPLE_BYTES, 4096 };
+	printf("Profiler overhead (million allocations per second)\n");
+	printf("  sample bytes      region      pool\n");
+	for (size_t rate : rates)
+	{
+		heap->EnableProfiler(rate);
+		double region = MeasureFrameScratch(New::Hint::DEFAULT);
+		double pool = MeasureFrameScratch(New::Hint::POOLABLE);
+		if (rate) printf("  %12zu %11.2f %9.2f\n", rate, region, pool);
+		else printf("  %12s %11.2f %9.2f\n", "off", region, pool);
+	}
+	heap->EnableProfiler(sample_bytes);
+}
+
+//#################################################################################################################################
+// Guarded Sampling Report
+//#################################################################################################################################
+
+// Compare small allocation throughput at several guard sample rates, then check that an overrun of a guarded
+// allocation is detected
+static void ReportGuardedSampling(void)
+{
+	Heap* heap = Heap::GetInstance();
+	unsigned int sample_rate = heap->GetGuardSampling();
+	const unsigned int rates[] = { 0, GUARD_SAMPLE_RATE, 100 };
+	printf("Guarded sampling (million allocations per second)\n");
+	printf("  sample rate      region      pool\n");
+	for (unsigned int rate : rates)
+	{
+		heap->SetGuardSampling(rate);
+		double region = MeasureFrameScratch(New::Hint::DEFAULT);
+		double pool = MeasureFrameScratch(New::Hint::POOLABLE);
+		if (rate) printf("  %11u %11.2f %9.2f\n", rate, region, pool);
+		else printf("  %11s %11.2f %9.2f\n", "off", region, pool);
+	}
+
+	// With a rate of 1 every allocation is guarded once the countdown drawn at the previous rate runs out. Write one
+	// byte past an allocation that does not fill its slot.
+	heap->SetGuardSampling(1);
+	HeapStats stats;
+	unsigned char* address;
+	for (;;)
+	{
+		address = (unsigned char*)heap->Allocate(13, New::Hint::DEFAULT);
+		heap->GetStats(stats);
+		if (stats.guarded.live_allocations) break;
+		heap->Free(address);
+	}
+	heap->SetGuardSampling(0);
+	unsigned char fill = address[13];
+	address[13] = ~fill;
+	bool detected = false;
+	try {
+		heap->Free(address);
+	}
+	catch (const char*) {
+		detected = true;
+		address[13] = fill;
+		heap->Free(address);
+	}
+	printf("  overrun of a guarded allocation %s\n", detected ? "detected" : "NOT DETECTED");
+	heap->SetGuardSampling(sample_rate);
+}
+
+//#################################################################################################################################
+// Stress Suite
+//#################################################################################################################################
+
+// Operations of a stress trace. Each thread replays its own trace against its own table of slots, where a slot holds
+// one live allocation. FRAME marks a frame boundary at which all threads meet.
+enum class StressOpType : unsigned char { ALLOCATE, FREE, RESIZE, RELOCATE, FRAME };
+
+struct StressOp
+{
+	StressOpType type;
+	New::Hint hint;				// hint of an allocation
+	unsigned int slot;			// slot of the allocation; STRESS_NO_SLOT for permanent allocations, which are never freed
+	unsigned int size;			// size of an allocation or resize
+};
+
+#define STRESS_NO_SLOT (~0u)
+
+// Builds a valid trace by tracking which slots are live
+class StressTraceBuilder
+{
+public:
+	StressTraceBuilder(unsigned int seed);
+
+	std::mt19937 random;
+	std::vector<StressOp> trace;
+
+	unsigned int Allocate(size_t size, New::Hint hint);
+	void Free(unsigned int slot);
+	void Resize(unsigned int slot, size_t size);
+	void Relocate(unsigned int slot);
+	void Frame(void);
+	void FreeAll(void);
+	unsigned int GetRandomLive(bool resizable);
+	size_t GetLiveCount(void) const { return live.size(); }
+	unsigned int GetSize(unsigned int slot) const { return slot_size[slot]; }
+
+private:
+	std::vector<unsigned int> free_slots;
+	std::vector<unsigned int> live;				// live slots
+	std::vector<unsigned int> live_index;		// position of each live slot in the live list
+	std::vector<New::Hint> slot_hint;
+	std::vector<unsigned int> slot_size;
+};
+
+StressTraceBuilder::StressTraceBuilder(unsigned int seed) : random(seed)
+{
+	for (unsigned int i = BENCHMARK_STRESS_SLOTS; i > 0; i--) free_slots.push_back(i - 1);
+	live_index.resize(BENCHMARK_STRESS_SLOTS);
+	slot_hint.resize(BENCHMARK_STRESS_SLOTS);
+	slot_size.resize(BENCHMARK_STRESS_SLOTS);
+}
+
+unsigned int StressTraceBuilder::Allocate(size_t size, New::Hint hint)
+{
+	unsigned int slot = STRESS_NO_SLOT;
+	if (hint != New::Hint::PERMANENT)
+	{
+		if (free_slots.empty()) return STRESS_NO_SLOT;
+		slot = free_slots.back();
+		free_slots.pop_back();
+		live_index[slot] = (unsigned int)live.size();
+		live.push_back(slot);
+		slot_hint[slot] = hint;
+		slot_size[slot] = (unsigned int)size;
+	}
+	trace.push_back({ StressOpType::ALLOCATE, hint, slot, (unsigned int)size });
+	return slot;
+}
+
+void StressTraceBuilder::Free(unsigned int slot)
+{
+	trace.push_back({ StressOpType::FREE, slot_hint[slot], slot, 0 });
+	unsigned int last = live.back();
+	live[live_index[slot]] = last;
+	live_index[last] = live_index[slot];
+	live.pop_back();
+	free_slots.push_back(slot);
+}
+
+void StressTraceBuilder::Resize(unsigned int slot, size_t size)
+{
+	trace.push_back({ StressOpType::RESIZE, slot_hint[slot], slot, (unsigned int)size });
+	slot_size[slot] = (unsigned int)size;
+}
+
+void StressTraceBuilder::Relocate(unsigned int slot)
+{
+	trace.push_back({ StressOpType::RELOCATE, slot_hint[slot], slot, slot_size[slot] });
+}
+
+// Transient allocations expire at the end of the following frame, so they are freed before every frame boundary
+void StressTraceBuilder::Frame(void)
+{
+	for (size_t i = live.size(); i > 0; i--)
+	{
+		if (slot_hint[live[i - 1]] == New::Hint::TRANSIENT) Free(live[i - 1]);
+	}
+	trace.push_back({ StressOpType::FRAME, New::Hint::DEFAULT, STRESS_NO_SLOT, 0 });
+}
+
+void StressTraceBuilder::FreeAll(void)
+{
+	while (!live.empty()) Free(live.back());
+}
+
+// Return a random live slot, or STRESS_NO_SLOT; pool elements cannot be resized so they are skipped if resizable is set
+unsigned int StressTraceBuilder::GetRandomLive(bool resizable)
+{
+	for (int attempt = 0; attempt < 8 && !live.empty(); attempt++)
+	{
+		unsigned int slot = live[random() % live.size()];
+		if (!resizable || slot_hint[slot] != New::Hint::POOLABLE || slot_size[slot] >= LARGE_ALLOCATION_SIZE) return slot;
+	}
+	return STRESS_NO_SLOT;
+}
+
+// Uniformly random operations over all hints and sizes, including large allocations served by system memory
+static std::vector<StressOp> GenerateRandomMix(unsigned int seed)
+{
+	StressTraceBuilder builder(seed);
+	std::mt19937& random = builder.random;
+	for (int i = 0; i < BENCHMARK_STRESS_OPS; i++)
+	{
+		if (i % BENCHMARK_STRESS_FRAME_OPS == BENCHMARK_STRESS_FRAME_OPS - 1)
+		{
+			builder.Frame();
+			continue;
+		}
+
+		unsigned int r = random() % 100;
+		unsigned int slot;
+		if (builder.GetLiveCount() == 0 || r < 45)
+		{
+			unsigned int h = random() % 100;
+			New::Hint hint = h < 35 ? New::Hint::DEFAULT : h < 75 ? New::Hint::POOLABLE : h < 98 ? New::Hint::TRANSIENT : New::Hint::PERMANENT;
+			size_t size = (random() % 100) == 0 ? LARGE_ALLOCATION_SIZE + random() % (1 << 18) : DrawWorkloadSize(random);
+			builder.Allocate(size, hint);
+		}
+		else if (r < 60)
+		{
+			if ((slot = builder.GetRandomLive(true)) != STRESS_NO_SLOT) {
+				size_t size = builder.GetSize(slot);
+				builder.Resize(slot, (random() & 1) ? size + size / 2 + 8 : size / 2 + 8);
+			}
+		}
+		else if (r < 65)
+		{
+			if ((slot = builder.GetRandomLive(false)) != STRESS_NO_SLOT) builder.Relocate(slot);
+		}
+		else
+		{
+			if ((slot = builder.GetRandomLive(false)) != STRESS_NO_SLOT) builder.Free(slot);
+		}
+	}
+	builder.FreeAll();
+	return builder.trace;
+}
+
+// A game-like frame loop: a permanent level load, then per-frame scratch memory, entity churn, growing buffers and
+// periodic large streaming buffers
+static std::vector<StressOp> GenerateFrameTrace(unsigned int seed)
+{
+	StressTraceBuilder builder(seed);
+	std::mt19937& random = builder.random;
+	std::vector<unsigned int> entities;
+	std::vector<unsigned int> buffers;
+	unsigned int stream = STRESS_NO_SLOT;
+
+	for (int i = 0; i < 500; i++)
+	{
+		builder.Allocate(64 + random() % 4032, New::Hint::PERMANENT);
+	}
+
+	for (int frame = 0; frame < BENCHMARK_STRESS_FRAMES; frame++)
+	{
+		for (int i = 0; i < 200; i++)
+		{
+			builder.Allocate(16 + random() % 496, New::Hint::TRANSIENT);
+		}
+
+		for (int i = 0; i < 40 && entities.size() < 2000; i++)
+		{
+			unsigned int slot = builder.Allocate(16 + random() % 240, New::Hint::POOLABLE);
+			if (slot != STRESS_NO_SLOT) entities.push_back(slot);
+		}
+		for (int i = 0; i < 36 && !entities.empty(); i++)
+		{
+			size_t index = random() % entities.size();
+			builder.Free(entities[index]);
+			entities[index] = entities.back();
+			entities.pop_back();
+		}
+
+		if (buffers.size() < 32) buffers.push_back(builder.Allocate(64, New::Hint::DEFAULT));
+		for (int i = 0; i < 8; i++)
+		{
+			size_t index = random() % buffers.size();
+			size_t size = builder.GetSize(buffers[index]) * 3 / 2 + 16;
+			if (size > 65536) {
+				builder.Free(buffers[index]);
+				buffers[index] = buffers.back();
+				buffers.pop_back();
+				break;
+			}
+			builder.Resize(buffers[index], size);
+		}
+		builder.Relocate(buffers[random() % buffers.size()]);
+
+		if (frame % 10 == 0)
+		{
+			if (stream != STRESS_NO_SLOT) builder.Free(stream);
+			stream = builder.Allocate(65536 + random() % (1 << 20), New::Hint::DEFAULT);
+		}
+
+		builder.Frame();
+	}
+	builder.FreeAll();
+	return builder.trace;
+}
+
+// Barrier at which the threads of a stress run meet at every frame boundary
+class StressBarrier
+{
+public:
+	StressBarrier(int count) { this->count = count; }
+
+	void Wait(void)
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		unsigned int arrival = generation;
+		if (++waiting == count) {
+			waiting = 0;
+			generation++;
+			cv.notify_all();
+		}
+		else {
+			cv.wait(lock, [&] { return generation != arrival; });
+		}
+	}
+
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	int count;
+	int waiting = 0;
+	unsigned int generation = 0;
+};
+
+// State shared by the threads of a stress run
+struct StressRun
+{
+	StressRun(bool use_heap, int num_threads) : barrier(num_threads) { this->use_heap = use_heap; }
+
+	bool use_heap;					// replay against the heap, otherwise against the platform malloc
+	StressBarrier barrier;
+	int frames = 0;
+	size_t peak_resident = 0;
+};
+
+// Write the slot number to the first and last bytes of an allocation so that corruption is detected when it is used
+static void StampAllocation(unsigned char* address, unsigned int size, unsigned int slot)
+{
+	if (size < sizeof(slot)) return;
+	memcpy(address, &slot, sizeof(slot));
+	memcpy(address + size - sizeof(slot), &slot, sizeof(slot));
+}
+
+static void CheckAllocation(unsigned char* address, unsigned int size, unsigned int slot, bool check_end)
+{
+	if (size < sizeof(slot)) return;
+	if (memcmp(address, &slot, sizeof(slot))) throw("stress suite detected a corrupted allocation");
+	if (check_end && memcmp(address + size - sizeof(slot), &slot, sizeof(slot))) throw("stress suite detected a corrupted allocation");
+}
+
+// Replay one thread's trace, recording the latency of every operation in microseconds
+static void ReplayStressTrace(const std::vector<StressOp>* trace, StressRun* run, int thread_index, std::vector<double>* latencies)
+{
+	struct Slot { unsigned char* address; unsigned int size; };
+	std::vector<Slot> slots(BENCHMARK_STRESS_SLOTS, { nullptr, 0 });
+	Heap* heap = Heap::GetInstance();
+	latencies->reserve(trace->size());
+
+	for (const StressOp& op : *trace)
+	{
+		if (op.type == StressOpType::FRAME)
+		{
+			// The first thread advances the frame and checks the heap while the other threads are stopped
+			run->barrier.Wait();
+			if (thread_index == 0)
+			{
+				if (run->use_heap) {
+					heap->BeginFrame();
+					if (++run->frames % BENCHMARK_STRESS_VERIFY == 0) heap->VerifyIntegrity();
+				}
+				size_t resident = GetResidentBytes();
+				if (resident > run->peak_resident) run->peak_resident = resident;
+			}
+			run->barrier.Wait();
+			continue;
+		}
+
+		Slot* slot = op.slot == STRESS_NO_SLOT ? nullptr : &slots[op.slot];
+		if (slot && op.type != StressOpType::ALLOCATE) CheckAllocation(slot->address, slot->size, op.slot, true);
+
+		unsigned char* address = nullptr;
+		auto start_time = std::chrono::high_resolution_clock::now();
+		switch (op.type)
+		{
+		case StressOpType::ALLOCATE:
+			address = (unsigned char*)(run->use_heap ? heap->Allocate(op.size, op.hint) : malloc(op.size));
+			break;
+		case StressOpType::FREE:
+			if (run->use_heap) heap->Free(slot->address);
+			else free(slot->address);
+			break;
+		case StressOpType::RESIZE:
+			address = (unsigned char*)(run->use_heap ? heap->Resize(slot->address, op.size) : realloc(slot->address, op.size));
+			break;
+		case StressOpType::RELOCATE:
+			if (run->use_heap) {
+				address = (unsigned char*)heap->Relocate(slot->address);
+			}
+			else {
+				address = (unsigned char*)malloc(slot->size);
+				memcpy(address, slot->address, slot->size);
+				free(slot->address);
+			}
+			break;
+		default:
+			break;
+		}
+		std::chrono::duration<double, std::micro> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+		latencies->push_back(elapsed_time.count());
+
+		if (!slot) continue;
+		if (op.type == StressOpType::FREE) {
+			slot->address = nullptr;
+			continue;
+		}
+		if (op.type == StressOpType::RESIZE) CheckAllocation(address, slot->size < op.size ? slot->size : op.size, op.slot, false);
+		slot->address = address;
+		slot->size = op.size;
+		StampAllocation(address, op.size, op.slot);
+	}
+}
+
+// Replay one trace per thread and report throughput, latency percentiles and peak resident growth
+static void RunStress(const char* name, const std::vector<std::vector<StressOp>>& traces, bool use_heap)
+{
+	int num_threads = (int)traces.size();
+	StressRun run(use_heap, num_threads);
+	std::vector<std::vector<double>> thread_latencies(num_threads);
+	std::vector<std::thread> threads;
+
+	size_t resident_before = GetResidentBytes();
+	run.peak_resident = resident_before;
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < num_threads; i++)
+	{
+		threads.emplace_back(ReplayStressTrace, &traces[i], &run, i, &thread_latencies[i]);
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	std::chrono::duration<double> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+	if (use_heap) Heap::GetInstance()->VerifyIntegrity();
+
+	std::vector<double> latencies;
+	for (auto& thread_latency : thread_latencies)
+	{
+		latencies.insert(latencies.end(), thread_latency.begin(), thread_latency.end());
+	}
+	std::sort(latencies.begin(), latencies.end());
+	double mops = latencies.size() / elapsed_time.count() / 1000000.0;
+	size_t peak_growth = run.peak_resident - resident_before;
+	printf("  %-12s %7d  %-9s %8.2f %7.3f %7.3f %9.1f %9.1f\n", name, num_threads, use_heap ? "heap" : "malloc", mops,
+		Percentile(latencies, 0.5), Percentile(latencies, 0.99), latencies.back(), peak_growth / 1048576.0);
+}
+
+// Replay randomized and frame-loop traces over all hints single and multi-threaded, against the heap and against the
+// platform malloc, verifying heap integrity at intervals
+static void RunStressSuite(void)
+{
+	int max_threads = (int)std::thread::hardware_concurrency();
+	if (max_threads > BENCHMARK_STRESS_THREADS) max_threads = BENCHMARK_STRESS_THREADS;
+	if (max_threads < 2) max_threads = 2;
+
+	printf("Stress suite (million operations per second, latency in microseconds, peak resident growth in MB)\n");
+	printf("  workload     threads  allocator   Mops/s     p50     p99       max   peak MB\n");
+	for (int workload = 0; workload < 2; workload++)
+	{
+		for (int num_threads = 1; num_threads <= max_threads; num_threads = num_threads < max_threads ? max_threads : num_threads + 1)
+		{
+			std::vector<std::vector<StressOp>> traces;
+			for (int i = 0; i < num_threads; i++)
+			{
+				unsigned int seed = BENCHMARK_WORKLOAD_SEED + i;
+				traces.push_back(workload == 0 ? GenerateRandomMix(seed) : GenerateFrameTrace(seed));
+			}
+			const char* name = workload == 0 ? "random mix" : "frame trace";
+			RunStress(name, traces, false);
+			RunStress(name, traces, true);
+		}
+	}
+}
+
+//#################################################################################################################################
+// Trace Replay
+//#################################################################################################################################
+
+// Operation of a loaded trace. The addresses of the trace are replaced by slot numbers so that every configuration
+// replays the same allocation lifetimes.
+struct ReplayOp
+{
+	TraceOp      op;
+	New::Hint    hint;
+	unsigned int size;
+	unsigned int slot;
+};
+
+struct LoadedTrace
+{
+	std::vector<ReplayOp> ops;
+	unsigned int num_slots = 0;		// upper limit on live allocations
+	int num_threads = 0;			// threads that made requests while recording
+	size_t unmatched = 0;			// operations on addresses that were not live when the trace was recorded
+};
+
+// Peak footprint observed while replaying a trace. Heap pages are totals, since pages mapped before the replay are
+// reused by it; resident memory is the growth over the replay.
+struct ReplayFootprint
+{
+	size_t peak_page_bytes = 0;		// bytes of pages mapped by all allocators
+	size_t peak_live_bytes = 0;		// bytes allocated when the page bytes peaked
+	size_t peak_resident = 0;		// growth in resident memory of the process
+};
+
+// Read a trace file and assign each allocation a slot; returns false if the file cannot be opened
+static bool LoadTrace(const char* filename, LoadedTrace& trace)
+{
+	FILE* file = fopen(filename, "rb");
+	if (!file) return false;
+	TraceHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord))
+	{
+		fclose(file);
+		throw("heap trace file has an unknown format");
+	}
+	std::vector<TraceRecord> records;
+	TraceRecord record;
+	while (fread(&record, sizeof(record), 1, file) == 1)
+	{
+		records.push_back(record);
+	}
+	fclose(file);
+
+	// Each thread streams its records in blocks, so restore the order in which the operations were made
+	std::stable_sort(records.begin(), records.end(), [](const TraceRecord& a, const TraceRecord& b) { return a.time < b.time; });
+
+	// Map each live address to a slot, reusing the slots of freed addresses
+	std::unordered_map<uint64_t, unsigned int> live;
+	std::vector<unsigned int> free_slots;
+	trace.ops.reserve(records.size());
+	for (const TraceRecord& r : records)
+	{
+		if (r.thread >= trace.num_threads) trace.num_threads = r.thread + 1;
+		ReplayOp op = { r.op, (New::Hint)r.hint, r.size, 0 };
+		uint64_t id = r.id;
+		if (r.op == TraceOp::RESIZE || r.op == TraceOp::RELOCATE || r.op == TraceOp::FREE)
+		{
+			auto it = live.find(r.id);
+			if (it == live.end())
+			{
+				// The allocation was made before recording started; a resize still tells us the new allocation
+				trace.unmatched++;
+				if (r.op != TraceOp::RESIZE) continue;
+				op.op = TraceOp::ALLOCATE;
+				id = r.new_id;
+			}
+			else
+			{
+				op.slot = it->second;
+				live.erase(it);
+				if (r.op == TraceOp::FREE) {
+					free_slots.push_back(op.slot);
+				}
+				else {
+					if (!live.emplace(r.new_id, op.slot).second) trace.unmatched++;
+				}
+				trace.ops.push_back(op);
+				continue;
+			}
+		}
+		if (op.op == TraceOp::ALLOCATE)
+		{
+			if (free_slots.empty()) {
+				op.slot = trace.num_slots++;
+			}
+			else {
+				op.slot = free_slots.back();
+				free_slots.pop_back();
+			}
+			// An address that is still live had a free that was not recorded; its slot is left live
+			auto result = live.emplace(id, op.slot);
+			if (!result.second) {
+				trace.unmatched++;
+				result.first->second = op.slot;
+			}
+		}
+		trace.ops.push_back(op);
+	}
+	return true;
+}
+
+// Add the page and live bytes of every allocator group
+static void GetHeapFootprint(size_t& page_bytes, size_t& live_bytes)
+{
+	HeapStats stats;
+	Heap::GetInstance()->GetStats(stats);
+	const AllocatorStats* groups[] = { &stats.system, &stats.region, &stats.transient, &stats.permanent, &stats.guarded, &stats.pools };
+	page_bytes = 0;
+	live_bytes = 0;
+	for (const AllocatorStats* group : groups)
+	{
+		page_bytes += group->page_bytes;
+		live_bytes += group->live_bytes;
+	}
+}
+
+// Replay a loaded trace against the heap or the platform malloc and return the elapsed time in seconds. If footprint
+// is given then the footprint is sampled at every frame and at intervals, which slows the replay.
+static double RunTrace(const LoadedTrace& trace, bool use_heap, ReplayFootprint* footprint)
+{
+	struct Slot { void* address; unsigned int size; New::Hint hint; };
+	std::vector<Slot> slots(trace.num_slots, { nullptr, 0, New::Hint::DEFAULT });
+	Heap* heap = Heap::GetInstance();
+	size_t resident_base = footprint ? GetResidentBytes() : 0;
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	for (size_t i = 0; i < trace.ops.size(); i++)
+	{
+		const ReplayOp& op = trace.ops[i];
+		Slot& slot = slots[op.slot];
+		switch (op.op)
+		{
+		case TraceOp::ALLOCATE:
+			slot.address = use_heap ? heap->Allocate(op.size, op.hint) : malloc(op.size);
+			slot.size = op.size;
+			slot.hint = op.hint;
+			break;
+		case TraceOp::RESIZE:
+			slot.address = use_heap ? heap->Resize(slot.address, op.size) : realloc(slot.address, op.size);
+			slot.size = op.size;
+			break;
+		case TraceOp::RELOCATE:
+			if (use_heap) {
+				slot.address = heap->Relocate(slot.address);
+			}
+			else {
+				void* address = malloc(slot.size);
+				memcpy(address, slot.address, slot.size);
+				free(slot.address);
+				slot.address = address;
+			}
+			break;
+		case TraceOp::FREE:
+			if (use_heap) heap->Free(slot.address);
+			else free(slot.address);
+			slot.address = nullptr;
+			break;
+		case TraceOp::FRAME:
+			if (use_heap) heap->BeginFrame();
+			break;
+		}
+
+		if (footprint && (op.op == TraceOp::FRAME || i % BENCHMARK_REPLAY_SAMPLE == 0))
+		{
+			if (use_heap)
+			{
+				size_t page_bytes, live_bytes;
+				GetHeapFootprint(page_bytes, live_bytes);
+				if (page_bytes > footprint->peak_page_bytes)
+				{
+					footprint->peak_page_bytes = page_bytes;
+					footprint->peak_live_bytes = live_bytes;
+				}
+			}
+			size_t resident = GetResidentBytes() - resident_base;
+			if (resident > footprint->peak_resident) footprint->peak_resident = resident;
+		}
+	}
+	std::chrono::duration<double> elapsed_time(std::chrono::high_resolution_clock::now() - start_time);
+
+	// Release what the trace left live; transient allocations expire and permanent ones cannot be freed
+	for (Slot& slot : slots)
+	{
+		if (!slot.address) continue;
+		if (!use_heap) free(slot.address);
+		else if (slot.hint != New::Hint::TRANSIENT && slot.hint != New::Hint::PERMANENT) heap->Free(slot.address);
+	}
+	return elapsed_time.count();
+}
+
+// Record the frame loop of the stress suite to a trace file and replay it
+static void BenchmarkTraceReplay(void)
+{
+	Heap* heap = Heap::GetInstance();
+	std::vector<StressOp> trace = GenerateFrameTrace(BENCHMARK_WORKLOAD_SEED);
+	StressRun run(true, 1);
+	std::vector<double> latencies;
+	if (!heap->StartTrace(BENCHMARK_TRACE_FILE)) return;
+	ReplayStressTrace(&trace, &run, 0, &latencies);
+	heap->StopTrace();
+	heap->ReplayTrace(BENCHMARK_TRACE_FILE);
+	remove(BENCHMARK_TRACE_FILE);
+}
+
+// Replay the trace in operation order on the calling thread against each configuration. Time is measured on one pass
+// and the footprint on a second; fragmentation is the fraction of the peak page bytes that was not allocated.
+void Heap::ReplayTrace(const char* filename)
+{
+	LoadedTrace trace;
+	if (!LoadTrace(filename, trace))
+	{
+		printf("Heap: unable to open trace file %s\n", filename);
+		return;
+	}
+
+	struct Configuration { const char* name; bool use_heap; bool thread_cache; bool retention; };
+	static const Configuration configurations[] = {
+		{ "heap",              true,  true,  true  },
+		{ "no thread cache",   true,  false, true  },
+		{ "no page retention", true,  true,  false },
+		{ "malloc",            false, false, false },
+	};
+	bool cache_enabled = thread_cache_enabled;
+	unsigned int max_pages = retain_max_pages;
+
+	printf("Trace replay of %s (%zu operations from %d threads, %zu unmatched)\n", filename, trace.ops.size(), trace.num_threads, trace.unmatched);
+	printf("  configuration          ms   Mops/s   peak MB  frag %%  resident MB\n");
+	for (const Configuration& configuration : configurations)
+	{
+		if (configuration.use_heap)
+		{
+			EnableThreadCache(configuration.thread_cache);
+			SetPageRetention(configuration.retention ? max_pages : 0, retain_idle_frames, retain_idle_milliseconds);
+		}
+		double seconds = RunTrace(trace, configuration.use_heap, nullptr);
+		ReplayFootprint footprint;
+		RunTrace(trace, configuration.use_heap, &footprint);
+
+		printf("  %-18s %8.1f %8.2f ", configuration.name, seconds * 1000.0, trace.ops.size() / seconds / 1000000.0);
+		if (configuration.use_heap)
+		{
+			double fragmentation = footprint.peak_page_bytes ? 1.0 - (double)footprint.peak_live_bytes / footprint.peak_page_bytes : 0.0;
+			printf("%9.1f %6.1f", footprint.peak_page_bytes / 1048576.0, fragmentation * 100.0);
+		}
+		else
+		{
+			printf("%9s %6s", "-", "-");
+		}
+		printf(" %12.1f\n", footprint.peak_resident / 1048576.0);
+	}
+	EnableThreadCache(cache_enabled);
+	SetPageRetention(max_pages, retain_idle_frames, retain_idle_milliseconds);
+}
+
+//#################################################################################################################################
+// Entry Point
+//#################################################################################################################################
+
+void Heap::TestAllocators(void)
+{
+	BenchmarkPoolScaling();
+	BenchmarkProducerConsumer();
+	BenchmarkBatchAllocation();
+	ReportAlignedAllocation();
+	BenchmarkSizedFree();
+	ReportSizePromotion();
+	ReportMemoryTags();
+	ReportIncrementalVerifier(append_sentinel);
+	ReportDefragmentation();
+	BenchmarkContainers();
+	ReportPoolFragmentation();
+	ReportPoolDensity();
+	BenchmarkPoolPages();
+	BenchmarkRegionFragmentation();
+	BenchmarkRegionGrowth();
+	BenchmarkFrameScratch();
+	ReportPageThrash();
+	ReportPageDecommit();
+	ReportHugePageDecommit();
+	BenchmarkLargeCache();
+	BenchmarkProfilerOverhead();
+	ReportGuardedSampling();
+	RunStressSuite();
+	BenchmarkTraceReplay();
+}
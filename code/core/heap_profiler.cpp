@@ -0,0 +1,301 @@
+/* Copyright is waived. No warranty is provided. Unrestricted use and modification is permitted. */
+
+#include "precompiled.h"
+#include <mutex>
+#include <cmath>
+#include <cstdio>
+#include "core/heap_profiler.h"
+#include "core/page_provider.h"
+
+#if defined(_WINDOWS)
+#include <windows.h>
+#include <dbghelp.h>
+#pragma comment(lib, "dbghelp.lib")
+#else
+#include <execinfo.h>
+#include <dlfcn.h>
+#endif
+
+#define PROFILE_SKIP_FRAMES   (2)		// Frames of the profiler itself at the top of a captured stack
+#define PROFILE_NAME_LENGTH   (256)		// Maximum length of a symbol name in a report
+
+//#################################################################################################################################
+// Sample Tables
+//#################################################################################################################################
+
+// Bytes attributed to one call stack. Sampled bytes are scaled to estimate all bytes allocated from the site.
+struct ProfileSite
+{
+	uint64_t hash;							// hash of the frames; 0 marks an unused entry
+	int depth;								// number of frames captured
+	void* frames[PROFILE_STACK_DEPTH];		// return addresses, innermost first
+	size_t live_bytes;						// estimated bytes allocated from the site that are still live
+	size_t total_bytes;						// estimated bytes allocated from the site since sampling was enabled
+	size_t samples;							// number of allocations sampled
+};
+
+// A sampled allocation that has not been freed
+struct ProfileSample
+{
+	void* address;							// nullptr marks an unused entry
+	unsigned int site;						// index of the site that made the allocation
+	size_t weight;							// estimated bytes the sample represents
+};
+
+std::atomic<size_t> HeapProfiler::sample_interval = 0;
+std::atomic<unsigned short> HeapProfiler::filter[PROFILE_FILTER_SIZE];
+thread_local int64_t HeapProfiler::countdown = 0;
+
+static std::mutex profile_mtx;						// guards the site and sample tables
+static ProfileSite* profile_sites = nullptr;		// open addressed by stack hash; mapped from the page provider
+static ProfileSample* profile_samples = nullptr;	// open addressed by address; mapped from the page provider
+static unsigned int num_sites = 0;
+static unsigned int num_samples = 0;
+static size_t dropped_samples = 0;					// samples lost because a table was full
+static thread_local uint64_t random_state = 0;		// state of the thread's random interval generator
+static thread_local bool countdown_started = false;
+
+static unsigned int HashAddress(void* address)
+{
+	return (unsigned int)((((uint64_t)address >> 4) * 0x9E3779B97F4A7C15ull) >> 32) & (PROFILE_MAX_SAMPLES - 1);
+}
+
+// Return a random number of bytes to allocate before the next sample. Intervals are exponentially distributed so
+// that every byte allocated has the same chance of being sampled, whatever the pattern of allocation sizes.
+static int64_t DrawInterval(size_t mean)
+{
+	if (random_state == 0) random_state = (uint64_t)&random_state ^ 0x2545F4914F6CDD1Dull;
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	double uniform = ((random_state >> 11) + 1) * (1.0 / 9007199254740993.0);	// (0, 1]
+	return (int64_t)(-log(uniform) * mean);
+}
+
+static int CaptureStack(void** frames)
+{
+#if defined(_WINDOWS)
+	return CaptureStackBackTrace(PROFILE_SKIP_FRAMES, PROFILE_STACK_DEPTH, frames, nullptr);
+#else
+	void* all_frames[PROFILE_STACK_DEPTH + PROFILE_SKIP_FRAMES];
+	int depth = backtrace(all_frames, PROFILE_STACK_DEPTH + PROFILE_SKIP_FRAMES) - PROFILE_SKIP_FRAMES;
+	if (depth < 0) depth = 0;
+	memcpy(frames, all_frames + PROFILE_SKIP_FRAMES, depth * sizeof(void*));
+	return depth;
+#endif
+}
+
+// Return the site for a call stack, adding it if it is new; returns nullptr if the table is full
+static ProfileSite* FindSite(void** frames, int depth)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (int i = 0; i < depth; i++)
+	{
+		hash = (hash ^ (uint64_t)frames[i]) * 1099511628211ull;
+	}
+	if (hash == 0) hash = 1;
+
+	unsigned int index = (unsigned int)(hash >> 32) & (PROFILE_MAX_SITES - 1);
+	for (;;)
+	{
+		ProfileSite* site = &profile_sites[index];
+		if (site->hash == 0)
+		{
+			if (num_sites >= PROFILE_MAX_SITES * 3 / 4) return nullptr;
+			num_sites++;
+			site->hash = hash;
+			site->depth = depth;
+			memcpy(site->frames, frames, depth * sizeof(void*));
+			return site;
+		}
+		if (site->hash == hash && site->depth == depth && !memcmp(site->frames, frames, depth * sizeof(void*))) return site;
+		index = (index + 1) & (PROFILE_MAX_SITES - 1);
+	}
+}
+
+// Return the entry of a live sample, or nullptr if the address was not sampled
+static ProfileSample* FindSample(void* address)
+{
+	for (unsigned int index = HashAddress(address);; index = (index + 1) & (PROFILE_MAX_SAMPLES - 1))
+	{
+		ProfileSample* sample = &profile_samples[index];
+		if (sample->address == address) return sample;
+		if (sample->address == nullptr) return nullptr;
+	}
+}
+
+// Add a sample; returns false if the table is full
+static bool InsertSample(void* address, unsigned int site, size_t weight)
+{
+	if (num_samples >= PROFILE_MAX_SAMPLES * 3 / 4) return false;
+	unsigned int index = HashAddress(address);
+	while (profile_samples[index].address != nullptr)
+	{
+		index = (index + 1) & (PROFILE_MAX_SAMPLES - 1);
+	}
+	profile_samples[index] = { address, site, weight };
+	num_samples++;
+	return true;
+}
+
+// Remove a sample, moving later entries of its probe sequence back so that no tombstones are needed
+static void RemoveSample(ProfileSample* sample)
+{
+	unsigned int hole = (unsigned int)(sample - profile_samples);
+	unsigned int index = hole;
+	for (;;)
+	{
+		index = (index + 1) & (PROFILE_MAX_SAMPLES - 1);
+		void* address = profile_samples[index].address;
+		if (address == nullptr) break;
+		unsigned int home = HashAddress(address);
+		// Move the entry into the hole unless its home lies cyclically between the hole and the entry
+		if (((index - home) & (PROFILE_MAX_SAMPLES - 1)) >= ((index - hole) & (PROFILE_MAX_SAMPLES - 1)))
+		{
+			profile_samples[hole] = profile_samples[index];
+			hole = index;
+		}
+	}
+	profile_samples[hole].address = nullptr;
+	num_samples--;
+}
+
+// Write the name of the function containing a return address
+static void GetSymbolName(void* frame, char* name, size_t length)
+{
+#if defined(_WINDOWS)
+	static bool symbols_loaded = false;
+	HANDLE process = GetCurrentProcess();
+	if (!symbols_loaded) symbols_loaded = SymInitialize(process, nullptr, TRUE) != FALSE;
+	char buffer[sizeof(SYMBOL_INFO) + PROFILE_NAME_LENGTH];
+	SYMBOL_INFO* symbol = (SYMBOL_INFO*)buffer;
+	symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+	symbol->MaxNameLen = PROFILE_NAME_LENGTH - 1;
+	DWORD64 displacement;
+	if (symbols_loaded && SymFromAddr(process, (DWORD64)frame, &displacement, symbol))
+	{
+		snprintf(name, length, "%s", symbol->Name);
+		return;
+	}
+#else
+	Dl_info info;
+	if (dladdr(frame, &info) && info.dli_sname)
+	{
+		snprintf(name, length, "%s", info.dli_sname);
+		return;
+	}
+#endif
+	snprintf(name, length, "%p", frame);
+}
+
+//#################################################################################################################################
+// Heap Profiler
+//#################################################################################################################################
+
+void HeapProfiler::Enable(size_t sample_bytes)
+{
+	std::lock_guard<std::mutex> lock(profile_mtx);
+	if (sample_bytes && !profile_sites)
+	{
+		// Mapped memory is zeroed so every entry starts unused
+		profile_sites = (ProfileSite*)PageProvider::GetInstance()->Map(PROFILE_MAX_SITES * sizeof(ProfileSite), HugePages::NONE);
+		profile_samples = (ProfileSample*)PageProvider::GetInstance()->Map(PROFILE_MAX_SAMPLES * sizeof(ProfileSample), HugePages::NONE);
+	}
+	sample_interval = sample_bytes;
+}
+
+void HeapProfiler::Sample(void* address, size_t size)
+{
+	size_t interval = sample_interval.load(std::memory_order_relaxed);
+	if (interval == 0) return;
+	countdown = DrawInterval(interval);
+
+	// The first allocation of a thread only starts its countdown
+	if (!countdown_started)
+	{
+		countdown_started = true;
+		return;
+	}
+	if (!address) return;
+
+	// An allocation of size bytes is sampled with probability 1 - e^(-size/interval); dividing by that probability
+	// makes the expected weight of a site equal to the bytes it allocated
+	double probability = 1.0 - exp(-(double)size / interval);
+	size_t weight = (size_t)(size / probability);
+	void* frames[PROFILE_STACK_DEPTH];
+	int depth = CaptureStack(frames);
+
+	std::lock_guard<std::mutex> lock(profile_mtx);
+	ProfileSite* site = FindSite(frames, depth);
+	if (!site || !InsertSample(address, (unsigned int)(site - profile_sites), weight))
+	{
+		dropped_samples++;
+		return;
+	}
+	site->live_bytes += weight;
+	site->total_bytes += weight;
+	site->samples++;
+	filter[GetFilterIndex(address)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void HeapProfiler::Release(void* address)
+{
+	std::lock_guard<std::mutex> lock(profile_mtx);
+	ProfileSample* sample = FindSample(address);
+	if (!sample) return;
+	profile_sites[sample->site].live_bytes -= sample->weight;
+	RemoveSample(sample);
+	filter[GetFilterIndex(address)].fetch_sub(1, std::memory_order_relaxed);
+}
+
+void HeapProfiler::OnMove(void* address, void* new_address)
+{
+	if (address == new_address || filter[GetFilterIndex(address)].load(std::memory_order_relaxed) == 0) return;
+	std::lock_guard<std::mutex> lock(profile_mtx);
+	ProfileSample* sample = FindSample(address);
+	if (!sample) return;
+	unsigned int site = sample->site;
+	size_t weight = sample->weight;
+	RemoveSample(sample);
+	filter[GetFilterIndex(address)].fetch_sub(1, std::memory_order_relaxed);
+	InsertSample(new_address, site, weight);
+	filter[GetFilterIndex(new_address)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void HeapProfiler::WriteReport(FILE* file, bool live)
+{
+	std::lock_guard<std::mutex> lock(profile_mtx);
+	if (!profile_sites) return;
+	char name[PROFILE_NAME_LENGTH];
+	for (unsigned int i = 0; i < PROFILE_MAX_SITES; i++)
+	{
+		const ProfileSite& site = profile_sites[i];
+		size_t bytes = live ? site.live_bytes : site.total_bytes;
+		if (site.hash == 0 || bytes == 0) continue;
+
+		// Folded stacks list the outermost frame first, separated by semicolons, followed by the count
+		for (int frame = site.depth - 1; frame >= 0; frame--)
+		{
+			GetSymbolName(site.frames[frame], name, sizeof(name));
+			fprintf(file, frame > 0 ? "%s;" : "%s", name);
+		}
+		fprintf(file, " %zu\n", bytes);
+	}
+	if (dropped_samples) fprintf(stderr, "HeapProfiler: %zu samples were dropped because the tables were full\n", dropped_samples);
+}
+
+bool HeapProfiler::PrintSite(void* address)
+{
+	if (filter[GetFilterIndex(address)].load(std::memory_order_relaxed) == 0) return false;
+	std::lock_guard<std::mutex> lock(profile_mtx);
+	ProfileSample* sample = FindSample(address);
+	if (!sample) return false;
+	const ProfileSite& site = profile_sites[sample->site];
+	char name[PROFILE_NAME_LENGTH];
+	for (int frame = 0; frame < site.depth; frame++)
+	{
+		GetSymbolName(site.frames[frame], name, sizeof(name));
+		printf("    %s\n", name);
+	}
+	return true;
+}
@@ -0,0 +1,49 @@
+/* Copyright is waived. No warranty is provided. Unrestricted use and modification is permitted. */
+
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+
+#define PROFILE_SAMPLE_BYTES  (512*1024)		// Default mean number of bytes allocated between samples
+#define PROFILE_STACK_DEPTH   (32)				// Maximum number of frames captured for a sample
+#define PROFILE_MAX_SITES     (4096)			// Number of distinct call sites that can be recorded
+#define PROFILE_MAX_SAMPLES   (16384)			// Number of sampled allocations that can be live at once
+#define PROFILE_FILTER_SIZE   (4096)			// Number of counters used to skip frees of allocations that were not sampled
+
+// Samples allocations at random intervals averaging a given number of bytes and attributes them to the call stack
+// that made them. Bytes are aggregated by call site, both for allocations that are still live and cumulatively, and
+// reported as folded stacks that flame graph tools accept.
+class HeapProfiler
+{
+public:
+	static void Enable(size_t sample_bytes);		// 0 disables sampling; samples already taken are kept
+	static bool IsEnabled(void) { return sample_interval.load(std::memory_order_relaxed) != 0; }
+	static size_t GetSampleBytes(void) { return sample_interval.load(std::memory_order_relaxed); }
+	static void WriteReport(FILE* file, bool live);	// live reports bytes still allocated, otherwise all bytes allocated
+	static bool PrintSite(void* address);			// prints the call stack of a sampled allocation, if it was sampled
+
+	// Called by the heap for every allocation and free; both return at once unless the address needs attention
+	static void OnAllocate(void* address, size_t size)
+	{
+		if (!IsEnabled()) return;
+		countdown -= (int64_t)size;
+		if (countdown < 0) Sample(address, size);
+	}
+	static void OnFree(void* address)
+	{
+		if (filter[GetFilterIndex(address)].load(std::memory_order_relaxed) == 0) return;
+		Release(address);
+	}
+	static void OnMove(void* address, void* new_address);	// a resize or relocate moved an allocation
+
+private:
+	static std::atomic<size_t> sample_interval;
+	static std::atomic<unsigned short> filter[PROFILE_FILTER_SIZE];	// count of live samples by address hash
+	static thread_local int64_t countdown;							// bytes the thread allocates before its next sample
+
+	static unsigned int GetFilterIndex(void* address) { return (unsigned int)((((uint64_t)address >> 4) * 0x9E3779B97F4A7C15ull) >> 52); }
+	static void Sample(void* address, size_t size);
+	static void Release(void* address);
+};
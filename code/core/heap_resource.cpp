@@ -0,0 +1,105 @@
+/* Copyright is waived. No warranty is provided. Unrestricted use and modification is permitted. */
+
+#include "precompiled.h"
+#include "core/heap_resource.h"
+
+//#################################################################################################################################
+// Heap Resource
+//#################################################################################################################################
+
+static HeapResource heap_resources[HEAP_HINT_COUNT] = {
+	HeapResource(New::Hint::DEFAULT),
+	HeapResource(New::Hint::PERMANENT),
+	HeapResource(New::Hint::TRANSIENT),
+	HeapResource(New::Hint::POOLABLE),
+};
+
+std::pmr::memory_resource* GetHeapResource(New::Hint hint)
+{
+	return &heap_resources[(int)hint];
+}
+
+void* HeapResource::do_allocate(size_t bytes, size_t alignment)
+{
+	return Heap::GetInstance()->Allocate(bytes, alignment > HEAP_ALIGNMENT ? alignment : HEAP_ALIGNMENT, hint);
+}
+
+// Unaligned allocations are freed with their size, so pool elements are returned without reading their page
+void HeapResource::do_deallocate(void* address, size_t bytes, size_t alignment)
+{
+	if (hint == New::Hint::PERMANENT) return;
+	if (alignment > HEAP_ALIGNMENT) Heap::GetInstance()->Free(address);
+	else Heap::GetInstance()->Free(address, bytes);
+}
+
+bool HeapResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept
+{
+	if (this == &other) return true;
+	const HeapResource* resource = dynamic_cast<const HeapResource*>(&other);
+	return resource && resource->hint == hint;
+}
+
+//#################################################################################################################################
+// Frame Resource
+//#################################################################################################################################
+
+FrameResource::~FrameResource(void)
+{
+	while (chunks)
+	{
+		Chunk* next = chunks->next;
+		Heap::GetInstance()->Free(chunks);
+		chunks = next;
+	}
+}
+
+void FrameResource::Reset(void)
+{
+	current = chunks;
+	offset = sizeof(Chunk);
+	used_bytes = 0;
+}
+
+size_t FrameResource::GetUsedBytes(void) const
+{
+	return current ? used_bytes + offset - sizeof(Chunk) : 0;
+}
+
+void* FrameResource::do_allocate(size_t bytes, size_t alignment)
+{
+	for (;;)
+	{
+		if (current)
+		{
+			size_t start = ((size_t)current + offset + alignment - 1) & ~(alignment - 1);
+			size_t end = start + bytes;
+			if (end <= (size_t)current + current->size)
+			{
+				offset = end - (size_t)current;
+				return (void*)start;
+			}
+		}
+
+		// Move to the next chunk kept from an earlier frame, skipping chunks too small for the allocation
+		Chunk* next = current ? current->next : chunks;
+		if (current) used_bytes += offset - sizeof(Chunk);
+		while (next && next->size < sizeof(Chunk) + alignment + bytes)
+		{
+			current = next;
+			next = next->next;
+		}
+
+		// Otherwise add a chunk to the end of the list, large enough for an allocation bigger than a chunk
+		if (!next)
+		{
+			size_t size = sizeof(Chunk) + alignment + bytes > chunk_size ? sizeof(Chunk) + alignment + bytes : chunk_size;
+			next = (Chunk*)Heap::GetInstance()->Allocate(size, New::Hint::DEFAULT);
+			next->next = nullptr;
+			next->size = size;
+			if (current) current->next = next;
+			else chunks = next;
+		}
+		current = next;
+		offset = sizeof(Chunk);
+	}
+}
@@ -0,0 +1,100 @@
+/* Copyright is waived. No warranty is provided. Unrestricted use and modification is permitted. */
+
+#pragma once
+
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include "core/heap.h"
+
+#define FRAME_RESOURCE_CHUNK_SIZE ((size_t)1<<18)	// Default size of the chunks from which a FrameResource allocates
+
+// Memory resource that allocates from the heap with one hint. Deallocation of PERMANENT memory does nothing. TRANSIENT
+// memory remains valid until the end of the following frame, so containers using it must not be kept longer.
+class HeapResource : public std::pmr::memory_resource
+{
+public:
+	explicit HeapResource(New::Hint hint) : hint(hint) {}
+	New::Hint GetHint(void) const { return hint; }
+
+private:
+	New::Hint hint;
+
+	void* do_allocate(size_t bytes, size_t alignment) override;
+	void  do_deallocate(void* address, size_t bytes, size_t alignment) override;
+	bool  do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+// Return the shared resource of a hint; resources of the same hint compare equal
+std::pmr::memory_resource* GetHeapResource(New::Hint hint);
+
+// Monotonic resource for memory that lives until the end of a frame. Allocations are bumped from chunks and never freed
+// individually; Reset releases them all at once and keeps the chunks for the next frame. The resource is not thread
+// safe, so each thread that builds frame containers uses its own.
+class FrameResource : public std::pmr::memory_resource
+{
+public:
+	explicit FrameResource(size_t chunk_size = FRAME_RESOURCE_CHUNK_SIZE) : chunk_size(chunk_size) {}
+	FrameResource(const FrameResource&) = delete;
+	FrameResource& operator=(const FrameResource&) = delete;
+	~FrameResource(void);
+
+	void   Reset(void);						// invalidates every allocation made since the previous reset
+	size_t GetUsedBytes(void) const;		// bytes bumped since the previous reset, including alignment padding
+
+private:
+	struct Chunk
+	{
+		Chunk* next;						// next chunk in the list, which is kept across resets
+		size_t size;						// bytes of the chunk, including this header
+	};
+
+	size_t chunk_size;
+	Chunk* chunks = nullptr;				// chunks in the order they are used
+	Chunk* current = nullptr;				// chunk from which memory is bumped, or nullptr before the first allocation
+	size_t offset = 0;						// offset of the first free byte in the current chunk
+	size_t used_bytes = 0;					// bytes bumped from chunks before the current one
+
+	void* do_allocate(size_t bytes, size_t alignment) override;
+	void  do_deallocate(void* address, size_t bytes, size_t alignment) override { (address); (bytes); (alignment); }
+	bool  do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+// Standard allocator that allocates from the heap with one hint, for containers whose type names their allocator
+template <class T, New::Hint H>
+class HeapAllocator
+{
+public:
+	typedef T value_type;
+	template <class U> struct rebind { typedef HeapAllocator<U, H> other; };
+
+	HeapAllocator(void) noexcept {}
+	template <class U> HeapAllocator(const HeapAllocator<U, H>&) noexcept {}
+
+	T* allocate(size_t count)
+	{
+		size_t alignment = alignof(T) > HEAP_ALIGNMENT ? alignof(T) : HEAP_ALIGNMENT;
+		return (T*)Heap::GetInstance()->Allocate(count * sizeof(T), alignment, H);
+	}
+	void deallocate(T* address, size_t count)
+	{
+		if (H == New::Hint::PERMANENT) return;
+		if (alignof(T) > HEAP_ALIGNMENT) Heap::GetInstance()->Free(address);
+		else Heap::GetInstance()->Free(address, count * sizeof(T));
+	}
+
+	template <class U> bool operator==(const HeapAllocator<U, H>&) const noexcept { return true; }
+	template <class U> bool operator!=(const HeapAllocator<U, H>&) const noexcept { return false; }
+};
+
+// Allocators for containers built during a frame, and for lookup tables that live for the rest of the program
+template <class T> using TransientHeapAllocator = HeapAllocator<T, New::Hint::TRANSIENT>;
+template <class T> using PermanentHeapAllocator = HeapAllocator<T, New::Hint::PERMANENT>;
+template <class T> using PoolHeapAllocator = HeapAllocator<T, New::Hint::POOLABLE>;
+
+// String allocated with a hint, and a hash for unordered containers keyed by strings of any allocator
+template <New::Hint H> using HeapString = std::basic_string<char, std::char_traits<char>, HeapAllocator<char, H>>;
+struct HeapStringHash
+{
+	template <class S> size_t operator()(const S& s) const { return std::hash<std::string_view>{}(std::string_view(s.data(), s.size())); }
+};
@@ -0,0 +1,153 @@
+/* Copyright is waived. No warranty is provided. Unrestricted use and modification is permitted. */
+
+#include "precompiled.h"
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include "core/heap_trace.h"
+#include "core/page_provider.h"
+
+//#################################################################################################################################
+// Trace Rings
+//#################################################################################################################################
+
+// Records of one thread waiting to be written. The owning thread adds records at the head; whichever thread holds the
+// trace lock writes them from the tail. Rings are mapped from the page provider so that recording does not allocate
+// from the heap being traced.
+struct TraceRing
+{
+	TraceRecord records[TRACE_RING_SIZE];
+	std::atomic<unsigned int> head;		// count of records added
+	std::atomic<unsigned int> tail;		// count of records written
+	uint16_t thread;					// index of the owning thread
+	TraceRing* next;					// pointers for the list of rings
+	TraceRing* prev;
+};
+
+// Owns the ring of a thread; the destructor writes the remaining records when the thread exits
+class TraceThread
+{
+public:
+	~TraceThread(void);
+	TraceRing* GetRing(void);
+
+private:
+	TraceRing* ring = nullptr;
+};
+
+std::atomic<bool> HeapTrace::recording = false;
+static std::mutex trace_mtx;						// guards the trace file and the list of rings
+static FILE* trace_file = nullptr;
+static TraceRing* trace_rings = nullptr;			// rings of all threads that have recorded
+static uint16_t trace_threads = 0;					// number of threads that have recorded
+static std::atomic<int64_t> trace_start = 0;		// time in nanoseconds at which the trace was started
+static thread_local TraceThread trace_thread;
+
+// Return a monotonic time in nanoseconds
+static int64_t GetNanoseconds(void)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Write the pending records of a ring to the trace file; the caller holds trace_mtx
+static void WriteRing(TraceRing* ring)
+{
+	unsigned int head = ring->head.load(std::memory_order_acquire);
+	unsigned int tail = ring->tail.load(std::memory_order_relaxed);
+	while (tail != head)
+	{
+		// Write up to the end of the buffer, then continue from its start
+		unsigned int start = tail % TRACE_RING_SIZE;
+		unsigned int count = head - tail;
+		if (count > TRACE_RING_SIZE - start) count = TRACE_RING_SIZE - start;
+		if (trace_file) fwrite(&ring->records[start], sizeof(TraceRecord), count, trace_file);
+		tail += count;
+	}
+	ring->tail.store(tail, std::memory_order_release);
+}
+
+TraceRing* TraceThread::GetRing(void)
+{
+	if (!ring)
+	{
+		// Mapped memory is zeroed so the ring starts empty
+		ring = (TraceRing*)PageProvider::GetInstance()->Map(sizeof(TraceRing), HugePages::NONE);
+		std::lock_guard<std::mutex> lock(trace_mtx);
+		ring->thread = trace_threads++;
+		ring->prev = nullptr;
+		ring->next = trace_rings;
+		if (trace_rings) trace_rings->prev = ring;
+		trace_rings = ring;
+	}
+	return ring;
+}
+
+TraceThread::~TraceThread(void)
+{
+	if (!ring) return;
+	std::lock_guard<std::mutex> lock(trace_mtx);
+	WriteRing(ring);
+	if (ring->next) ring->next->prev = ring->prev;
+	if (ring->prev) ring->prev->next = ring->next;
+	else trace_rings = ring->next;
+	PageProvider::GetInstance()->Unmap(ring, sizeof(TraceRing));
+	ring = nullptr;
+}
+
+//#################################################################################################################################
+// Trace Recorder
+//#################################################################################################################################
+
+bool HeapTrace::Start(const char* filename)
+{
+	std::lock_guard<std::mutex> lock(trace_mtx);
+	if (trace_file) return false;
+	trace_file = fopen(filename, "wb");
+	if (!trace_file) return false;
+	TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, sizeof(TraceRecord), 0 };
+	fwrite(&header, sizeof(header), 1, trace_file);
+
+	// Discard records left over from an earlier trace
+	for (TraceRing* ring = trace_rings; ring != nullptr; ring = ring->next)
+	{
+		ring->tail.store(ring->head.load(std::memory_order_acquire), std::memory_order_release);
+	}
+	trace_start = GetNanoseconds();
+	recording = true;
+	return true;
+}
+
+void HeapTrace::Stop(void)
+{
+	recording = false;
+	std::lock_guard<std::mutex> lock(trace_mtx);
+	if (!trace_file) return;
+	for (TraceRing* ring = trace_rings; ring != nullptr; ring = ring->next)
+	{
+		WriteRing(ring);
+	}
+	fclose(trace_file);
+	trace_file = nullptr;
+}
+
+void HeapTrace::Record(TraceOp op, void* address, void* new_address, size_t size, New::Hint hint)
+{
+	TraceRing* ring = trace_thread.GetRing();
+	unsigned int head = ring->head.load(std::memory_order_relaxed);
+	if (head - ring->tail.load(std::memory_order_acquire) == TRACE_RING_SIZE)
+	{
+		// The ring is full; stream it to the file
+		std::lock_guard<std::mutex> lock(trace_mtx);
+		WriteRing(ring);
+	}
+
+	TraceRecord& record = ring->records[head % TRACE_RING_SIZE];
+	record.time = (uint64_t)(GetNanoseconds() - trace_start.load(std::memory_order_relaxed));
+	record.id = (uint64_t)address;
+	record.new_id = (uint64_t)new_address;
+	record.size = (uint32_t)size;
+	record.thread = ring->thread;
+	record.op = op;
+	record.hint = (uint8_t)hint;
+	ring->head.store(head + 1, std::memory_order_release);
+}
@@ -0,0 +1,55 @@
+/* Copyright is waived. No warranty is provided. Unrestricted use and modification is permitted. */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include "core/new.h"
+
+#define TRACE_MAGIC     (0x43525448)	// "HTRC"; first word of a trace file
+#define TRACE_VERSION   (1)				// Version of the trace file format
+#define TRACE_RING_SIZE (4096)			// Number of records each thread buffers before streaming them to the file
+
+// Heap operations recorded in a trace
+enum class TraceOp : uint8_t
+{
+	ALLOCATE,		// id is the address returned
+	RESIZE,			// id is the address resized, new_id the address returned
+	RELOCATE,		// id is the address relocated, new_id the address returned
+	FREE,			// id is the address freed
+	FRAME,			// Heap::BeginFrame was called
+};
+
+// Start of a trace file
+struct TraceHeader
+{
+	uint32_t magic;			// TRACE_MAGIC
+	uint32_t version;		// TRACE_VERSION
+	uint32_t record_size;	// sizeof(TraceRecord)
+	uint32_t reserved;
+};
+
+// One heap operation; records of different threads are interleaved in the file in blocks, so a reader orders them by time
+struct TraceRecord
+{
+	uint64_t time;			// nanoseconds since the trace was started
+	uint64_t id;			// address identifying the allocation
+	uint64_t new_id;		// address identifying the allocation after a resize or relocate
+	uint32_t size;			// requested size of an allocate or resize
+	uint16_t thread;		// index of the thread that made the request
+	TraceOp  op;
+	uint8_t  hint;			// New::Hint of an allocate
+};
+
+// Records heap operations into per-thread ring buffers that are streamed to a binary file
+class HeapTrace
+{
+public:
+	static bool Start(const char* filename);
+	static void Stop(void);
+	static bool IsRecording(void) { return recording.load(std::memory_order_relaxed); }
+	static void Record(TraceOp op, void* address, void* new_address, size_t size, New::Hint hint);
+
+private:
+	static std::atomic<bool> recording;
+};
@@ -30,6 +30,32 @@ void* __cdecl operator new[](size_t size, New::Hint hint)
 }
 
 
+_NODISCARD _Ret_notnull_ _Post_writable_byte_size_(__formal(0, parameter0)) _VCRT_ALLOCATOR
+void* __cdecl operator new (size_t size, std::align_val_t alignment)
+{
+	return Heap::GetInstance()->Allocate(size, (size_t)alignment, New::Hint::DEFAULT);
+}
+
+
+_NODISCARD _Ret_notnull_ _Post_writable_byte_size_(__formal(0, parameter0)) _VCRT_ALLOCATOR
+void* __cdecl operator new[](size_t size, std::align_val_t alignment)
+{
+	return Heap::GetInstance()->Allocate(size, (size_t)alignment, New::Hint::DEFAULT);
+}
+
+
+void* __cdecl operator new (size_t size, std::align_val_t alignment, New::Hint hint)
+{
+	return Heap::GetInstance()->Allocate(size, (size_t)alignment, hint);
+}
+
+
+void* __cdecl operator new[](size_t size, std::align_val_t alignment, New::Hint hint)
+{
+	return Heap::GetInstance()->Allocate(size, (size_t)alignment, hint);
+}
+
+
 void* resize(void* address, size_t new_size)
 {
 	if (address) {
@@ -64,6 +90,23 @@ void __cdecl operator delete[](void* address)
 }
 
 
+// Sized delete operators find the pool of a small allocation from its size
+void __cdecl operator delete (void* address, size_t size)
+{
+	if (address) {
+		Heap::GetInstance()->Free(address, size);
+	}
+}
+
+
+void __cdecl operator delete[](void* address, size_t size)
+{
+	if (address) {
+		Heap::GetInstance()->Free(address, size);
+	}
+}
+
+
 // These delete operators execute if there is an exception in new(size_t size, New::Hint hint)
 void __cdecl operator delete (void* address, New::Hint hint)
 {
@@ -81,3 +124,64 @@ void __cdecl operator delete[](void* address, New::Hint hint)
 		Heap::GetInstance()->Free(address);
 	}
 }
+
+
+// Aligned allocations are freed like any other; the alignment is not needed
+void __cdecl operator delete (void* address, std::align_val_t alignment)
+{
+	(alignment);	// unreferenced parameter
+	if (address) {
+		Heap::GetInstance()->Free(address);
+	}
+}
+
+
+void __cdecl operator delete[](void* address, std::align_val_t alignment)
+{
+	(alignment);	// unreferenced parameter
+	if (address) {
+		Heap::GetInstance()->Free(address);
+	}
+}
+
+
+// These delete operators execute if there is an exception in new(size_t size, std::align_val_t alignment, New::Hint hint)
+void __cdecl operator delete (void* address, std::align_val_t alignment, New::Hint hint)
+{
+	(alignment);	// unreferenced parameter
+	(hint);			// unreferenced parameter
+	if (address) {
+		Heap::GetInstance()->Free(address);
+	}
+}
+
+
+void __cdecl operator delete[](void* address, std::align_val_t alignment, New::Hint hint)
+{
+	(alignment);	// unreferenced parameter
+	(hint);			// unreferenced parameter
+	if (address) {
+		Heap::GetInstance()->Free(address);
+	}
+}
+
+
+// Aligned allocations may have been served by a larger size class than their size selects
+void __cdecl operator delete (void* address, size_t size, std::align_val_t alignment)
+{
+	(size);			// unreferenced parameter
+	(alignment);	// unreferenced parameter
+	if (address) {
+		Heap::GetInstance()->Free(address);
+	}
+}
+
+
+void __cdecl operator delete[](void* address, size_t size, std::align_val_t alignment)
+{
+	(size);			// unreferenced parameter
+	(alignment);	// unreferenced parameter
+	if (address) {
+		Heap::GetInstance()->Free(address);
+	}
+}
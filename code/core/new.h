@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include <new>
+
 // Allocation hints
 namespace New
 {
@@ -16,6 +18,8 @@ namespace New
 // Global new operators with hint parameter
 void* __cdecl operator new (size_t size, New::Hint hint);
 void* __cdecl operator new[] (size_t size, New::Hint hint);
+void* __cdecl operator new (size_t size, std::align_val_t alignment, New::Hint hint);
+void* __cdecl operator new[] (size_t size, std::align_val_t alignment, New::Hint hint);
 
 // Global methods to modify memory allocations
 void* resize(void* address, size_t new_size);
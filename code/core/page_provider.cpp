@@ -0,0 +1,157 @@
+/* Copyright is waived. No warranty is provided. Unrestricted use and modification is permitted. */
+
+#include "precompiled.h"
+#include "core/page_provider.h"
+
+#if defined(_WINDOWS)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#if defined(_WINDOWS)
+
+//#################################################################################################################################
+// Windows Page Provider
+//#################################################################################################################################
+
+class SystemPageProvider : public PageProvider
+{
+public:
+	void* Map(size_t size, HugePages huge_pages);
+	void  Unmap(void* address, size_t size);
+	void* Reserve(size_t size);
+	bool  Commit(void* address, size_t size);
+	bool  Decommit(void* address, size_t size);
+};
+
+void* SystemPageProvider::Map(size_t size, HugePages huge_pages)
+{
+	// Large pages require the SeLockMemoryPrivilege; if they cannot be used then map default pages
+	// Windows has no transparent huge pages so that mode maps default pages
+	if (huge_pages == HugePages::EXPLICIT)
+	{
+		size_t large_page_size = GetLargePageMinimum();
+		if (large_page_size && (size % large_page_size) == 0)
+		{
+			void* address = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (address) return address;
+		}
+	}
+	void* address = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!address) throw("out of memory");
+	return address;
+}
+
+void SystemPageProvider::Unmap(void* address, size_t size)
+{
+	(size);		// unreferenced parameter
+	VirtualFree(address, 0, MEM_RELEASE);
+}
+
+void* SystemPageProvider::Reserve(size_t size)
+{
+	return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool SystemPageProvider::Commit(void* address, size_t size)
+{
+	return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+}
+
+// Large pages cannot be decommitted, so this fails for memory mapped with MEM_LARGE_PAGES
+bool SystemPageProvider::Decommit(void* address, size_t size)
+{
+	return VirtualFree(address, size, MEM_DECOMMIT) != 0;
+}
+
+#else
+
+//#################################################################################################################################
+// POSIX Page Provider
+//#################################################################################################################################
+
+class SystemPageProvider : public PageProvider
+{
+public:
+	void* Map(size_t size, HugePages huge_pages);
+	void  Unmap(void* address, size_t size);
+	void* Reserve(size_t size);
+	bool  Commit(void* address, size_t size);
+	bool  Decommit(void* address, size_t size);
+};
+
+void* SystemPageProvider::Map(size_t size, HugePages huge_pages)
+{
+	#if defined(MAP_HUGETLB)
+	// Explicit huge pages come from the pool configured in /proc/sys/vm/nr_hugepages and may be unavailable
+	if (huge_pages == HugePages::EXPLICIT && (size % HUGE_PAGE_SIZE) == 0)
+	{
+		void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (address != MAP_FAILED) return address;
+	}
+	#endif
+
+	#if defined(MADV_HUGEPAGE)
+	// Transparent huge pages can only back huge page aligned memory, so over-map and trim to an aligned range
+	if (huge_pages != HugePages::NONE && (size % HUGE_PAGE_SIZE) == 0)
+	{
+		void* mapping = mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mapping == MAP_FAILED) throw("out of memory");
+		size_t head = (HUGE_PAGE_SIZE - ((size_t)mapping & (HUGE_PAGE_SIZE - 1))) & (HUGE_PAGE_SIZE - 1);
+		void* address = (char*)mapping + head;
+		if (head) munmap(mapping, head);
+		munmap((char*)address + size, HUGE_PAGE_SIZE - head);
+		madvise(address, size, MADV_HUGEPAGE);
+		return address;
+	}
+	#endif
+
+	void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (address == MAP_FAILED) throw("out of memory");
+	return address;
+}
+
+void SystemPageProvider::Unmap(void* address, size_t size)
+{
+	munmap(address, size);
+}
+
+void* SystemPageProvider::Reserve(size_t size)
+{
+	void* address = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return address == MAP_FAILED ? nullptr : address;
+}
+
+bool SystemPageProvider::Commit(void* address, size_t size)
+{
+	return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+bool SystemPageProvider::Decommit(void* address, size_t size)
+{
+	// The range stays reserved and faults when touched, as decommitted memory does on Windows, until it is committed.
+	// Both calls fail with EINVAL on a range of a MAP_HUGETLB mapping that is not aligned to whole huge pages.
+	if (madvise(address, size, MADV_DONTNEED) != 0) return false;
+	return mprotect(address, size, PROT_NONE) == 0;
+}
+
+#endif
+
+//#################################################################################################################################
+// Provider Instance
+//#################################################################################################################################
+
+static PageProvider* page_provider = nullptr;
+
+PageProvider* PageProvider::GetInstance(void)
+{
+	static SystemPageProvider system_page_provider;
+	if (!page_provider) page_provider = &system_page_provider;
+	return page_provider;
+}
+
+void PageProvider::SetInstance(PageProvider* provider)
+{
+	page_provider = provider;
+}
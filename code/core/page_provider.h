@@ -0,0 +1,31 @@
+/* Copyright is waived. No warranty is provided. Unrestricted use and modification is permitted. */
+
+#pragma once
+
+#include <cstdlib>
+
+#define HUGE_PAGE_SIZE ((size_t)1<<21)		// Size of a huge page
+
+// Huge page modes used when mapping memory
+enum class HugePages
+{
+	NONE,			// map with the default system page size
+	TRANSPARENT,	// ask the system to back the mapping with huge pages where it can
+	EXPLICIT,		// map from the system huge page pool, falling back to default pages if it is unavailable
+};
+
+// Source of page memory for the heap allocators
+class PageProvider
+{
+public:
+	virtual ~PageProvider(void) {}
+
+	virtual void* Map(size_t size, HugePages huge_pages) = 0;		// reserve and commit memory
+	virtual void  Unmap(void* address, size_t size) = 0;			// release memory and address space
+	virtual void* Reserve(size_t size) = 0;							// reserve address space without committing memory
+	virtual bool  Commit(void* address, size_t size) = 0;			// commit memory within reserved or decommitted address space
+	virtual bool  Decommit(void* address, size_t size) = 0;			// return memory to the system and keep the address space; false on failure
+
+	static PageProvider* GetInstance(void);
+	static void SetInstance(PageProvider* provider);				// replace the platform provider; call before the first allocation
+};
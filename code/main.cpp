@@ -4,6 +4,7 @@
 
 #include <fstream>
 #include <chrono>
+#include "core/heap_profiler.h"
 #include "core/keyboard.h"
 #include "core/mouse.h"
 #include "core/window.h"
@@ -25,12 +26,33 @@ void OnGraphicsReset(bool is_fullscreen);
 
 int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance, _In_ LPSTR lpCmdLine, _In_ int nCmdShow)
 {
-	(nCmdShow); (hPrevInstance); (lpCmdLine);		// eliminate warning for unreferenced parameters
+	(nCmdShow); (hPrevInstance);		// eliminate warning for unreferenced parameters
 
-	// Configure memory allocators
+	// Configure memory allocators; release builds check a sample of allocations with guard pages instead of all of them
 	Heap::GetInstance()->EnableLeakTracking(true);
+#if defined(_DEBUG)
 	Heap::GetInstance()->EnableSentinel(true);
 	Heap::GetInstance()->EnableFillOnFree(true);
+	Heap::GetInstance()->EnableTransientCheck(true);
+#else
+	Heap::GetInstance()->SetGuardSampling(GUARD_SAMPLE_RATE);
+#endif
+
+	// Replay a heap trace with -replay <file>, or record one of this session with -trace <file>
+	if (strncmp(lpCmdLine, "-replay ", 8) == 0)
+	{
+		Heap::GetInstance()->ReplayTrace(lpCmdLine + 8);
+		return 0;
+	}
+	if (strncmp(lpCmdLine, "-trace ", 7) == 0) Heap::GetInstance()->StartTrace(lpCmdLine + 7);
+
+	// Serve short-lived DEFAULT sizes from pools, starting from the sizes learned by earlier sessions
+	Heap::GetInstance()->LoadPromotionProfile(PROMOTION_PROFILE_FILE);
+	Heap::GetInstance()->EnablePromotion(true);
+
+	// Sample allocations with -profile <file>; the cumulative bytes of each call site are written there on exit
+	const char* profile_file = strncmp(lpCmdLine, "-profile ", 9) == 0 ? lpCmdLine + 9 : nullptr;
+	if (profile_file) Heap::GetInstance()->EnableProfiler(PROFILE_SAMPLE_BYTES);
 
 	// Create application window
 	auto application_name = "dx9-sandbox";
@@ -59,6 +81,11 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 		auto current_time = std::chrono::high_resolution_clock::now();
 		std::chrono::duration<float> elapsed_time(current_time - loop_time);
 		loop_time = current_time;
+		Heap::GetInstance()->BeginFrame();
+#if defined(_DEBUG)
+		// Check a few heap pages each frame so that sentinel damage is found soon after it is done
+		if (!Heap::GetInstance()->VerifyStep()) throw("heap corruption");
+#endif
 		window->Update();
 		EntityManager::GetInstance().UpdateAll(elapsed_time.count());
 		OnWindowRedraw();
@@ -68,6 +95,9 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 	delete plank;
 
 	// Check for leaks on the way out
+	Heap::GetInstance()->StopTrace();
+	if (profile_file) Heap::GetInstance()->WriteProfile(profile_file, false);
+	Heap::GetInstance()->SavePromotionProfile(PROMOTION_PROFILE_FILE);
 	Heap::GetInstance()->ReportLeaks();
 	return 0;
 }
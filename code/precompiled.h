@@ -56,6 +56,7 @@
 
 #include "core/new.h"
 #include "core/heap.h"
+#include "core/heap_resource.h"
 #include "core/keyboard.h"
 #include "core/list.h"
 #include "core/map.h"